@@ -1,8 +1,25 @@
 // bookman.c: Bookstore sales management system.
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
 
 // Book operation flags.
 #define NEW_BOOK (1 << 0)
@@ -11,42 +28,176 @@
 #define UPD_PRICE (1 << 3)
 #define UPD_QUANT (1 << 4)
 #define QRY_BOOK (1 << 5)
+#define SELL_BOOK (1 << 6) // Decrease quantity, quantity holds remaining after.
+#define UPSERT_BOOK (NEW_BOOK | UPD_NAME | UPD_PRICE | UPD_QUANT) // Batches only, add or replace.
 // Book operation return values.
 #define SUCCESS 0
 #define INVALID_ARG -1
 #define BOOK_NONEXIST -2
 #define BOOK_EXIST -3
 #define MAP_INCONSIST -4
+#define IO_FAILED -5
+#define OUT_OF_STOCK -6
+// Command return values.
+#define CMD_DONE 1 // Success, output already written.
+#define CMD_QUIT 2
+// Book storage engines.
+#define ENGINE_LIST 0
+#define ENGINE_COLUMN 1
+
+// Data file formats.
+#define FORMAT_TEXT 0
+#define FORMAT_BINARY 1
+#define FORMAT_PACKED 2
 
 #define DEFAULT_DATA_PATH "books.dat"
+#define IMAGE_MAGIC "bookman2"
+#define IMAGE_VERSION 2
+#define PACK_MAGIC "bookman3"
+#define PACK_VERSION 3
+#define PACK_BLOCK_BOOKS 4096
+#define LZ_HASH_BITS 12
+// Image record flags.
+#define IMGREC_DELETED (1 << 0)
+// Records per page of the image page cache.
+#define PCACHE_PAGE_RECS 256
+#define PCACHE_MIN_FRAMES 4
+#define IO_BUF_SIZE (1 << 20)
+#define OUTBUF_INIT_SIZE 4096
+// Commands between journal commits in batch mode.
+#define BATCH_COMMIT_CMDS 4096
+#define SERVER_INBUF_SIZE (64 * 1024)
+#define SERVER_MAX_EVENTS 256
+#define SERVER_MAX_THREADS 64
+// Interval workers check for shutdown.
+#define SERVER_POLL_MS 100
+#define SHARD_MAX 64
+#define LIMBO_INIT_SIZE 64
+#define SNAP_CHUNK_RECS PCACHE_PAGE_RECS // Image records a snapshot reads at once.
+#define SNAP_PRE_INIT_SIZE 64
+#define LOAD_MAX_THREADS 16
+// Data file bytes per loader thread at least.
+#define LOAD_MIN_CHUNK (1 << 20)
+#define LOAD_MAX_ERRORS 10
+#define JOURNAL_BUF_SIZE (64 * 1024)
+// Journal fsync interval, modifications within are committed together.
+#define JOURNAL_SYNC_MS 10
+// Journal size triggering compaction into a new snapshot.
+#define JOURNAL_COMPACT_SIZE (64 * 1024 * 1024)
+#define LEDGER_BUF_SIZE (64 * 1024)
+#define LEDGER_INIT_SIZE 1024
+#define ROLLUP_INIT_SIZE 2
+#define HOUR_SECS 3600
 #define VERSION "0.0.1"
-#define MAX_CMD_LEN 256
+#define MAX_CMD_LEN 4096
 #define MAX_LISTNAME_LEN 256
+// Characters of catalog names, which name their data files.
+#define CATALOG_NAME_CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-."
 #define MAX_BOOKNAME_LEN 256
-#define MAX_CMD_TOKENS 5
-#define SNMAP_SIZE 10007
+#define MAX_CMD_TOKENS 512
+// Verb lookup table, one slot per verb.
+#define CMD_HASH_SIZE 64
+#define SNMAP_INIT_SIZE 16
+// Grow SN map when load factor reaches 7/8.
+#define SNMAP_LOAD_NUM 7
+#define SNMAP_LOAD_DEN 8
+// Old table slots migrated per SN map modification while growing.
+#define SNMAP_MIGRATE_STEP 16
+#define BSTORE_INIT_SIZE 64
+#define ARENA_CHUNK_SIZE (64 * 1024)
+// Freed arena blocks up to this size are recycled by size class.
+#define ARENA_MAX_CLASS 512
+#define INTERN_STRIPES 64 // Power of 2.
+#define INTERN_INIT_SIZE 256
+#define POOL_SLAB_SIZE 1024
+#define SKIP_MAX_LEVEL 24
+// Secondary indexes.
+#define IDX_PRICE 0
+#define IDX_NAME 1
+#define IDX_QUANT 2
+#define IDX_VALUE 3 // Price times quantity.
+#define IDX_SN 4
+#define IDX_COUNT 5
+// Books per page of a scan in SN order.
+#define SCAN_PAGE_BOOKS 1024
+#define IDXCUR_PAGE_BOOKS 1024 // Listed between letting writers in.
+#define SCAN_END (1ULL << 32)
+#define ALERT_INIT_SIZE 16
+#define TRIGRAM_INIT_SIZE 1024
+#define POSTING_INIT_SIZE 4
+#define ORDER_INIT_SIZE 64
+// Batched operations, grouped into index regions per shard, looked up ahead.
+#define BATCH_INIT_SIZE 1024
+#define BATCH_OPS 4096 // Ops per batch of journal replay and benchmark.
+#define BATCH_REGIONS 1024
+#define BATCH_PREFETCH 8
+// Latency histogram, 16 linear buckets per power of 2.
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+// Command statistics, latency timed for one in 2^STATS_SAMPLE_BITS calls.
+#define CMD_MAX 32
+#define STATS_SAMPLE_BITS 4
+#define STATS_OPS 5
+#define STATS_PROBE_BINS 7
+// SN distributions of benchmark catalogs.
+#define DIST_SEQ 0
+#define DIST_RANDOM 1
+#define DIST_CLUSTER 2
+// Consecutive SNs per cluster, as a power of 2.
+#define BENCH_CLUSTER_BITS 10
+// Timed operations per benchmark phase at most, others are only counted.
+#define BENCH_MAX_SAMPLES (1 << 20)
+#define BENCH_NAME_LEN 16
+
+struct BookNode;
 
+/**
+ * snmap_node_t: Hash map slot, locates the book it indexes.
+ * Members:
+ * row: row of the book in column store.
+ * book: book list entry.
+ */
 typedef struct SNMapNode
 {
     unsigned int sn;
-    struct SNMapNode *next;
+    unsigned int row;
+    struct BookNode *book;
 } snmap_node_t;
 
+/**
+ * snmap_table_t: Robin Hood open addressing table.
+ * meta holds probe distance + 1 of each slot, 0 for empty slots.
+ * size is always a power of 2.
+ */
+typedef struct SNMapTable
+{
+    snmap_node_t *slot;
+    unsigned char *meta;
+    unsigned int size;
+    unsigned int n;
+} snmap_table_t;
+
 /**
  * Hash map to query book by sn.
+ * On growth cur is replaced by a table twice as large and entries of old
+ * are migrated a few slots per modification, so no single command pays
+ * for a full rehash.
  */
 typedef struct SNMap
 {
-    snmap_node_t *map[SNMAP_SIZE];
+    snmap_table_t cur;
+    snmap_table_t old;
+    unsigned int migrate; // Next slot of old to migrate.
 } snmap_t;
 
 /**
- * book_t: Linked list node representing a book entry.
+ * book_t: Doubly linked list node representing a book entry.
  * Members:
  * sn: serial number of a book, unsigned int.
  * name: book name, char pointer.
  * price: book price, unsigned int.
  * quantity: books in stock, unsigned int.
+ * prev, next: neighbours in list, allow unlinking in O(1).
  */
 typedef struct BookNode
 {
@@ -54,808 +205,9495 @@ typedef struct BookNode
     char *name;
     unsigned int price;
     unsigned int quantity;
+    struct BookNode *prev;
     struct BookNode *next;
 } book_t;
 
 /**
- * blist_t: Linked list of books in stock.
+ * arena_chunk_t: Memory chunk of an arena.
  */
-typedef struct BookList
+typedef struct ArenaChunk
 {
-    unsigned int n;
-    char *name;
-    book_t *head;
-    snmap_t *snmap;
-} blist_t;
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} arena_chunk_t;
 
-// Universal functions.
-void error_die(const char *msg);
-int save_data(const blist_t *blist, const char *path);
-int read_data(blist_t *blist, const char *path);
-
-// Data structure functions.
+/**
+ * arena_t: Bump allocator, allocations never move until arena is destroyed.
+ * Freed blocks are kept on per size class free lists for reuse.
+ * Members:
+ * held: bytes allocated from heap.
+ * used: bytes handed out and not freed.
+ */
+typedef struct Arena
+{
+    arena_chunk_t *head;
+    void *free[ARENA_MAX_CLASS / sizeof(void *) + 1];
+    size_t held;
+    size_t used;
+} arena_t;
 
-// SN hash map.
-snmap_t *snmap_create();
-snmap_node_t *snmap_node_create();
-void snmap_destroy(snmap_t *snmap);
-unsigned int sn_hash(unsigned int sn);
-void snmap_append(snmap_t *snmap, unsigned int sn);
-void snmap_remove(snmap_t *snmap, unsigned int sn);
-int snmap_query(snmap_t *snmap, unsigned int sn);
+/**
+ * istr_t: Interned name, shared by all books of every catalog with that
+ * name. Names handed out point at str.
+ */
+typedef struct InternStr
+{
+    struct InternStr *next;
+    unsigned int refs;
+    unsigned int hash;
+    char str[];
+} istr_t;
 
-// Book list.
-book_t *book_create();
-blist_t *blist_create();
-void book_destroy(book_t *book);
-void blist_destroy(blist_t *blist);
-int blist_op(blist_t *blist, book_t *data, int opflag);
+/**
+ * intern_t: Stripe of the name intern table, a chained hash set.
+ * Low bits of the hash pick the stripe, the next ones the bucket. Entries
+ * are allocated from the stripe's arena.
+ */
+typedef struct Intern
+{
+    pthread_mutex_t lock;
+    istr_t **bucket;
+    unsigned int size;
+    unsigned int n;
+    arena_t mem;
+} intern_t;
 
-int main(void)
+/**
+ * pool_slab_t: Slab of fixed size objects.
+ */
+typedef struct PoolSlab
 {
-    // Interactive shell for now.
+    struct PoolSlab *next;
+    char data[];
+} pool_slab_t;
 
-    // TODO: custom path, parse cmdline params.
-    // Print welcome message.
-    printf("\n");
-    printf("Welcome to bookman (%s)\n", VERSION);
-    printf("\n");
+/**
+ * pool_t: Fixed size object allocator.
+ * Objects are carved from slabs of POOL_SLAB_SIZE objects, freed objects
+ * go to a free list.
+ */
+typedef struct Pool
+{
+    pool_slab_t *slabs;
+    void *free;
+    size_t objsize;
+    size_t carved; // Objects carved from head slab.
+    size_t held;
+    size_t n; // Live objects.
+} pool_t;
 
-    // Read data from default save location.
-    blist_t *booklist = blist_create();
-    if (read_data(booklist, DEFAULT_DATA_PATH))
-    {
-        printf("Saved data not found, new data file created\n");
-        printf("\n");
-    }
+/**
+ * bstore_t: Columnar book store.
+ * Every field lives in its own dense array indexed by row, names are
+ * interned. Deleting moves the last row into the hole.
+ */
+typedef struct BookStore
+{
+    unsigned int n;
+    unsigned int size;
+    unsigned int *sn;
+    unsigned int *price;
+    unsigned int *quantity;
+    char **name;
+} bstore_t;
 
-    printf("Input help for help\n");
-    printf("\n");
+/**
+ * imghdr_t: Header of binary data file.
+ * A binary data file holds, in native byte order, the header, an array of
+ * n records, an open addressing SN index of idxsize slots and a blob of
+ * NUL terminated names.
+ */
+typedef struct ImageHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int n;
+    unsigned int idxsize;
+    unsigned int listname; // Offset of list name in name blob.
+    unsigned long long recoff;
+    unsigned long long idxoff;
+    unsigned long long nameoff;
+    unsigned long long namelen;
+} imghdr_t;
 
-    // Interactive loop.
-    char buf[MAX_CMD_LEN + 1];
-    char *cmd[MAX_CMD_TOKENS + 1];
-    int ntoken;
-    char *token;
-    char exit = 0;
-    while (1)
-    {
-        // Read command.
-        printf("(%s)> ", booklist->name);
-        if (fgets(buf, sizeof(buf), stdin) == NULL)
-        {
-            error_die("Error reading command");
-        }
-        // Null terminate.
-        buf[strcspn(buf, "\n")] = '\0';
-        // Parse command.
-        ntoken = 0;
-        token = strtok(buf, " ");
-        exit = 0;
-        // Seperate command into tokens.
-        while (token != NULL)
-        {
-            cmd[ntoken] = token;
-            ntoken++;
-            token = strtok(NULL, " ");
-        }
-        // Determine command.
-        if (strcmp(cmd[0], "help") == 0)
-        {
-            // Print help message.
-            printf("\nHelp:\n\n");
+/**
+ * imgrec_t: Fixed width book record of binary data file.
+ */
+typedef struct ImageRecord
+{
+    unsigned int sn;
+    unsigned int price;
+    unsigned int quantity;
+    unsigned int flags;
+    unsigned int name; // Offset of name in name blob.
+    unsigned int namelen;
+} imgrec_t;
 
-            printf("  Modification\n");
-            printf("   add [SN] [NAME] [PRICE] [QUANTITY]        add a new entry\n");
-            printf("   del [SN]                                  delete an entry\n");
-            printf("   mod [name|price|quantity] [SN] [VALUE]    modify specified property of an entry\n");
-            printf("   modall [SN] [NAME] [PRICE] [QUANTITY]     modify all properties of an entry\n\n");
+/**
+ * imgslot_t: SN index slot of binary data file, linear probing by sn_hash.
+ * rec is record index + 1, 0 for empty slots.
+ */
+typedef struct ImageSlot
+{
+    unsigned int sn;
+    unsigned int rec;
+} imgslot_t;
 
-            printf("  Query\n");
-            printf("   query [name|price|quantity] [SN]          query specified property of an entry\n");
-            printf("   query all [SN]                            query all properties of an entry\n");
-            printf("   queryall                                  query all properties of all entries\n");
-            printf("   sort [name|price] [a|d]                   sort entries by name|price in acsending|decsending order\n\n");
+/**
+ * pframe_t: Frame of the page cache.
+ * Members:
+ * page: page held, UINT_MAX if empty.
+ * ref: used since the clock hand last passed.
+ */
+typedef struct PageFrame
+{
+    unsigned int page;
+    int ref;
+    int dirty;
+} pframe_t;
 
-            printf("  Transaction\n");
-            printf("   sell [SN] [QUANTITY]                      sell specified quantity of specified entry\n\n");
+/**
+ * pcache_t: Bounded cache of the record pages of a binary data file.
+ * Missing pages are read with pread into the frame the clock hand picks.
+ * The journal replays against the data file, so modified pages never go
+ * back to it: they are written to an unlinked scratch file on eviction and
+ * read back from there.
+ */
+typedef struct PageCache
+{
+    pthread_mutex_t lock;
+    int fd;
+    int swapfd; // Scratch file.
+    unsigned long long off; // File offset of first record.
+    unsigned int n; // Records.
+    unsigned int npages;
+    unsigned int nframes;
+    unsigned int hand;
+    char *mem;
+    pframe_t *frame;
+    unsigned int *where; // Frame of each page + 1, 0 if not cached.
+    unsigned char *swapped; // Latest copy of page is in scratch file.
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long writebacks;
+} pcache_t;
 
-            printf("  Save & Exit\n");
-            printf("   write                                     save modified data to file\n");
-            printf("   quit                                      exit without saving\n\n");
+/**
+ * mapimg_t: Binary data file mapped copy-on-write into memory.
+ * Price and quantity updates and deletions are applied to the records in
+ * place and never reach the file, other changes move the record to the in
+ * memory engine. With a page cache, only the header and SN index are read
+ * into memory, names are mapped read only and records are paged through
+ * cache. Records are copied in and out by img_read and img_store.
+ */
+typedef struct MappedImage
+{
+    char *base;
+    size_t size;
+    const imghdr_t *hdr;
+    imgrec_t *rec; // NULL with page cache.
+    const imgslot_t *idx;
+    const char *names;
+    unsigned int live; // Records not deleted.
+    pcache_t *cache;
+    imghdr_t head; // Header read with page cache.
+} mapimg_t;
 
-            printf("  Misc\n");
-            printf("   help                                      print help message\n\n");
-        }
-        else if (strcmp(cmd[0], "add") == 0) // Add book.
-        {
-            if (ntoken != 5)
-            {
-                printf("Invalid command\n");
-                continue;
-            }
-            // Add new book.
-            book_t newbook;
-            newbook.name = cmd[2];
+/**
+ * packhdr_t: Header of packed data file.
+ * A packed data file holds, in native byte order, the header, namelen
+ * bytes of list name and nblocks blocks of up to PACK_BLOCK_BOOKS books in
+ * ascending SN order. crc covers header and list name.
+ */
+typedef struct PackHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int nblocks;
+    unsigned int n;
+    unsigned int namelen;
+    unsigned int crc;
+    unsigned int pad;
+} packhdr_t;
 
-            if (sscanf(cmd[1], "%d", &newbook.sn) <= 0)
-            {
-                printf("Invalid command\n");
-                continue;
-            }
-            if (sscanf(cmd[3], "%d", &newbook.price) <= 0)
-            {
-                printf("Invalid command\n");
-                continue;
-            }
-            if (sscanf(cmd[4], "%d", &newbook.quantity) <= 0)
-            {
-                printf("Invalid command\n");
-                continue;
-            }
-            int opres = 0;
-            opres = blist_op(booklist, &newbook, NEW_BOOK);
-            // Check result.
-            if (opres < 0)
-            {
-                if (opres == BOOK_EXIST)
-                {
-                    printf("Book with same SN already exists\n");
-                    continue;
-                }
-                else if (opres == INVALID_ARG)
-                {
-                    printf("Invalid command\n");
-                    continue;
-                }
-                else if (opres == MAP_INCONSIST)
-                {
-                    printf("Internal error\n");
-                    continue;
-                }
-                else
-                {
-                    printf("Unknown error\n");
-                    continue;
-                }
-            }
-            else
-            {
-                printf("Success\n");
-            }
-        }
-        else if (strcmp(cmd[0], "del") == 0) // Delete book.
-        {
-            if (ntoken != 2)
-            {
-                printf("Invalid command\n");
-                continue;
-            }
-            book_t delbook;
-            if (sscanf(cmd[1], "%d", &delbook.sn) <= 0)
-            {
-                printf("Invalid command\n");
-                continue;
-            }
-            int opres = 0;
-            opres = blist_op(booklist, &delbook, DEL_BOOK);
-            // Check result.
-            if (opres < 0)
-            {
-                if (opres == BOOK_NONEXIST)
-                {
-                    printf("Book doesn't exist\n");
-                    continue;
-                }
-                else if (opres == INVALID_ARG)
-                {
-                    printf("Invalid command\n");
-                    continue;
-                }
-                else if (opres == MAP_INCONSIST)
-                {
-                    printf("Internal error\n");
-                    continue;
-                }
-                else
-                {
-                    printf("Unknown error\n");
-                    continue;
-                }
-            }
-            else
-            {
-                printf("Success\n");
-            }
-        }
-        else if (strcmp(cmd[0], "mod") == 0)
-        {
-            if (ntoken != 4)
-            {
-                printf("Invalid command\n");
-                continue;
-            }
-            book_t modbook;
-            if (sscanf(cmd[2], "%d", &modbook.sn) <= 0)
-            {
-                printf("Invalid command\n");
-                continue;
-            }
-            int opflag;
-            if (strcmp(cmd[1], "name") == 0)
-            {
-                opflag = UPD_NAME;
-                modbook.name = cmd[3];
-            }
-            else if (strcmp(cmd[1], "price") == 0)
-            {
-                opflag = UPD_PRICE;
-                if (sscanf(cmd[3], "%d", &modbook.price) <= 0)
-                {
-                    printf("Invalid command\n");
-                    continue;
-                }
-            }
-            else if (strcmp(cmd[1], "quantity") == 0)
-            {
-                opflag = UPD_QUANT;
-                if (sscanf(cmd[3], "%d", &modbook.quantity) <= 0)
-                {
-                    printf("Invalid command\n");
-                    continue;
-                }
-            }
-            else
-            {
-                printf("Invalid command\n");
-                continue;
-            }
-            int opres = 0;
-            opres = blist_op(booklist, &modbook, opflag);
-            // Check result.
-            if (opres < 0)
-            {
-                if (opres == BOOK_NONEXIST)
-                {
-                    printf("Book doesn't exist\n");
-                    continue;
-                }
-                else if (opres == INVALID_ARG)
-                {
-                    printf("Invalid command\n");
-                    continue;
-                }
-                else if (opres == MAP_INCONSIST)
-                {
-                    printf("Internal error\n");
-                    continue;
-                }
-                else
-                {
-                    printf("Unknown error\n");
-                    continue;
-                }
-            }
-            else
-            {
-                printf("Success\n");
-            }
-        }
-        else if (strcmp(cmd[0], "modall") == 0)
-        {
-            if (ntoken != 5)
-            {
-                printf("Invalid command\n");
-                continue;
-            }
-            book_t modbook;
-            if (sscanf(cmd[1], "%d", &modbook.sn) <= 0)
-            {
-                printf("Invalid command\n");
-                continue;
-            }
-            int opflag;
-            opflag = UPD_NAME | UPD_PRICE | UPD_QUANT;
+/**
+ * packblk_t: Header of a packed block, followed by size bytes of payload.
+ * The payload holds SNs as varint deltas, prices and quantities each as
+ * varint base and bit-packed offsets, and names front coded against the
+ * previous name as varint prefix and suffix lengths and suffix bytes. crc
+ * covers payload, then the header up to crc.
+ * Members:
+ * namebytes: length of all names decoded.
+ */
+typedef struct PackBlock
+{
+    unsigned int n;
+    unsigned int size;
+    unsigned int namebytes;
+    unsigned int first; // First and last SN.
+    unsigned int last;
+    unsigned int crc;
+} packblk_t;
 
-            modbook.name = cmd[2];
+/**
+ * packer_t: Books of a packed save, encoded a block per task.
+ */
+typedef struct Packer
+{
+    const struct LoadRecord *rec;
+    unsigned int n;
+    unsigned int nblocks;
+    unsigned int next; // Next block to encode.
+    unsigned char **block; // Header and payload of each block.
+} packer_t;
 
-            if (sscanf(cmd[3], "%d", &modbook.price) <= 0)
-            {
-                printf("Invalid command\n");
-                continue;
-            }
+/**
+ * jentry_t: Journal entry, followed by namelen bytes of name.
+ * Entries carry absolute values, so replaying entries already contained
+ * in a snapshot leaves it unchanged.
+ */
+typedef struct JournalEntry
+{
+    unsigned int sum; // Checksum of rest of entry and name.
+    unsigned short opflag;
+    unsigned short namelen;
+    unsigned int sn;
+    unsigned int price;
+    unsigned int quantity;
+} jentry_t;
 
-            if (sscanf(cmd[4], "%d", &modbook.quantity) <= 0)
-            {
-                printf("Invalid command\n");
-                continue;
-            }
+/**
+ * journal_t: Append-only log of list modifications since last snapshot.
+ * Entries are buffered and written after every command, a syncer thread
+ * fsyncs them in groups every JOURNAL_SYNC_MS, or at once for committers
+ * waiting on synced to pass what they wrote. Once the journal grows past
+ * JOURNAL_COMPACT_SIZE it is renamed to oldpath and a thread writes a
+ * snapshot taken right after, while modifications go to a fresh journal.
+ * buflock guards the buffer and file, so shards may log concurrently.
+ */
+typedef struct Journal
+{
+    int fd;
+    char *datapath;
+    char *path;
+    char *oldpath;
+    char *buf;
+    size_t used;
+    unsigned long long size;
+    struct SaveTask *compactor; // Snapshot writer, NULL for none.
+    int saving; // Save in progress, compaction waits.
+    int ledgerfd; // Synced along with journal, -1 for none.
+    pthread_t syncer;
+    pthread_mutex_t buflock;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t synccond; // Signalled when synced advances.
+    int dirty; // Written since last fsync.
+    unsigned long long written; // Bytes written since open.
+    unsigned long long synced; // Bytes of written on disk.
+    unsigned int waiters; // Committers waiting for fsync.
+    int stop;
+} journal_t;
 
-            int opres = 0;
-            opres = blist_op(booklist, &modbook, opflag);
-            // Check result.
-            if (opres < 0)
-            {
-                if (opres == BOOK_NONEXIST)
-                {
-                    printf("Book doesn't exist\n");
-                    continue;
-                }
-                else if (opres == INVALID_ARG)
-                {
-                    printf("Invalid command\n");
-                    continue;
-                }
-                else if (opres == MAP_INCONSIST)
-                {
-                    printf("Internal error\n");
-                    continue;
-                }
-                else
-                {
-                    printf("Unknown error\n");
-                    continue;
-                }
-            }
-            else
-            {
-                printf("Success\n");
-            }
-        }
-    }
-}
+/**
+ * salerec_t: Sales ledger record.
+ * Members:
+ * price: unit price at time of sale.
+ * time: seconds since epoch.
+ */
+typedef struct SaleRecord
+{
+    unsigned int sn;
+    unsigned int quantity;
+    unsigned int price;
+    unsigned int time;
+} salerec_t;
 
-void error_die(const char *msg)
+/**
+ * rollpt_t: Rollup point, totals of all sales up to and including hour.
+ */
+typedef struct RollupPoint
 {
-    fprintf(stderr, "Fatal error: %s\n", msg);
-    exit(EXIT_FAILURE);
-}
+    unsigned int hour; // Hours since epoch.
+    unsigned long long units;
+    unsigned long long revenue;
+} rollpt_t;
+
+/**
+ * rollup_t: Running sales totals, one point per hour with sales.
+ * Points are in hour order, so totals of any range of hours take two
+ * binary searches.
+ */
+typedef struct Rollup
+{
+    rollpt_t *pt;
+    unsigned int n;
+    unsigned int size;
+} rollup_t;
+
+/**
+ * salebook_t: Rollup of one SN, empty slots have no points.
+ */
+typedef struct SaleBook
+{
+    unsigned int sn;
+    rollup_t roll;
+} salebook_t;
+
+/**
+ * ledger_t: Append-only sales history and its rollups.
+ * Records are buffered and written along with the journal, the file is
+ * replayed into the rollups on open. Rollups of books are kept after a
+ * book is deleted. lock guards all members, sells of all shards take it.
+ */
+typedef struct Ledger
+{
+    int fd;
+    char *buf;
+    size_t used;
+    unsigned int last; // Time of latest record.
+    rollup_t all;
+    salebook_t *book; // Open addressing table by SN.
+    unsigned int nbook;
+    unsigned int size;
+    pthread_mutex_t lock;
+} ledger_t;
+
+/**
+ * skipnode_t: Skip list node, ordered by key then sn.
+ * prev links level 0 backwards for descending scans.
+ */
+typedef struct SkipNode
+{
+    unsigned long long num; // Numeric key.
+    const char *str; // String key, points to name of indexed book.
+    unsigned int sn;
+    unsigned int level;
+    struct SkipNode *prev;
+    struct SkipNode *next[];
+} skipnode_t;
+
+/**
+ * skiplist_t: Ordered secondary index of a list.
+ * Nodes live in an arena owned by the index.
+ */
+typedef struct SkipList
+{
+    int type; // IDX_*
+    skipnode_t *head; // Sentinel.
+    skipnode_t *tail;
+    unsigned int level;
+    unsigned int n;
+    unsigned int seed;
+    arena_t nodes;
+} skiplist_t;
+
+/**
+ * posting_t: Sorted SNs of books whose name contains trigram key.
+ */
+typedef struct Posting
+{
+    unsigned int key; // 0 if slot empty.
+    unsigned int n;
+    unsigned int size;
+    unsigned int *sn;
+} posting_t;
+
+/**
+ * trigram_t: Trigram inverted index over book names.
+ * Open addressing on the three name bytes packed into key.
+ */
+typedef struct Trigram
+{
+    posting_t *slot;
+    unsigned int size;
+    unsigned int n;
+} trigram_t;
+
+/**
+ * orderline_t: Line of a basket sold by blist_order.
+ */
+typedef struct OrderLine
+{
+    unsigned int sn;
+    unsigned int quantity;
+    unsigned int left; // Quantity in stock after line.
+    unsigned int price; // Unit price sold at.
+    int res;
+} orderline_t;
+
+/**
+ * batchop_t: Operation of a batch applied by blist_batch.
+ * Members:
+ * data: book data, updated as blist_op does.
+ * opflag: operation, UPSERT_BOOK replaces the book or adds it.
+ * res: result of operation.
+ */
+typedef struct BatchOp
+{
+    book_t data;
+    int opflag;
+    int res;
+} batchop_t;
+
+/**
+ * feed_t: Feed file of import, read a chunk of operations at a time.
+ * Members:
+ * op: operations of the last chunk, names of upserts live in names.
+ * n: operations in the last chunk, 0 at end of file.
+ * size: operations op and names have room for.
+ */
+typedef struct Feed
+{
+    FILE *file;
+    batchop_t *op;
+    char *names;
+    unsigned int n;
+    unsigned int size;
+} feed_t;
+
+/**
+ * batchundo_t: Book before an operation of an atomic batch.
+ * Members:
+ * opflag: operation as applied, 0 if not applied.
+ * before: book before operation, name held in intern table.
+ */
+typedef struct BatchUndo
+{
+    int opflag;
+    book_t before;
+} batchundo_t;
+
+/**
+ * alert_t: Book whose quantity fell below the watch threshold.
+ */
+typedef struct Alert
+{
+    unsigned int sn;
+    unsigned int quantity;
+} alert_t;
+
+/**
+ * limbo_t: Name retired while snapshots were open, freed once every
+ * snapshot taken at or before epoch is released.
+ */
+typedef struct Limbo
+{
+    char *name;
+    unsigned long long epoch;
+} limbo_t;
+
+/**
+ * snaprec_t: Book as seen by a snapshot.
+ */
+typedef struct SnapRecord
+{
+    unsigned int sn;
+    unsigned int price;
+    unsigned int quantity;
+    const char *name; // Kept alive by epoch.
+} snaprec_t;
+
+/**
+ * snapimg_t: Image record as a snapshot saw it, kept once overwritten.
+ * Open addressing by sn_hash of idx, idx is record index + 1, 0 for empty
+ * slots.
+ */
+typedef struct SnapImage
+{
+    unsigned int idx;
+    imgrec_t rec;
+} snapimg_t;
+
+/**
+ * snap_t: Point-in-time view of a list, one part per shard.
+ * Engine records are copied shard by shard, names stay in list storage and
+ * are only retired into limbo while the snapshot is open. Image records
+ * are not copied: once the part of their shard is taken, records keep
+ * their old contents in pre when first overwritten.
+ * Members:
+ * books: books of each part, image ones included.
+ * taken: part copied, set under the shard lock.
+ * pre: overwritten image records, under snaplock of the list.
+ */
+typedef struct Snapshot
+{
+    unsigned long long epoch;
+    unsigned int nparts;
+    snaprec_t *rec[SHARD_MAX];
+    unsigned int n[SHARD_MAX];
+    unsigned int books[SHARD_MAX];
+    int taken[SHARD_MAX];
+    struct BookList *blist;
+    mapimg_t *img;
+    snapimg_t *pre;
+    unsigned int npre;
+    unsigned int presize;
+    struct Snapshot *prev;
+    struct Snapshot *next;
+} snap_t;
+
+/**
+ * savetask_t: Snapshot saved to the data file, in a thread of its own for
+ * background saves and journal compaction.
+ * Members:
+ * format: format saved in, the list's format once saved.
+ * res: result of save_data, set once done.
+ * done: set when the thread finished, it is joined by the next save.
+ */
+typedef struct SaveTask
+{
+    struct BookList *blist;
+    snap_t *snap;
+    int format;
+    int res;
+    int done;
+    pthread_t thread;
+} savetask_t;
+
+/**
+ * blist_t: List of books in stock.
+ * Books are kept in a linked list from head with ENGINE_LIST, or in a
+ * column store with ENGINE_COLUMN. List entries are allocated from pools
+ * owned by the list, names are shared through the intern table. Books
+ * loaded from a binary data file stay in the mapped image img until
+ * modified. Secondary indexes are built on first use and then maintained
+ * on every modification. While a quantity watch is set, books crossing
+ * below the threshold are queued in alert until a front end prints them.
+ * A list partitioned by blist_shard routes each book by SN hash to one of
+ * its shards, each a list with its own engine, indexes and lock. The parent
+ * keeps the mapped image, journal and data file.
+ * Snapshots are registered with the top list, which advances epoch for
+ * each. Lists retire names into limbo instead of freeing them while any
+ * snapshot is open. Background saves write a snapshot from their own
+ * thread, autosave starts them after enough modifications or time.
+ */
+typedef struct BookList
+{
+    unsigned int n;
+    char *name;
+    int engine;
+    int format; // Format of data file.
+    mapimg_t *img;
+    size_t pagecache; // Page cache bytes for a binary data file, 0 maps it whole.
+    book_t *head;
+    bstore_t *store;
+    snmap_t *snmap;
+    pool_t books; // Book list entries, names are interned.
+    journal_t *jnl;
+    ledger_t *ledger; // Sales history, top list only.
+    char *path; // Data file.
+    skiplist_t *index[IDX_COUNT];
+    trigram_t *trigram;
+    int watch;
+    unsigned int threshold; // Watch quantity below.
+    alert_t *alert;
+    unsigned int nalert;
+    unsigned int alertsize;
+    struct BookList **shard; // NULL unless partitioned.
+    unsigned int nshards;
+    struct BookList *parent; // Owner of a shard.
+    unsigned int id; // Index of a shard.
+    pthread_mutex_t lock; // Held while a shard is used.
+    snap_t *snaps; // Open snapshots, newest first.
+    unsigned int nsnaps;
+    unsigned long long epoch;
+    unsigned long long oldest; // Epoch of oldest open snapshot.
+    pthread_mutex_t snaplock;
+    pthread_rwlock_t gate; // Read by changes to several shards, written while a snapshot is taken.
+    pthread_mutex_t savelock; // Held by write.
+    savetask_t *bgsave; // Background save not joined yet, under savelock.
+    unsigned long long nmods; // Modifications since load.
+    unsigned long long savedmods; // Modifications when last save started.
+    unsigned long long savedat; // Clock when last save started.
+    unsigned int autosave; // Save after this many modifications, 0 for never.
+    unsigned int autosecs; // Save this long after last save if modified, 0 for never.
+    limbo_t *limbo;
+    unsigned int nlimbo;
+    unsigned int limbosize;
+} blist_t;
+
+/**
+ * catalog_t: Named book list of the process, kept in data file path.
+ * Loaded on first use and evicted again while no session uses it.
+ * Members:
+ * blist: NULL while not loaded.
+ * refs: sessions using the catalog, which keep it loaded.
+ * used: registry clock at last use, least recently used is evicted first.
+ * held: bytes held by the list when loaded or last released.
+ * busy: loaded or unloaded with the registry unlocked, sessions acquiring
+ * the catalog wait on cond until it is done.
+ */
+typedef struct Catalog
+{
+    char *name;
+    char *path;
+    blist_t *blist;
+    unsigned int refs;
+    unsigned long long used;
+    size_t held;
+    int busy;
+    pthread_cond_t cond;
+    struct Catalog *next;
+} catalog_t;
+
+/**
+ * catalogs_t: Registry of the catalogs in the directory of the default one.
+ * Settings apply to every catalog loaded. Reference counts and catalog
+ * states are serialized by lock, which is dropped while a catalog is
+ * loaded from or saved to its file.
+ */
+typedef struct Catalogs
+{
+    catalog_t *head;
+    catalog_t *dflt; // Used by new sessions.
+    char *dir;
+    int engine;
+    int nthreads; // Loader threads.
+    unsigned int nshards;
+    int journal;
+    size_t pagecache;
+    int verbose; // Report loads to interactive users.
+    size_t budget; // Bytes held by loaded catalogs and names, 0 for no limit.
+    unsigned long long clock;
+    pthread_mutex_t lock;
+    char *statspath; // Periodic stats dump.
+    unsigned long long statsperiod; // In nanoseconds.
+    unsigned long long statsnext;
+    unsigned int autosave; // Autosave policy of loaded catalogs.
+    unsigned int autosecs;
+    unsigned long long savenext; // Next check of idle catalogs.
+} catalogs_t;
+
+/**
+ * session_t: Catalog in use by a front end or client connection.
+ */
+typedef struct Session
+{
+    catalogs_t *cats;
+    catalog_t *cur; // Loaded while in use.
+} session_t;
+
+/**
+ * outbuf_t: Growable output buffer of a front end.
+ * Output is flushed to fd, or kept for the caller if fd is -1.
+ */
+typedef struct OutBuf
+{
+    char *data;
+    size_t used;
+    size_t size;
+    int fd;
+} outbuf_t;
+
+/**
+ * command_t: Command verb and its handler.
+ * Members:
+ * whole: handler runs with every shard locked.
+ * sessfn: handler of the session itself, run instead of fn.
+ */
+typedef struct Command
+{
+    const char *verb;
+    int (*fn)(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+    int whole;
+    int (*sessfn)(session_t *session, char **cmd, int ntoken, outbuf_t *out);
+} command_t;
+
+/**
+ * hist_t: Log-linear histogram of latencies in nanoseconds.
+ * Buckets below 2^HIST_SUB_BITS hold one value each, every further power
+ * of 2 is split into 2^HIST_SUB_BITS buckets, so values are kept to
+ * within about 6%.
+ */
+typedef struct Histogram
+{
+    unsigned long long count;
+    unsigned long long bucket[HIST_BUCKETS];
+} hist_t;
+
+/**
+ * stats_t: Command and book operation counters of one thread.
+ * Only the owning thread updates its counters, readers add up the counters
+ * of all threads.
+ * Members:
+ * calls, failed, latency: per entry of commands, latency sampled.
+ * ops: book operations by kind, see stats_op.
+ */
+typedef struct Stats
+{
+    unsigned long long calls[CMD_MAX];
+    unsigned long long failed[CMD_MAX];
+    hist_t latency[CMD_MAX];
+    unsigned long long ops[STATS_OPS];
+    unsigned long long opfail;
+    struct Stats *next;
+} stats_t;
+
+/**
+ * bench_t: Benchmark catalog and its settings.
+ * Members:
+ * sn: SNs of catalog in insertion order.
+ * rng: xorshift state picking books at random.
+ */
+typedef struct Bench
+{
+    blist_t *blist;
+    int engine;
+    unsigned int nshards;
+    int dist;
+    unsigned int namelen;
+    unsigned int n;
+    unsigned int *sn;
+    unsigned long long rng;
+    const char *path; // Scratch data file.
+    int nthreads;
+} bench_t;
+
+/**
+ * conn_t: Client connection of the server.
+ * Requests wait in in until their line is complete, responses wait in out
+ * until the socket takes them.
+ */
+typedef struct Conn
+{
+    int fd;
+    char *in;
+    size_t inused;
+    outbuf_t out;
+    size_t sent; // Bytes of out already written.
+    int dirty; // Queued for flush.
+    int closing; // Close once out is written.
+    session_t session;
+    struct Conn *next; // Next queued for flush.
+} conn_t;
+
+/**
+ * server_t: Event loop of one server thread.
+ * All threads poll the listening socket, each serves the clients it
+ * accepted.
+ */
+typedef struct Server
+{
+    catalogs_t *cats;
+    int lfd;
+    int epfd;
+    unsigned int nconn;
+    pthread_t thread;
+} server_t;
+
+/**
+ * blist_iter_t: Cursor over all books of a list, for either engine.
+ */
+typedef struct BookListIter
+{
+    const blist_t *blist;
+    const snap_t *snap; // Iterate snapshot instead.
+    unsigned int rec;
+    const blist_t *cur; // List whose engine is walked.
+    unsigned int shard;
+    book_t *node;
+    unsigned int row;
+    imgrec_t chunk[SNAP_CHUNK_RECS]; // Image records of snapshot.
+    unsigned int chunkpos;
+    unsigned int chunklen;
+} blist_iter_t;
+
+/**
+ * idxcur_t: Ordered cursor over one index of every shard.
+ * Shards are merged by picking the smallest, or largest, of their heads.
+ * A yielding cursor lets go of the shards after each page of books and
+ * resumes past the key of the last one, books whose key changes meanwhile
+ * may be returned twice or not at all.
+ */
+typedef struct IndexCursor
+{
+    struct BookList *blist;
+    int type;
+    int descending;
+    int yield;
+    unsigned int n;
+    unsigned int count; // Books returned.
+    skiplist_t *list[SHARD_MAX];
+    skipnode_t *node[SHARD_MAX];
+    skipnode_t *last;
+} idxcur_t;
+
+/**
+ * scan_t: Paginated scan of a list in SN order, with price and quantity
+ * ranges as filters.
+ * A page resumes at SN next, so books present all along are returned
+ * exactly once however the list changes between pages.
+ */
+typedef struct Scan
+{
+    unsigned long long next; // SCAN_END once done.
+    unsigned int minprice;
+    unsigned int maxprice;
+    unsigned int minquant;
+    unsigned int maxquant;
+} scan_t;
+
+/**
+ * fanout_t: Function run on one shard by its own thread.
+ */
+typedef struct Fanout
+{
+    blist_t *shard;
+    void (*fn)(blist_t *, void *);
+    void *arg;
+    pthread_t thread;
+} fanout_t;
+
+/**
+ * loadrec_t: Book parsed by bulk loader.
+ * name points into the mapped data file and is not NUL terminated.
+ */
+typedef struct LoadRecord
+{
+    unsigned int sn;
+    unsigned int price;
+    unsigned int quantity;
+    unsigned int namelen;
+    unsigned int line;
+    unsigned int row;
+    const char *name;
+    book_t *book;
+} loadrec_t;
+
+/**
+ * loadkey_t: SN index entry of bulk loader.
+ * key holds home slot in high and SN hash in low 32 bits, so sorting by key
+ * orders entries by home slot and makes duplicate SNs adjacent.
+ */
+typedef struct LoadKey
+{
+    unsigned long long key;
+    loadrec_t *rec;
+} loadkey_t;
+
+/**
+ * loadchunk_t: Work of one loader thread.
+ * A data file chunk parsed into records, then one partition of the SN
+ * index built from all records.
+ */
+typedef struct LoadChunk
+{
+    const char *start;
+    const char *end;
+    unsigned int firstline;
+    unsigned int lines;
+    loadrec_t *rec;
+    unsigned int n;
+    unsigned int size;
+    unsigned int bad[LOAD_MAX_ERRORS]; // Lines failed to parse.
+    unsigned int nbad;
+    unsigned int row; // First column store row.
+    pool_t books;
+    book_t *head;
+    book_t *tail;
+    unsigned int count[LOAD_MAX_THREADS]; // Entries per partition.
+    loadkey_t *deferred; // Entries not fitting in partition.
+    unsigned int ndeferred;
+    loadrec_t *dup[LOAD_MAX_ERRORS][2]; // Duplicate entries.
+    unsigned int ndup;
+    unsigned int block; // First block of a packed file.
+    char *text; // Names decoded from a packed file.
+} loadchunk_t;
+
+/**
+ * loader_t: Parallel bulk loader of text data files.
+ */
+typedef struct Loader
+{
+    blist_t *blist;
+    int nthreads;
+    unsigned int npart; // Power of 2, at most nthreads.
+    unsigned int partshift;
+    loadchunk_t chunk[LOAD_MAX_THREADS];
+    loadkey_t *keys;
+    unsigned int partstart[LOAD_MAX_THREADS + 1];
+} loader_t;
+
+/**
+ * loadtask_t: Loader phase run by one thread.
+ */
+typedef struct LoadTask
+{
+    loader_t *loader;
+    int id;
+    void (*phase)(loader_t *, int);
+} loadtask_t;
+
+// Universal functions.
+void error_die(const char *msg);
+const char *result_msg(int res);
+int run_command(session_t *session, char **cmd, int ntoken, outbuf_t *out);
+int split_command(char *buf, char **cmd);
+int parse_orderline(const char *token, orderline_t *line);
+unsigned int read_order(const char *path, orderline_t **line);
+feed_t *feed_open(const char *path);
+int feed_read(feed_t *feed, unsigned int max);
+void feed_close(feed_t *feed);
+void run_repl(session_t *session);
+void run_batch(session_t *session);
+void command_init();
+unsigned int command_hash(const char *verb);
+const command_t *command_find(const char *verb);
+int parse_uint(const char *token, unsigned int *val);
+int check_name(const char *name);
+
+// Commands.
+int cmd_help(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_add(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_del(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_mod(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_modall(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_write(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_autosave(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_quit(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_mem(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_stats(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_sort(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_top(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_sell(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_order(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_import(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_find(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_watch(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_lowstock(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_revenue(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_query(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_queryall(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out);
+int cmd_use(session_t *session, char **cmd, int ntoken, outbuf_t *out);
+
+// Benchmark.
+int run_bench(bench_t *bench);
+unsigned int bench_sn(unsigned int i, int dist);
+void bench_name(unsigned int sn, unsigned int seed, unsigned int len, char *name);
+unsigned int bench_pick(bench_t *bench);
+void bench_ops(bench_t *bench, const char *op, int opflag);
+void bench_batch(bench_t *bench, const char *op, int opflag);
+void bench_io(bench_t *bench, int format);
+void bench_scan(bench_t *bench);
+void bench_report(const bench_t *bench, const char *op, unsigned long long ops, unsigned long long ns, const hist_t *hist);
+unsigned long long clock_ns();
+
+// Histogram.
+void hist_record(hist_t *hist, unsigned long long val);
+unsigned int hist_index(unsigned long long val);
+unsigned long long hist_value(unsigned int idx);
+unsigned long long hist_quantile(const hist_t *hist, double q);
+unsigned long long hist_max(const hist_t *hist);
+
+// Statistics.
+stats_t *stats_local();
+void stats_add(unsigned long long *counter, unsigned long long n);
+void stats_sum(stats_t *sum);
+int stats_op(int opflag);
+void stats_tick(catalogs_t *cats);
+void stats_dump(catalogs_t *cats);
+void print_stats(blist_t *booklist, outbuf_t *out);
+void print_counters(outbuf_t *out);
+void print_probes(blist_t *booklist, outbuf_t *out);
+void print_mem(blist_t *booklist, outbuf_t *out);
+
+// Server.
+int run_server(catalogs_t *cats, const char *sockpath, int nthreads);
+void *server_loop(void *arg);
+void server_signal(int sig);
+conn_t *conn_create(catalogs_t *cats, int fd);
+void conn_destroy(conn_t *conn);
+void conn_read(conn_t *conn);
+int conn_write(conn_t *conn);
+void print_alerts(blist_t *booklist, outbuf_t *out);
+
+// Catalogs.
+catalogs_t *catalogs_create(const char *datapath);
+void catalogs_destroy(catalogs_t *cats);
+catalog_t *catalog_add(catalogs_t *cats, const char *name, const char *path);
+catalog_t *catalog_find(catalogs_t *cats, const char *name);
+void catalog_acquire(catalogs_t *cats, catalog_t *cat, outbuf_t *out);
+void catalog_release(catalogs_t *cats, catalog_t *cat);
+blist_t *catalog_load(catalogs_t *cats, catalog_t *cat, outbuf_t *out);
+int catalog_unload(catalog_t *cat, blist_t *blist);
+void catalogs_evict(catalogs_t *cats);
+size_t catalogs_held(catalogs_t *cats);
+
+// Output buffer.
+void ob_init(outbuf_t *ob, int fd);
+void ob_printf(outbuf_t *ob, const char *fmt, ...);
+void ob_flush(outbuf_t *ob);
+void ob_destroy(outbuf_t *ob);
+int save_data(const blist_t *blist, const snap_t *snap, const char *path, int format);
+int sync_dir(const char *path);
+int save_start(blist_t *blist, int format, int background);
+void *save_run(void *arg);
+int save_join(blist_t *blist);
+int save_finish(blist_t *blist, savetask_t *task);
+int save_due(blist_t *blist);
+void save_auto(blist_t *blist);
+void save_tick(catalogs_t *cats);
+int read_data(blist_t *blist, const char *path, int nthreads);
+int save_text(const blist_t *blist, const snap_t *snap, FILE *datfile);
+int save_binary(const blist_t *blist, const snap_t *snap, FILE *datfile);
+void save_iter_init(blist_iter_t *iter, const blist_t *blist, const snap_t *snap);
+unsigned int save_count(const blist_t *blist, const snap_t *snap);
+int read_text(blist_t *blist, const char *path, int nthreads);
+int save_packed(const blist_t *blist, const snap_t *snap, FILE *datfile);
+int read_packed(blist_t *blist, const char *path, int nthreads);
+
+// Packed blocks.
+unsigned int crc32c(const void *data, size_t len, unsigned int crc);
+void crc32c_init();
+#if defined(__x86_64__)
+unsigned int crc32c_sse42(const unsigned char *p, size_t len, unsigned int crc);
+#endif
+unsigned char *pack_varint(unsigned char *p, unsigned int val);
+const unsigned char *unpack_varint(const unsigned char *p, const unsigned char *end, unsigned int *val);
+unsigned char *pack_bits(unsigned char *p, const unsigned int *val, unsigned int n);
+const unsigned char *unpack_bits(const unsigned char *p, const unsigned char *end, unsigned int *val, unsigned int n);
+unsigned char *pack_block(const loadrec_t *rec, unsigned int n);
+int unpack_block(const packblk_t *blk, const unsigned char *payload, loadrec_t *rec, char *text);
+unsigned char *lz_pack(unsigned char *p, const unsigned char *src, size_t len);
+const unsigned char *lz_unpack(const unsigned char *p, const unsigned char *end, unsigned char *dst, size_t len);
+void *pack_worker(void *arg);
+int pack_rec_cmp(const void *a, const void *b);
+
+// Bulk loader.
+const char *scan_token(const char *p, const char *end, size_t *len);
+int scan_uint(const char **p, const char *end, unsigned int *val);
+int load_parse_line(const char *p, const char *end, loadrec_t *rec);
+void load_run(loader_t *loader, void (*phase)(loader_t *, int));
+void *load_worker(void *arg);
+void load_phase_parse(loader_t *loader, int id);
+void load_phase_store(loader_t *loader, int id);
+void load_phase_scatter(loader_t *loader, int id);
+int load_key_cmp(const void *a, const void *b);
+void load_phase_index(loader_t *loader, int id);
+void load_phase_unpack(loader_t *loader, int id);
+void load_finish(loader_t *loader, const char *path, unsigned int total);
+
+// Journal.
+journal_t *journal_open(const char *datapath);
+void journal_close(journal_t *jnl);
+unsigned int journal_sum(const void *data, size_t len, unsigned int sum);
+int journal_replay(blist_t *blist, const char *path);
+void journal_append(journal_t *jnl, const book_t *data, int opflag);
+void journal_write(journal_t *jnl);
+void journal_sync(journal_t *jnl);
+void journal_await(journal_t *jnl);
+void journal_commit(blist_t *blist);
+void journal_reset(journal_t *jnl, int saved);
+void journal_rotate(journal_t *jnl);
+void journal_wait(blist_t *blist);
+void journal_compact(blist_t *blist);
+void *journal_compactor(void *arg);
+void journal_reap(journal_t *jnl);
+void *journal_syncer(void *arg);
+
+// Sales ledger.
+ledger_t *ledger_open(const char *datapath);
+void ledger_close(ledger_t *ledger);
+void ledger_sell(ledger_t *ledger, unsigned int sn, unsigned int quantity, unsigned int price);
+void ledger_add(ledger_t *ledger, const salerec_t *rec);
+void ledger_write(ledger_t *ledger);
+rollup_t *ledger_book(ledger_t *ledger, unsigned int sn, int create);
+size_t ledger_held(const ledger_t *ledger);
+void rollup_add(rollup_t *roll, unsigned int hour, unsigned int quantity, unsigned int price);
+unsigned int rollup_find(const rollup_t *roll, unsigned int hour);
+void rollup_sum(const rollup_t *roll, unsigned int from, unsigned int to, unsigned long long *units, unsigned long long *revenue);
+int parse_hour(const char *text, unsigned int *hour, unsigned int *span);
+
+// Mapped image.
+mapimg_t *img_open(const char *path, size_t cache);
+void img_close(mapimg_t *img);
+long img_query(mapimg_t *img, unsigned int sn, imgrec_t *rec);
+void img_read(mapimg_t *img, unsigned int idx, imgrec_t *rec);
+void img_store(mapimg_t *img, unsigned int idx, const imgrec_t *rec);
+const char *img_name(const mapimg_t *img, const imgrec_t *rec);
+void img_view(const mapimg_t *img, const imgrec_t *rec, book_t *book);
+
+// Page cache.
+pcache_t *pcache_create(int fd, const char *path, unsigned long long off, unsigned int n, size_t bytes);
+void pcache_destroy(pcache_t *cache);
+imgrec_t *pcache_page(pcache_t *cache, unsigned int page, int dirty);
+void pcache_peek(pcache_t *cache, unsigned int page, imgrec_t *buf);
+void pcache_io(int fd, char *buf, size_t len, unsigned long long off, int out);
+
+// Skip list.
+skiplist_t *skip_create(int type);
+void skip_destroy(skiplist_t *list);
+void skip_key(int type, const book_t *book, unsigned long long *num, const char **str);
+int skip_cmp(const skiplist_t *list, const skipnode_t *node, unsigned long long num, const char *str, unsigned int sn);
+void skip_insert(skiplist_t *list, const book_t *book);
+void skip_remove(skiplist_t *list, const book_t *book);
+skipnode_t *skip_seek(const skiplist_t *list, unsigned long long num, const char *str);
+skipnode_t *skip_next(const skiplist_t *list, unsigned long long num, const char *str, unsigned int sn, int descending);
+
+// Trigram index.
+trigram_t *trigram_create();
+void trigram_destroy(trigram_t *tg);
+posting_t *trigram_posting(trigram_t *tg, unsigned int key, int create);
+void trigram_add(trigram_t *tg, const char *name, unsigned int sn, int bulk);
+void trigram_seal(trigram_t *tg);
+int sn_cmp(const void *a, const void *b);
+void trigram_remove(trigram_t *tg, const char *name, unsigned int sn);
+unsigned int trigram_search(trigram_t *tg, const char *text, unsigned int **res);
+long posting_find(const posting_t *post, unsigned int sn);
+
+// Data structure functions.
+
+// SN hash map.
+snmap_t *snmap_create();
+void snmap_destroy(snmap_t *snmap);
+unsigned int sn_hash(unsigned int sn);
+size_t snmap_held(const snmap_t *snmap);
+void snmap_table_init(snmap_table_t *table, unsigned int size);
+long snmap_table_find(const snmap_table_t *table, unsigned int sn, unsigned int hash);
+int snmap_table_insert(snmap_table_t *table, snmap_node_t *node);
+void snmap_table_erase(snmap_table_t *table, unsigned int idx);
+void snmap_place(snmap_t *snmap, snmap_node_t node);
+void snmap_grow(snmap_t *snmap);
+void snmap_migrate(snmap_t *snmap, unsigned int steps);
+void snmap_append(snmap_t *snmap, snmap_node_t node);
+void snmap_remove(snmap_t *snmap, unsigned int sn);
+snmap_node_t *snmap_query(snmap_t *snmap, unsigned int sn);
+void snmap_prefetch(const snmap_t *snmap, unsigned int sn);
+const snmap_node_t *snmap_home(const snmap_t *snmap, unsigned int sn);
+void snmap_reserve(snmap_t *snmap, unsigned int n);
+
+// Arena.
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_free(arena_t *arena, void *ptr, size_t size);
+void arena_destroy(arena_t *arena);
+
+// Name intern table.
+char *intern_get(const char *str, size_t len);
+void intern_put(char *str);
+void intern_usage(size_t *held, size_t *used, unsigned int *n);
+
+// Object pool.
+void pool_init(pool_t *pool, size_t objsize);
+void *pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, void *ptr);
+void pool_destroy(pool_t *pool);
+void pool_merge(pool_t *pool, pool_t *from);
+
+// Column store.
+bstore_t *bstore_create();
+void bstore_destroy(bstore_t *store);
+unsigned int bstore_append(bstore_t *store, const book_t *data);
+void bstore_remove(bstore_t *store, unsigned int row);
+void bstore_reserve(bstore_t *store, unsigned int size);
+void bstore_view(const bstore_t *store, unsigned int row, book_t *book);
+size_t bstore_held(const bstore_t *store);
+
+// Book list.
+book_t *book_create(blist_t *blist);
+blist_t *blist_create(int engine);
+void book_destroy(blist_t *blist, book_t *book);
+void blist_destroy(blist_t *blist);
+int blist_op(blist_t *blist, book_t *data, int opflag);
+int blist_apply(blist_t *blist, book_t *data, int opflag);
+int blist_apply_node(blist_t *blist, snmap_node_t *node, book_t *data, int opflag);
+int blist_sell(book_t *data, const book_t *before, int *opflag);
+void blist_img_store(blist_t *blist, unsigned int idx, const imgrec_t *rec);
+int blist_order(blist_t *blist, orderline_t *line, unsigned int n);
+int blist_batch(blist_t *blist, batchop_t *op, unsigned int n, int atomic);
+void batch_order(blist_t *blist, const batchop_t *op, unsigned int n, unsigned int *order, unsigned int *start);
+void batch_group(const snmap_t *snmap, const batchop_t *op, unsigned int *order, unsigned int n, unsigned int *tmp);
+void batch_prefetch(blist_t *blist, unsigned int sn);
+int batch_apply(blist_t *blist, batchop_t *op, book_t *before, int *applied);
+void batch_log(blist_t *blist, const batchop_t *op, int applied, unsigned int sold);
+int blist_view(blist_t *blist, unsigned int sn, book_t *book);
+int blist_view_node(blist_t *blist, const snmap_node_t *node, unsigned int sn, book_t *book);
+skiplist_t *blist_index(blist_t *blist, int type);
+void blist_index_update(blist_t *blist, const book_t *old, const book_t *new);
+void blist_watch(blist_t *blist, const book_t *old, const book_t *new);
+trigram_t *blist_trigram(blist_t *blist);
+void blist_iter_init(blist_iter_t *iter, const blist_t *blist);
+int blist_iter_next(blist_iter_t *iter, book_t *book);
+unsigned int blist_count(const blist_t *blist);
+size_t blist_held(blist_t *blist);
+void scan_init(scan_t *scan);
+int blist_scan(blist_t *blist, scan_t *scan, book_t *page, unsigned int limit);
+void blist_retire(blist_t *blist, char *name);
+void blist_put_names(blist_t *blist);
+void blist_reclaim(blist_t *blist);
+
+// Snapshots.
+snap_t *snap_take(blist_t *blist);
+void snap_release(blist_t *blist, snap_t *snap);
+void snap_iter_init(blist_iter_t *iter, const snap_t *snap);
+void snap_chunk(blist_iter_t *iter);
+const snapimg_t *snap_pre(const snap_t *snap, unsigned int idx);
+void snap_keep(snap_t *snap, unsigned int idx, const imgrec_t *rec);
+void shard_snap(blist_t *shard, void *arg);
+
+// Shards.
+void blist_shard(blist_t *blist, unsigned int nshards);
+unsigned int shard_id(unsigned int sn, unsigned int nshards);
+blist_t *blist_route(blist_t *blist, unsigned int sn);
+void blist_lock(blist_t *blist);
+void blist_unlock(blist_t *blist);
+void blist_yield(blist_t *blist);
+void blist_fanout(blist_t *blist, void (*fn)(blist_t *, void *), void *arg);
+void *fanout_run(void *arg);
+void shard_fill(blist_t *shard, void *arg);
+void shard_index(blist_t *shard, void *arg);
+void shard_trigram(blist_t *shard, void *arg);
+void idxcur_init(idxcur_t *cur, blist_t *blist, int type, int descending);
+void idxcur_seek(idxcur_t *cur, unsigned long long num, const char *str);
+skipnode_t *idxcur_next(idxcur_t *cur);
+void idxcur_resume(idxcur_t *cur);
+
+int main(int argc, char **argv)
+{
+    // Parse cmdline params.
+    int engine = ENGINE_LIST;
+    const char *datapath = DEFAULT_DATA_PATH;
+    int nthreads = 0;
+    int journal = 1;
+    int batch = !isatty(STDIN_FILENO);
+    const char *sockpath = NULL;
+    int nshards = 0;
+    int nworkers = 1;
+    unsigned int nbench = 0;
+    int dist = DIST_RANDOM;
+    unsigned int namelen = BENCH_NAME_LEN;
+    unsigned int statsecs = 0;
+    unsigned int budget = 0;
+    unsigned int pagecache = 0;
+    unsigned int autosave = 0;
+    unsigned int autosecs = 0;
+    int len;
+    int opt;
+    command_init();
+    while ((opt = getopt(argc, argv, "A:B:D:L:M:P:T:bie:f:j:ns:S:t:")) != -1)
+    {
+        if (opt == 'f')
+        {
+            datapath = optarg;
+        }
+        else if (opt == 's')
+        {
+            sockpath = optarg;
+            batch = 1;
+        }
+        else if (opt == 'b')
+        {
+            batch = 1;
+        }
+        else if (opt == 'i')
+        {
+            batch = 0;
+        }
+        else if (opt == 'n')
+        {
+            journal = 0;
+        }
+        else if (opt == 'j' && atoi(optarg) > 0)
+        {
+            nthreads = atoi(optarg);
+        }
+        else if (opt == 'S' && atoi(optarg) > 0 && atoi(optarg) <= SHARD_MAX)
+        {
+            nshards = atoi(optarg);
+        }
+        else if (opt == 't' && atoi(optarg) > 0 && atoi(optarg) <= SERVER_MAX_THREADS)
+        {
+            nworkers = atoi(optarg);
+        }
+        else if (opt == 'e' && strcmp(optarg, "list") == 0)
+        {
+            engine = ENGINE_LIST;
+        }
+        else if (opt == 'e' && strcmp(optarg, "column") == 0)
+        {
+            engine = ENGINE_COLUMN;
+        }
+        else if (opt == 'B' && parse_uint(optarg, &nbench) == SUCCESS && nbench > 0)
+        {
+            continue;
+        }
+        else if (opt == 'D' && (strcmp(optarg, "seq") == 0 || strcmp(optarg, "random") == 0 || strcmp(optarg, "cluster") == 0))
+        {
+            dist = optarg[0] == 's' ? DIST_SEQ : optarg[0] == 'r' ? DIST_RANDOM : DIST_CLUSTER;
+        }
+        else if (opt == 'L' && parse_uint(optarg, &namelen) == SUCCESS && namelen > 0 && namelen <= MAX_BOOKNAME_LEN)
+        {
+            continue;
+        }
+        else if (opt == 'T' && parse_uint(optarg, &statsecs) == SUCCESS && statsecs > 0)
+        {
+            continue;
+        }
+        else if (opt == 'M' && parse_uint(optarg, &budget) == SUCCESS && budget > 0)
+        {
+            continue;
+        }
+        else if (opt == 'P' && parse_uint(optarg, &pagecache) == SUCCESS && pagecache > 0)
+        {
+            continue;
+        }
+        else if (opt == 'A' && sscanf(optarg, "%u:%u%n", &autosave, &autosecs, &len) == 2 && optarg[len] == '\0')
+        {
+            continue;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-b|-i|-s SOCKET [-t THREADS]] [-A N:SECS] [-e list|column] [-f FILE] [-j THREADS] [-M MB] [-n] [-P MB] [-S SHARDS] [-T SECS]\n",
+                    argv[0]);
+            fprintf(stderr, "       %s -B BOOKS [-D seq|random|cluster] [-L NAMELEN] [-e list|column] [-f FILE] [-j THREADS] [-S SHARDS]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Benchmark on a generated catalog, FILE only holds its saves.
+    if (nbench > 0)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s.bench", datapath);
+        bench_t bench;
+        memset(&bench, 0, sizeof(bench_t));
+        bench.engine = engine;
+        bench.nshards = nshards;
+        bench.dist = dist;
+        bench.namelen = namelen;
+        bench.n = nbench;
+        bench.path = path;
+        bench.nthreads = nthreads;
+        return run_bench(&bench) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    // Print welcome message.
+    if (!batch)
+    {
+        printf("\n");
+        printf("Welcome to bookman (%s)\n", VERSION);
+        printf("\n");
+    }
+
+    // Catalogs live next to the default one, FILE.
+    catalogs_t *cats = catalogs_create(datapath);
+    cats->engine = engine;
+    cats->nthreads = nthreads;
+    cats->journal = journal;
+    cats->verbose = !batch;
+    cats->budget = (size_t)budget << 20;
+    cats->pagecache = (size_t)pagecache << 20;
+    cats->autosave = autosave;
+    cats->autosecs = autosecs;
+    // Server threads modify the list concurrently, which needs shards.
+    if (sockpath != NULL && nworkers > 1 && nshards < 2)
+    {
+        nshards = nworkers;
+    }
+    cats->nshards = nshards;
+    if (statsecs > 0)
+    {
+        char spath[PATH_MAX];
+        snprintf(spath, sizeof(spath), "%s.stats", datapath);
+        cats->statspath = strdup(spath);
+        cats->statsperiod = statsecs * 1000000000ULL;
+    }
+    // Default catalog is read at startup, others on first use.
+    outbuf_t out;
+    ob_init(&out, STDOUT_FILENO);
+    catalog_acquire(cats, cats->dflt, batch ? NULL : &out);
+    ob_flush(&out);
+    ob_destroy(&out);
+    session_t session = {cats, cats->dflt};
+
+    if (sockpath != NULL)
+    {
+        if (run_server(cats, sockpath, nworkers))
+        {
+            catalogs_destroy(cats);
+            return EXIT_FAILURE;
+        }
+    }
+    else if (batch)
+    {
+        run_batch(&session);
+    }
+    else
+    {
+        printf("Input help for help\n");
+        printf("\n");
+        fflush(stdout);
+        run_repl(&session);
+    }
+    // Last dump covers commands since the previous one.
+    if (cats->statspath != NULL)
+    {
+        stats_dump(cats);
+    }
+    catalogs_destroy(cats);
+    return EXIT_SUCCESS;
+}
+
+void run_repl(session_t *session)
+{
+    // Interactive loop.
+    char buf[MAX_CMD_LEN + 1];
+    char *cmd[MAX_CMD_TOKENS + 1];
+    int ntoken;
+    int res;
+    outbuf_t out;
+    ob_init(&out, STDOUT_FILENO);
+    while (1)
+    {
+        // Commit journal of last command.
+        blist_t *booklist = session->cur->blist;
+        if (booklist->jnl != NULL)
+        {
+            journal_commit(booklist);
+        }
+        save_auto(booklist);
+        stats_tick(session->cats);
+        save_tick(session->cats);
+        // Read command.
+        ob_printf(&out, "(%s)> ", booklist->name);
+        ob_flush(&out);
+        if (fgets(buf, sizeof(buf), stdin) == NULL)
+        {
+            if (ferror(stdin))
+            {
+                error_die("Error reading command");
+            }
+            ob_printf(&out, "\n");
+            break;
+        }
+        ntoken = split_command(buf, cmd);
+        res = run_command(session, cmd, ntoken, &out);
+        if (res == CMD_QUIT)
+        {
+            break;
+        }
+        print_alerts(session->cur->blist, &out);
+        if (res != CMD_DONE)
+        {
+            ob_printf(&out, "%s\n", result_msg(res));
+        }
+    }
+    ob_flush(&out);
+    ob_destroy(&out);
+}
+
+void run_batch(session_t *session)
+{
+    // No prompts, one result code line per command.
+    char buf[MAX_CMD_LEN + 1];
+    char *cmd[MAX_CMD_TOKENS + 1];
+    char *inbuf = (char *)malloc(IO_BUF_SIZE);
+    if (inbuf == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    setvbuf(stdin, inbuf, _IOFBF, IO_BUF_SIZE);
+    outbuf_t out;
+    ob_init(&out, STDOUT_FILENO);
+    unsigned long ncmd = 0;
+    unsigned long nfail = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (fgets(buf, sizeof(buf), stdin) != NULL)
+    {
+        int ntoken = split_command(buf, cmd);
+        if (ntoken == 0)
+        {
+            continue;
+        }
+        int res = run_command(session, cmd, ntoken, &out);
+        if (res == CMD_QUIT)
+        {
+            break;
+        }
+        ncmd++;
+        if (res < 0)
+        {
+            nfail++;
+        }
+        blist_t *booklist = session->cur->blist;
+        print_alerts(booklist, &out);
+        ob_printf(&out, "=%d\n", res < 0 ? res : SUCCESS);
+        // Results are released only after their journal entries.
+        if (out.used >= IO_BUF_SIZE || ncmd % BATCH_COMMIT_CMDS == 0)
+        {
+            if (booklist->jnl != NULL)
+            {
+                journal_commit(booklist);
+            }
+            ob_flush(&out);
+            save_auto(booklist);
+            stats_tick(session->cats);
+            save_tick(session->cats);
+        }
+    }
+    if (ferror(stdin))
+    {
+        error_die("Error reading command");
+    }
+    if (session->cur->blist->jnl != NULL)
+    {
+        journal_commit(session->cur->blist);
+    }
+    ob_flush(&out);
+    ob_destroy(&out);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%lu commands, %lu failed, %.3f s, %.0f commands/s\n", ncmd, nfail, secs, secs > 0 ? ncmd / secs : 0.0);
+    free(inbuf);
+}
+
+int run_bench(bench_t *bench)
+{
+    bench->sn = (unsigned int *)malloc(sizeof(unsigned int) * bench->n);
+    if (bench->sn == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    for (unsigned int i = 0; i < bench->n; ++i)
+    {
+        bench->sn[i] = bench_sn(i, bench->dist);
+    }
+    bench->rng = 88172645463325252ULL;
+    bench->blist = blist_create(bench->engine);
+    bench->blist->name = strdup("bench");
+    if (bench->nshards > 1)
+    {
+        blist_shard(bench->blist, bench->nshards);
+    }
+    // Modifications, then scans and I/O over the full catalog.
+    bench_ops(bench, "NEW_BOOK", NEW_BOOK);
+    bench_ops(bench, "QRY_BOOK", QRY_BOOK);
+    bench_ops(bench, "UPD_PRICE", UPD_PRICE);
+    bench_ops(bench, "UPD_QUANT", UPD_QUANT);
+    bench_ops(bench, "UPD_NAME", UPD_NAME);
+    bench_ops(bench, "SELL_BOOK", SELL_BOOK);
+    bench_ops(bench, "UPD_ALL", UPD_NAME | UPD_PRICE | UPD_QUANT);
+    bench_batch(bench, "UPSERT_BATCH", UPSERT_BOOK);
+    bench_scan(bench);
+    bench_io(bench, FORMAT_TEXT);
+    bench_io(bench, FORMAT_BINARY);
+    bench_io(bench, FORMAT_PACKED);
+    bench_ops(bench, "DEL_BOOK", DEL_BOOK);
+    unlink(bench->path);
+    blist_destroy(bench->blist);
+    free(bench->sn);
+    return 0;
+}
+
+unsigned int bench_sn(unsigned int i, int dist)
+{
+    // Odd multipliers permute, so SNs never repeat.
+    if (dist == DIST_SEQ)
+    {
+        return i;
+    }
+    if (dist == DIST_RANDOM)
+    {
+        return i * 2654435761U;
+    }
+    unsigned int cluster = (i >> BENCH_CLUSTER_BITS) * 2246822519U;
+    return (cluster << BENCH_CLUSTER_BITS) | (i & ((1U << BENCH_CLUSTER_BITS) - 1));
+}
+
+void bench_name(unsigned int sn, unsigned int seed, unsigned int len, char *name)
+{
+    unsigned int x = sn * 2654435761U + seed * 40503U + 1;
+    for (unsigned int i = 0; i < len; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        name[i] = 'a' + x % 26;
+    }
+    name[len] = '\0';
+}
+
+unsigned int bench_pick(bench_t *bench)
+{
+    bench->rng ^= bench->rng << 13;
+    bench->rng ^= bench->rng >> 7;
+    bench->rng ^= bench->rng << 17;
+    return bench->sn[bench->rng % bench->n];
+}
+
+void bench_ops(bench_t *bench, const char *op, int opflag)
+{
+    // Additions and deletions go over the catalog in order, the rest pick
+    // books at random. Every 2^shift-th operation is timed.
+    char name[MAX_BOOKNAME_LEN + 1];
+    char qryname[MAX_BOOKNAME_LEN + 1];
+    unsigned int shift = 0;
+    while ((bench->n >> shift) > BENCH_MAX_SAMPLES)
+    {
+        shift++;
+    }
+    hist_t *hist = (hist_t *)calloc(1, sizeof(hist_t));
+    if (hist == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    book_t data;
+    data.name = opflag & QRY_BOOK ? qryname : name;
+    unsigned long long start = clock_ns();
+    for (unsigned int i = 0; i < bench->n; ++i)
+    {
+        data.sn = opflag & (NEW_BOOK | DEL_BOOK) ? bench->sn[i] : bench_pick(bench);
+        data.price = i;
+        data.quantity = opflag & SELL_BOOK ? 1 : bench->n;
+        if (opflag & (NEW_BOOK | UPD_NAME))
+        {
+            bench_name(data.sn, opflag, bench->namelen, name);
+        }
+        if ((i & ((1U << shift) - 1)) != 0)
+        {
+            blist_op(bench->blist, &data, opflag);
+            continue;
+        }
+        unsigned long long begin = clock_ns();
+        blist_op(bench->blist, &data, opflag);
+        hist_record(hist, clock_ns() - begin);
+    }
+    bench_report(bench, op, bench->n, clock_ns() - start, hist);
+    free(hist);
+}
+
+void bench_batch(bench_t *bench, const char *op, int opflag)
+{
+    // Same books as bench_ops picks, BATCH_OPS per batch. Only applying
+    // batches is timed, latency is the mean per operation of a batch.
+    hist_t *hist = (hist_t *)calloc(1, sizeof(hist_t));
+    batchop_t *batch = (batchop_t *)malloc(sizeof(batchop_t) * BATCH_OPS);
+    char *names = (char *)malloc((MAX_BOOKNAME_LEN + 1) * BATCH_OPS);
+    if (hist == NULL || batch == NULL || names == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    unsigned long long ns = 0;
+    for (unsigned int i = 0; i < bench->n; i += BATCH_OPS)
+    {
+        unsigned int n = bench->n - i < BATCH_OPS ? bench->n - i : BATCH_OPS;
+        for (unsigned int j = 0; j < n; ++j)
+        {
+            batch[j].data.sn = opflag == NEW_BOOK || opflag == DEL_BOOK ? bench->sn[i + j] : bench_pick(bench);
+            batch[j].data.name = names + (MAX_BOOKNAME_LEN + 1) * j;
+            batch[j].data.price = i + j;
+            batch[j].data.quantity = opflag & SELL_BOOK ? 1 : bench->n;
+            batch[j].opflag = opflag;
+            bench_name(batch[j].data.sn, opflag, bench->namelen, batch[j].data.name);
+        }
+        unsigned long long begin = clock_ns();
+        blist_batch(bench->blist, batch, n, 0);
+        unsigned long long took = clock_ns() - begin;
+        hist_record(hist, took / n);
+        ns += took;
+    }
+    bench_report(bench, op, bench->n, ns, hist);
+    free(names);
+    free(batch);
+    free(hist);
+}
+
+void bench_scan(bench_t *bench)
+{
+    // Phases run once, they have no latency distribution.
+    // Storage order.
+    blist_iter_t iter;
+    book_t book;
+    unsigned int n = 0;
+    unsigned long long start = clock_ns();
+    blist_iter_init(&iter, bench->blist);
+    while (blist_iter_next(&iter, &book))
+    {
+        n++;
+    }
+    unsigned long long ns = clock_ns() - start;
+    if (n != bench->n)
+    {
+        error_die("Benchmark scan mismatch");
+    }
+    bench_report(bench, "scan", bench->n, ns, NULL);
+    // Index build, then price order.
+    start = clock_ns();
+    blist_index(bench->blist, IDX_PRICE);
+    ns = clock_ns() - start;
+    bench_report(bench, "index_build", bench->n, ns, NULL);
+    idxcur_t cursor;
+    skipnode_t *current;
+    n = 0;
+    start = clock_ns();
+    idxcur_init(&cursor, bench->blist, IDX_PRICE, 0);
+    while ((current = idxcur_next(&cursor)) != NULL)
+    {
+        n++;
+    }
+    ns = clock_ns() - start;
+    if (n != bench->n)
+    {
+        error_die("Benchmark scan mismatch");
+    }
+    bench_report(bench, "index_scan", bench->n, ns, NULL);
+}
+
+void bench_io(bench_t *bench, int format)
+{
+    const char *kind = format == FORMAT_TEXT ? "text" : format == FORMAT_BINARY ? "binary" : "packed";
+    char op[32];
+    unsigned long long start = clock_ns();
+    if (save_data(bench->blist, NULL, bench->path, format))
+    {
+        error_die("Benchmark save failed");
+    }
+    unsigned long long ns = clock_ns() - start;
+    snprintf(op, sizeof(op), "save_%s", kind);
+    bench_report(bench, op, bench->n, ns, NULL);
+    // Binary files are mapped, records are only faulted in by a scan.
+    // Loads are sharded like the catalog they came from.
+    blist_t *loaded = blist_create(bench->engine);
+    blist_iter_t iter;
+    book_t book;
+    unsigned int n = 0;
+    start = clock_ns();
+    read_data(loaded, bench->path, bench->nthreads);
+    if (bench->nshards > 1)
+    {
+        blist_shard(loaded, bench->nshards);
+    }
+    blist_iter_init(&iter, loaded);
+    while (blist_iter_next(&iter, &book))
+    {
+        n++;
+    }
+    ns = clock_ns() - start;
+    if (n != bench->n)
+    {
+        error_die("Benchmark load mismatch");
+    }
+    snprintf(op, sizeof(op), "read_%s", kind);
+    bench_report(bench, op, bench->n, ns, NULL);
+    blist_destroy(loaded);
+}
+
+void bench_report(const bench_t *bench, const char *op, unsigned long long ops, unsigned long long ns, const hist_t *hist)
+{
+    // One JSON object per line, latencies only for phases with a hist.
+    static const char *dist[] = {"seq", "random", "cluster"};
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double secs = ns / 1e9;
+    printf("{\"op\":\"%s\",\"engine\":\"%s\",\"shards\":%u,\"dist\":\"%s\",\"namelen\":%u,\"books\":%u,"
+           "\"ops\":%llu,\"secs\":%.6f,\"ops_per_sec\":%.0f,",
+           op, bench->engine == ENGINE_LIST ? "list" : "column", bench->nshards, dist[bench->dist], bench->namelen, bench->n,
+           ops, secs, secs > 0 ? ops / secs : 0.0);
+    if (hist != NULL)
+    {
+        printf("\"p50_ns\":%llu,\"p99_ns\":%llu,", hist_quantile(hist, 0.5), hist_quantile(hist, 0.99));
+    }
+    printf("\"peak_rss_kb\":%ld}\n", usage.ru_maxrss);
+    fflush(stdout);
+}
+
+unsigned long long clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Histogram functions.
+
+void hist_record(hist_t *hist, unsigned long long val)
+{
+    stats_add(&hist->bucket[hist_index(val)], 1);
+    stats_add(&hist->count, 1);
+}
+
+unsigned int hist_index(unsigned long long val)
+{
+    if (val < (1U << HIST_SUB_BITS))
+    {
+        return val;
+    }
+    // Top bit picks the power of 2, next bits the bucket within.
+    unsigned int msb = 63 - __builtin_clzll(val);
+    unsigned int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((val >> shift) & ((1U << HIST_SUB_BITS) - 1));
+}
+
+unsigned long long hist_value(unsigned int idx)
+{
+    // Lowest value of bucket.
+    if (idx < (1U << HIST_SUB_BITS))
+    {
+        return idx;
+    }
+    unsigned int shift = (idx >> HIST_SUB_BITS) - 1;
+    unsigned long long sub = idx & ((1U << HIST_SUB_BITS) - 1);
+    return ((1ULL << HIST_SUB_BITS) + sub) << shift;
+}
+
+unsigned long long hist_quantile(const hist_t *hist, double q)
+{
+    if (hist->count == 0)
+    {
+        return 0;
+    }
+    unsigned long long rank = (unsigned long long)(q * hist->count);
+    if (rank >= hist->count)
+    {
+        rank = hist->count - 1;
+    }
+    unsigned long long seen = 0;
+    for (unsigned int i = 0; i < HIST_BUCKETS; ++i)
+    {
+        seen += hist->bucket[i];
+        if (seen > rank)
+        {
+            return hist_value(i);
+        }
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+unsigned long long hist_max(const hist_t *hist)
+{
+    for (unsigned int i = HIST_BUCKETS; i-- > 0;)
+    {
+        if (hist->bucket[i] != 0)
+        {
+            return hist_value(i);
+        }
+    }
+    return 0;
+}
+
+// Statistics functions.
+
+// Counters of every thread that ran a command, never freed.
+stats_t *stats_all = NULL;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread stats_t *stats_mine = NULL;
+const char *stats_opname[STATS_OPS] = {"add", "del", "mod", "query", "sell"};
+
+stats_t *stats_local()
+{
+    if (stats_mine == NULL)
+    {
+        stats_mine = (stats_t *)calloc(1, sizeof(stats_t));
+        if (stats_mine == NULL)
+        {
+            error_die("Malloc failed");
+        }
+        pthread_mutex_lock(&stats_lock);
+        stats_mine->next = stats_all;
+        stats_all = stats_mine;
+        pthread_mutex_unlock(&stats_lock);
+    }
+    return stats_mine;
+}
+
+void stats_add(unsigned long long *counter, unsigned long long n)
+{
+    // Single writer, a plain add that readers may load at any time.
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void stats_sum(stats_t *sum)
+{
+    pthread_mutex_lock(&stats_lock);
+    for (stats_t *stats = stats_all; stats != NULL; stats = stats->next)
+    {
+        for (unsigned int i = 0; i < CMD_MAX; ++i)
+        {
+            sum->calls[i] += __atomic_load_n(&stats->calls[i], __ATOMIC_RELAXED);
+            sum->failed[i] += __atomic_load_n(&stats->failed[i], __ATOMIC_RELAXED);
+            sum->latency[i].count += __atomic_load_n(&stats->latency[i].count, __ATOMIC_RELAXED);
+            for (unsigned int j = 0; j < HIST_BUCKETS; ++j)
+            {
+                sum->latency[i].bucket[j] += __atomic_load_n(&stats->latency[i].bucket[j], __ATOMIC_RELAXED);
+            }
+        }
+        for (unsigned int i = 0; i < STATS_OPS; ++i)
+        {
+            sum->ops[i] += __atomic_load_n(&stats->ops[i], __ATOMIC_RELAXED);
+        }
+        sum->opfail += __atomic_load_n(&stats->opfail, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+int stats_op(int opflag)
+{
+    // Modification of several properties counts once.
+    if (opflag & NEW_BOOK)
+    {
+        return 0;
+    }
+    if (opflag & DEL_BOOK)
+    {
+        return 1;
+    }
+    if (opflag & QRY_BOOK)
+    {
+        return 3;
+    }
+    if (opflag & SELL_BOOK)
+    {
+        return 4;
+    }
+    return 2;
+}
+
+void stats_tick(catalogs_t *cats)
+{
+    if (cats->statspath == NULL)
+    {
+        return;
+    }
+    // Of concurrent front ends, the one moving statsnext dumps.
+    unsigned long long now = clock_ns();
+    unsigned long long next = __atomic_load_n(&cats->statsnext, __ATOMIC_RELAXED);
+    if (now < next || !__atomic_compare_exchange_n(&cats->statsnext, &next, now + cats->statsperiod, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    stats_dump(cats);
+}
+
+void stats_dump(catalogs_t *cats)
+{
+    outbuf_t out;
+    ob_init(&out, -1);
+    ob_printf(&out, "time     %lld\n", (long long)time(NULL));
+    print_counters(&out);
+    // Loaded catalogs stay loaded while the registry is locked.
+    pthread_mutex_lock(&cats->lock);
+    for (catalog_t *cat = cats->head; cat != NULL; cat = cat->next)
+    {
+        blist_t *booklist = cat->blist;
+        if (booklist == NULL)
+        {
+            continue;
+        }
+        ob_printf(&out, "catalog  %s\n", cat->name);
+        if (booklist->shard != NULL)
+        {
+            blist_lock(booklist);
+        }
+        print_probes(booklist, &out);
+        print_mem(booklist, &out);
+        if (booklist->shard != NULL)
+        {
+            blist_unlock(booklist);
+        }
+    }
+    pthread_mutex_unlock(&cats->lock);
+    // Replace whole file, readers never see a partial dump.
+    char tmppath[PATH_MAX];
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", cats->statspath);
+    FILE *file = fopen(tmppath, "w");
+    if (file != NULL)
+    {
+        int failed = fwrite(out.data, 1, out.used, file) != out.used;
+        if (fclose(file) != 0 || failed || rename(tmppath, cats->statspath) != 0)
+        {
+            unlink(tmppath);
+        }
+    }
+    ob_destroy(&out);
+}
+
+volatile sig_atomic_t server_stop = 0;
+
+void server_signal(int sig)
+{
+    (void)sig;
+    __atomic_store_n(&server_stop, 1, __ATOMIC_RELAXED);
+}
+
+int run_server(catalogs_t *cats, const char *sockpath, int nthreads)
+{
+    // Clients share the list through the socket, served by nthreads loops.
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockpath) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, sockpath);
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lfd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    // Stale socket of an earlier run.
+    unlink(sockpath);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, SOMAXCONN) < 0)
+    {
+        perror(sockpath);
+        close(lfd);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "Listening on %s\n", sockpath);
+
+    server_t server[SERVER_MAX_THREADS];
+    unsigned int nconn = 0;
+    for (int i = 0; i < nthreads; ++i)
+    {
+        server[i].cats = cats;
+        server[i].lfd = lfd;
+        server[i].nconn = 0;
+        server[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (server[i].epfd < 0)
+        {
+            error_die(strerror(errno));
+        }
+        // Wake one thread per new client.
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (nthreads > 1 ? EPOLLEXCLUSIVE : 0);
+        ev.data.ptr = NULL; // Listening socket.
+        epoll_ctl(server[i].epfd, EPOLL_CTL_ADD, lfd, &ev);
+        if (i > 0 && pthread_create(&server[i].thread, NULL, server_loop, &server[i]) != 0)
+        {
+            error_die("Failed to create thread");
+        }
+    }
+    server_loop(&server[0]);
+    for (int i = 0; i < nthreads; ++i)
+    {
+        if (i > 0)
+        {
+            pthread_join(server[i].thread, NULL);
+        }
+        close(server[i].epfd);
+        nconn += server[i].nconn;
+    }
+    fprintf(stderr, "Shutting down, %u clients connected\n", nconn);
+    close(lfd);
+    unlink(sockpath);
+    return 0;
+}
+
+void *server_loop(void *arg)
+{
+    server_t *server = (server_t *)arg;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    struct epoll_event ev;
+    while (!__atomic_load_n(&server_stop, __ATOMIC_RELAXED))
+    {
+        int nev = epoll_wait(server->epfd, events, SERVER_MAX_EVENTS, SERVER_POLL_MS);
+        if (nev < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error_die(strerror(errno));
+        }
+        conn_t *dirty = NULL;
+        for (int i = 0; i < nev; ++i)
+        {
+            conn_t *conn = (conn_t *)events[i].data.ptr;
+            if (conn == NULL)
+            {
+                // Accept all pending clients.
+                int fd;
+                while ((fd = accept4(server->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    conn = conn_create(server->cats, fd);
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = conn;
+                    epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev);
+                    server->nconn++;
+                }
+                continue;
+            }
+            if (events[i].events & EPOLLIN)
+            {
+                conn_read(conn);
+            }
+            else if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                conn->closing = 1;
+                conn->out.used = conn->sent;
+            }
+            if (!conn->dirty)
+            {
+                conn->dirty = 1;
+                conn->next = dirty;
+                dirty = conn;
+            }
+        }
+        // Responses are released only after their journal entries.
+        blist_t *committed = NULL;
+        for (conn_t *conn = dirty; conn != NULL; conn = conn->next)
+        {
+            blist_t *booklist = conn->session.cur->blist;
+            if (booklist->jnl != NULL && booklist != committed)
+            {
+                journal_commit(booklist);
+                committed = booklist;
+            }
+            save_auto(booklist);
+        }
+        while (dirty != NULL)
+        {
+            conn_t *conn = dirty;
+            dirty = conn->next;
+            conn->dirty = 0;
+            int pending = conn_write(conn);
+            if (pending < 0 || (pending == 0 && conn->closing))
+            {
+                epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                conn_destroy(conn);
+                server->nconn--;
+                continue;
+            }
+            // Stop reading from clients not taking their responses.
+            ev.events = pending ? EPOLLOUT : 0;
+            if (!conn->closing && conn->out.used - conn->sent < IO_BUF_SIZE)
+            {
+                ev.events |= EPOLLIN;
+            }
+            ev.data.ptr = conn;
+            epoll_ctl(server->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        }
+        stats_tick(server->cats);
+        save_tick(server->cats);
+    }
+    return NULL;
+}
+
+conn_t *conn_create(catalogs_t *cats, int fd)
+{
+    conn_t *new = (conn_t *)malloc(sizeof(conn_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    memset(new, 0, sizeof(conn_t));
+    new->fd = fd;
+    new->in = (char *)malloc(SERVER_INBUF_SIZE);
+    if (new->in == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    ob_init(&new->out, -1);
+    // Clients start out on the default catalog.
+    new->session.cats = cats;
+    new->session.cur = cats->dflt;
+    catalog_acquire(cats, cats->dflt, NULL);
+    return new;
+}
+
+void conn_destroy(conn_t *conn)
+{
+    catalog_release(conn->session.cats, conn->session.cur);
+    close(conn->fd);
+    free(conn->in);
+    ob_destroy(&conn->out);
+    free(conn);
+}
+
+void conn_read(conn_t *conn)
+{
+    char *cmd[MAX_CMD_TOKENS + 1];
+    if (conn->closing)
+    {
+        return;
+    }
+    ssize_t len = read(conn->fd, conn->in + conn->inused, SERVER_INBUF_SIZE - conn->inused);
+    if (len <= 0)
+    {
+        if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            return;
+        }
+        // Client done sending, answer what it sent.
+        conn->closing = 1;
+        return;
+    }
+    conn->inused += len;
+    // Run every complete line, pipelined requests answer in order.
+    char *line = conn->in;
+    char *end = conn->in + conn->inused;
+    char *nl;
+    while (!conn->closing && (nl = memchr(line, '\n', end - line)) != NULL)
+    {
+        *nl = '\0';
+        int res = INVALID_ARG;
+        if (nl - line <= MAX_CMD_LEN)
+        {
+            int ntoken = split_command(line, cmd);
+            res = ntoken == 0 ? CMD_DONE : run_command(&conn->session, cmd, ntoken, &conn->out);
+        }
+        line = nl + 1;
+        if (res == CMD_QUIT)
+        {
+            conn->closing = 1;
+            break;
+        }
+        print_alerts(conn->session.cur->blist, &conn->out);
+        ob_printf(&conn->out, "=%d\n", res < 0 ? res : SUCCESS);
+    }
+    conn->inused = end - line;
+    memmove(conn->in, line, conn->inused);
+    if (conn->inused == SERVER_INBUF_SIZE)
+    {
+        // Line can never complete.
+        ob_printf(&conn->out, "=%d\n", INVALID_ARG);
+        conn->closing = 1;
+    }
+}
+
+int conn_write(conn_t *conn)
+{
+    // Write what the socket takes, 1 if output is left.
+    while (conn->sent < conn->out.used)
+    {
+        ssize_t res = write(conn->fd, conn->out.data + conn->sent, conn->out.used - conn->sent);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN)
+            {
+                return 1;
+            }
+            return -1;
+        }
+        conn->sent += res;
+    }
+    conn->sent = 0;
+    conn->out.used = 0;
+    return 0;
+}
+
+int split_command(char *buf, char **cmd)
+{
+    // Tokens are terminated in place, a token in double quotes may hold
+    // blanks. Returns -1 for an unterminated quote.
+    int ntoken = 0;
+    char *p = buf;
+    while (1)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+        {
+            p++;
+        }
+        if (*p == '\0' || *p == '\n')
+        {
+            break;
+        }
+        char *token = p;
+        if (*p == '"')
+        {
+            token = ++p;
+            while (*p != '"' && *p != '\0' && *p != '\n')
+            {
+                p++;
+            }
+            if (*p != '"' || (p[1] != ' ' && p[1] != '\t' && p[1] != '\r' && p[1] != '\n' && p[1] != '\0'))
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            while (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '\0')
+            {
+                p++;
+            }
+        }
+        // Extra tokens are only counted, commands reject them.
+        if (ntoken < MAX_CMD_TOKENS)
+        {
+            cmd[ntoken] = token;
+        }
+        ntoken++;
+        if (*p == '\0' || *p == '\n')
+        {
+            *p = '\0';
+            break;
+        }
+        *p++ = '\0';
+    }
+    return ntoken;
+}
+
+void print_alerts(blist_t *booklist, outbuf_t *out)
+{
+    if (booklist->shard != NULL)
+    {
+        for (unsigned int i = 0; i < booklist->nshards; ++i)
+        {
+            pthread_mutex_lock(&booklist->shard[i]->lock);
+            print_alerts(booklist->shard[i], out);
+            pthread_mutex_unlock(&booklist->shard[i]->lock);
+        }
+        return;
+    }
+    for (unsigned int i = 0; i < booklist->nalert; ++i)
+    {
+        ob_printf(out, "Low stock: %u quantity %u\n", booklist->alert[i].sn, booklist->alert[i].quantity);
+    }
+    booklist->nalert = 0;
+}
+
+int parse_orderline(const char *token, orderline_t *line)
+{
+    const char *p = token;
+    const char *end = token + strlen(token);
+    const char *colon = strchr(token, ':');
+    memset(line, 0, sizeof(orderline_t));
+    if (colon == NULL || scan_uint(&p, colon, &line->sn) < 0 || p != colon)
+    {
+        return INVALID_ARG;
+    }
+    p = colon + 1;
+    if (*p == ' ' || scan_uint(&p, end, &line->quantity) < 0 || p != end)
+    {
+        return INVALID_ARG;
+    }
+    return SUCCESS;
+}
+
+unsigned int read_order(const char *path, orderline_t **line)
+{
+    // Basket file holds whitespace separated SN:QTY tokens.
+    FILE *file = fopen(path, "r");
+    char token[64];
+    unsigned int n = 0;
+    unsigned int size = ORDER_INIT_SIZE;
+    *line = NULL;
+    if (file == NULL)
+    {
+        return 0;
+    }
+    orderline_t *new = (orderline_t *)malloc(sizeof(orderline_t) * size);
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    while (fscanf(file, "%63s", token) == 1)
+    {
+        if (n == size)
+        {
+            size *= 2;
+            new = (orderline_t *)realloc(new, sizeof(orderline_t) * size);
+            if (new == NULL)
+            {
+                error_die("Malloc failed");
+            }
+        }
+        if (parse_orderline(token, &new[n]) != SUCCESS)
+        {
+            fclose(file);
+            free(new);
+            return 0;
+        }
+        n++;
+    }
+    fclose(file);
+    *line = new;
+    return n;
+}
+
+feed_t *feed_open(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    feed_t *new = (feed_t *)calloc(1, sizeof(feed_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    new->file = file;
+    new->size = BATCH_INIT_SIZE;
+    new->op = (batchop_t *)malloc(sizeof(batchop_t) * new->size);
+    new->names = (char *)malloc((MAX_BOOKNAME_LEN + 1) * new->size);
+    if (new->op == NULL || new->names == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    return new;
+}
+
+int feed_read(feed_t *feed, unsigned int max)
+{
+    // Feed file holds one op per line: SN NAME PRICE QUANTITY adds or
+    // replaces a book, del SN deletes and sell SN QUANTITY sells. Names
+    // are quoted as on the command line. Reads up to max ops, a malformed
+    // line ends the chunk before it.
+    char line[MAX_BOOKNAME_LEN + 64];
+    char *token[MAX_CMD_TOKENS];
+    int res = SUCCESS;
+    feed->n = 0;
+    while (feed->n < max && fgets(line, sizeof(line), feed->file) != NULL)
+    {
+        if (strchr(line, '\n') == NULL && !feof(feed->file))
+        {
+            // Line too long.
+            res = INVALID_ARG;
+            break;
+        }
+        int ntoken = split_command(line, token);
+        if (ntoken == 0)
+        {
+            continue;
+        }
+        if (feed->n == feed->size)
+        {
+            feed->size *= 2;
+            feed->op = (batchop_t *)realloc(feed->op, sizeof(batchop_t) * feed->size);
+            feed->names = (char *)realloc(feed->names, (MAX_BOOKNAME_LEN + 1) * feed->size);
+            if (feed->op == NULL || feed->names == NULL)
+            {
+                error_die("Malloc failed");
+            }
+        }
+        batchop_t *op = &feed->op[feed->n];
+        if (ntoken == 2 && strcmp(token[0], "del") == 0 && parse_uint(token[1], &op->data.sn) == SUCCESS)
+        {
+            op->opflag = DEL_BOOK;
+        }
+        else if (ntoken == 3 && strcmp(token[0], "sell") == 0 && parse_uint(token[1], &op->data.sn) == SUCCESS &&
+                 parse_uint(token[2], &op->data.quantity) == SUCCESS)
+        {
+            op->opflag = SELL_BOOK;
+        }
+        else if (ntoken == 4 && check_name(token[1]) == SUCCESS && parse_uint(token[0], &op->data.sn) == SUCCESS &&
+                 parse_uint(token[2], &op->data.price) == SUCCESS && parse_uint(token[3], &op->data.quantity) == SUCCESS)
+        {
+            op->opflag = UPSERT_BOOK;
+            strcpy(feed->names + (MAX_BOOKNAME_LEN + 1) * feed->n, token[1]);
+        }
+        else
+        {
+            res = INVALID_ARG;
+            break;
+        }
+        feed->n++;
+    }
+    // Names moved with realloc, point at them once all are read.
+    for (unsigned int i = 0; i < feed->n; ++i)
+    {
+        feed->op[i].data.name = feed->names + (MAX_BOOKNAME_LEN + 1) * i;
+    }
+    return res;
+}
+
+void feed_close(feed_t *feed)
+{
+    fclose(feed->file);
+    free(feed->names);
+    free(feed->op);
+    free(feed);
+}
+
+const char *result_msg(int res)
+{
+    switch (res)
+    {
+    case SUCCESS:
+        return "Success";
+    case INVALID_ARG:
+        return "Invalid command";
+    case BOOK_NONEXIST:
+        return "Book doesn't exist";
+    case BOOK_EXIST:
+        return "Book with same SN already exists";
+    case MAP_INCONSIST:
+        return "Internal error";
+    case IO_FAILED:
+        return "Save failed";
+    case OUT_OF_STOCK:
+        return "Insufficient stock";
+    default:
+        return "Unknown error";
+    }
+}
+
+// Book commands lock their shard, commands over the catalog hold all.
+const command_t commands[] = {
+    {.verb = "help", .fn = cmd_help},
+    {.verb = "add", .fn = cmd_add},
+    {.verb = "del", .fn = cmd_del},
+    {.verb = "mod", .fn = cmd_mod},
+    {.verb = "modall", .fn = cmd_modall},
+    {.verb = "write", .fn = cmd_write},
+    {.verb = "autosave", .fn = cmd_autosave},
+    {.verb = "quit", .fn = cmd_quit},
+    {.verb = "mem", .fn = cmd_mem, .whole = 1},
+    {.verb = "sort", .fn = cmd_sort, .whole = 1},
+    {.verb = "range", .fn = cmd_sort, .whole = 1},
+    {.verb = "top", .fn = cmd_top, .whole = 1},
+    {.verb = "sell", .fn = cmd_sell},
+    {.verb = "order", .fn = cmd_order},
+    {.verb = "import", .fn = cmd_import},
+    {.verb = "find", .fn = cmd_find, .whole = 1},
+    {.verb = "watch", .fn = cmd_watch, .whole = 1},
+    {.verb = "lowstock", .fn = cmd_lowstock, .whole = 1},
+    {.verb = "revenue", .fn = cmd_revenue},
+    {.verb = "query", .fn = cmd_query},
+    {.verb = "queryall", .fn = cmd_queryall, .whole = 1},
+    {.verb = "stats", .fn = cmd_stats, .whole = 1},
+    {.verb = "use", .sessfn = cmd_use},
+    {.verb = NULL},
+};
+const command_t *command_slot[CMD_HASH_SIZE];
+
+void command_init()
+{
+    if (sizeof(commands) / sizeof(command_t) > CMD_MAX)
+    {
+        error_die("Too many commands");
+    }
+    for (const command_t *command = commands; command->verb != NULL; ++command)
+    {
+        // Lookup never probes, a new verb may need other multipliers.
+        unsigned int i = command_hash(command->verb);
+        if (command_slot[i] != NULL)
+        {
+            error_die("Command hash collision");
+        }
+        command_slot[i] = command;
+    }
+}
+
+unsigned int command_hash(const char *verb)
+{
+    // Length, first and last letter put every verb in a slot of its own,
+    // command_init checks.
+    size_t len = strlen(verb);
+    unsigned char first = verb[0];
+    unsigned char last = len > 0 ? verb[len - 1] : 0;
+    return (len * 7 + first * 22 + last) & (CMD_HASH_SIZE - 1);
+}
+
+const command_t *command_find(const char *verb)
+{
+    const command_t *command = command_slot[command_hash(verb)];
+    if (command == NULL || strcmp(command->verb, verb) != 0)
+    {
+        return NULL;
+    }
+    return command;
+}
+
+int parse_uint(const char *token, unsigned int *val)
+{
+    // Whole token must be digits and fit.
+    const char *p = token;
+    const char *end = token + strlen(token);
+    if (*p == ' ' || *p == '\t' || scan_uint(&p, end, val) < 0 || p != end)
+    {
+        return INVALID_ARG;
+    }
+    return SUCCESS;
+}
+
+int check_name(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 0 && len <= MAX_BOOKNAME_LEN ? SUCCESS : INVALID_ARG;
+}
+
+int run_command(session_t *session, char **cmd, int ntoken, outbuf_t *out)
+{
+    blist_t *booklist = session->cur->blist;
+    if (ntoken == 0)
+    {
+        return CMD_DONE;
+    }
+    // Malformed line or too many tokens.
+    if (ntoken < 0 || ntoken > MAX_CMD_TOKENS)
+    {
+        return INVALID_ARG;
+    }
+    const command_t *command = command_find(cmd[0]);
+    if (command == NULL)
+    {
+        return INVALID_ARG;
+    }
+    // Reading the clock costs about as much as a command, time a sample.
+    stats_t *stats = stats_local();
+    unsigned int id = command - commands;
+    int timed = (stats->calls[id] & ((1U << STATS_SAMPLE_BITS) - 1)) == 0;
+    unsigned long long begin = timed ? clock_ns() : 0;
+    stats_add(&stats->calls[id], 1);
+    int res;
+    if (command->sessfn != NULL)
+    {
+        res = command->sessfn(session, cmd, ntoken, out);
+    }
+    else if (command->whole && booklist->shard != NULL)
+    {
+        blist_lock(booklist);
+        res = command->fn(booklist, cmd, ntoken, out);
+        blist_unlock(booklist);
+    }
+    else
+    {
+        res = command->fn(booklist, cmd, ntoken, out);
+    }
+    if (res < 0)
+    {
+        stats_add(&stats->failed[id], 1);
+    }
+    if (timed)
+    {
+        hist_record(&stats->latency[id], clock_ns() - begin);
+    }
+    return res;
+}
+
+int cmd_help(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    // Print help message.
+    ob_printf(out, "\nHelp:\n\n");
+
+    ob_printf(out, "  Modification\n");
+    ob_printf(out, "   add [SN] [NAME] [PRICE] [QUANTITY]        add a new entry\n");
+    ob_printf(out, "   del [SN]                                  delete an entry\n");
+    ob_printf(out, "   mod [name|price|quantity] [SN] [VALUE]    modify specified property of an entry\n");
+    ob_printf(out, "   modall [SN] [NAME] [PRICE] [QUANTITY]     modify all properties of an entry\n");
+    ob_printf(out, "   import @[FILE] [atomic]                   apply lines of SN NAME PRICE QUANTITY (add or replace),\n");
+    ob_printf(out, "                                             del SN and sell SN QUANTITY, all or none if atomic\n\n");
+
+    ob_printf(out, "  Query\n");
+    ob_printf(out, "   query [name|price|quantity] [SN]          query specified property of an entry\n");
+    ob_printf(out, "   query all [SN]                            query all properties of an entry\n");
+    ob_printf(out, "   queryall [LIMIT] [CURSOR]                 query all properties of LIMIT entries after CURSOR in SN order\n");
+    ob_printf(out, "   queryall ... [price|quantity] [LO] [HI]   query only entries with price|quantity in range\n");
+    ob_printf(out, "   sort [name|price] [a|d]                   sort entries by name|price in acsending|decsending order\n");
+    ob_printf(out, "   range price [LO] [HI]                     query entries with price in range\n");
+    ob_printf(out, "   range name [FROM] [TO]                    query entries with name in range\n");
+    ob_printf(out, "   top [K] [price|quantity|value]            query K entries with highest price|quantity|value\n");
+    ob_printf(out, "   find [prefix|contains] [TEXT]             query entries with name starting with|containing TEXT\n\n");
+
+    ob_printf(out, "  Transaction\n");
+    ob_printf(out, "   sell [SN] [QUANTITY]                      sell specified quantity of specified entry\n");
+    ob_printf(out, "   order [SN:QUANTITY] ...                   sell all lines of a basket or none\n");
+    ob_printf(out, "   order @[FILE]                             sell basket read from file\n");
+    ob_printf(out, "   revenue [SN|all] [FROM] [TO]              query units sold and revenue, FROM and TO as YYYY-MM-DD[THH] UTC\n\n");
+    ob_printf(out, "  Stock Watch\n");
+    ob_printf(out, "   watch quantity < [N]                      alert when quantity of an entry falls below N\n");
+    ob_printf(out, "   watch off                                 stop watching quantity\n");
+    ob_printf(out, "   lowstock                                  query entries with quantity below watch threshold\n\n");
+
+    ob_printf(out, "  Catalogs\n");
+    ob_printf(out, "   use                                       list catalogs\n");
+    ob_printf(out, "   use [LIST]                                switch to catalog LIST, created if new\n\n");
+
+    ob_printf(out, "  Save & Exit\n");
+    ob_printf(out, "   write [text|binary|packed]                save modified data to file\n");
+    ob_printf(out, "   write [text|binary|packed] bg             save in background, commands go on meanwhile\n");
+    ob_printf(out, "   autosave [N] [SECS]                       save in background after N modifications or SECS seconds\n");
+    ob_printf(out, "   autosave [off]                            stop autosave, without arguments print policy\n");
+    ob_printf(out, "   quit                                      exit bookman\n\n");
+
+    ob_printf(out, "  Misc\n");
+    ob_printf(out, "   mem                                       print memory held by each pool\n");
+    ob_printf(out, "   stats                                     print command latencies, operation counts and SN map probes\n");
+    ob_printf(out, "   help                                      print help message\n\n");
+    return CMD_DONE;
+}
+
+int cmd_add(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken != 5)
+    {
+        return INVALID_ARG;
+    }
+    // Add new book.
+    book_t newbook;
+    newbook.name = cmd[2];
+    if (check_name(newbook.name) != SUCCESS || parse_uint(cmd[1], &newbook.sn) != SUCCESS || parse_uint(cmd[3], &newbook.price) != SUCCESS ||
+        parse_uint(cmd[4], &newbook.quantity) != SUCCESS)
+    {
+        return INVALID_ARG;
+    }
+    return blist_op(booklist, &newbook, NEW_BOOK);
+}
+
+int cmd_del(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken != 2)
+    {
+        return INVALID_ARG;
+    }
+    book_t delbook;
+    if (parse_uint(cmd[1], &delbook.sn) != SUCCESS)
+    {
+        return INVALID_ARG;
+    }
+    return blist_op(booklist, &delbook, DEL_BOOK);
+}
+
+int cmd_mod(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken != 4)
+    {
+        return INVALID_ARG;
+    }
+    book_t modbook;
+    if (parse_uint(cmd[2], &modbook.sn) != SUCCESS)
+    {
+        return INVALID_ARG;
+    }
+    int opflag;
+    if (strcmp(cmd[1], "name") == 0)
+    {
+        opflag = UPD_NAME;
+        modbook.name = cmd[3];
+        if (check_name(modbook.name) != SUCCESS)
+        {
+            return INVALID_ARG;
+        }
+    }
+    else if (strcmp(cmd[1], "price") == 0)
+    {
+        opflag = UPD_PRICE;
+        if (parse_uint(cmd[3], &modbook.price) != SUCCESS)
+        {
+            return INVALID_ARG;
+        }
+    }
+    else if (strcmp(cmd[1], "quantity") == 0)
+    {
+        opflag = UPD_QUANT;
+        if (parse_uint(cmd[3], &modbook.quantity) != SUCCESS)
+        {
+            return INVALID_ARG;
+        }
+    }
+    else
+    {
+        return INVALID_ARG;
+    }
+    return blist_op(booklist, &modbook, opflag);
+}
+
+int cmd_modall(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken != 5)
+    {
+        return INVALID_ARG;
+    }
+    book_t modbook;
+    modbook.name = cmd[2];
+    if (check_name(modbook.name) != SUCCESS || parse_uint(cmd[1], &modbook.sn) != SUCCESS || parse_uint(cmd[3], &modbook.price) != SUCCESS ||
+        parse_uint(cmd[4], &modbook.quantity) != SUCCESS)
+    {
+        return INVALID_ARG;
+    }
+    return blist_op(booklist, &modbook, UPD_NAME | UPD_PRICE | UPD_QUANT);
+}
+
+int cmd_write(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    int format = -1;
+    int arg = 1;
+    if (arg < ntoken && strcmp(cmd[arg], "text") == 0)
+    {
+        format = FORMAT_TEXT;
+        arg++;
+    }
+    else if (arg < ntoken && strcmp(cmd[arg], "binary") == 0)
+    {
+        format = FORMAT_BINARY;
+        arg++;
+    }
+    else if (arg < ntoken && strcmp(cmd[arg], "packed") == 0)
+    {
+        format = FORMAT_PACKED;
+        arg++;
+    }
+    int background = arg < ntoken && strcmp(cmd[arg], "bg") == 0;
+    if (arg + background != ntoken)
+    {
+        return INVALID_ARG;
+    }
+    // Journal already holds all modifications, make it durable.
+    if (ntoken == 1 && booklist->jnl != NULL)
+    {
+        pthread_mutex_lock(&booklist->jnl->buflock);
+        journal_write(booklist->jnl);
+        pthread_mutex_unlock(&booklist->jnl->buflock);
+        journal_sync(booklist->jnl);
+        return SUCCESS;
+    }
+    pthread_mutex_lock(&booklist->savelock);
+    int res = save_start(booklist, format, background);
+    pthread_mutex_unlock(&booklist->savelock);
+    return res ? IO_FAILED : SUCCESS;
+}
+
+int cmd_autosave(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    unsigned int autosave, autosecs;
+    if (ntoken == 1)
+    {
+        autosave = __atomic_load_n(&booklist->autosave, __ATOMIC_RELAXED);
+        autosecs = __atomic_load_n(&booklist->autosecs, __ATOMIC_RELAXED);
+        if (autosave == 0 && autosecs == 0)
+        {
+            ob_printf(out, "Autosave off\n");
+        }
+        else
+        {
+            ob_printf(out, "Autosave every %u modifications or %u seconds\n", autosave, autosecs);
+        }
+        return CMD_DONE;
+    }
+    if (ntoken == 2 && strcmp(cmd[1], "off") == 0)
+    {
+        autosave = 0;
+        autosecs = 0;
+    }
+    else if (ntoken != 3 || parse_uint(cmd[1], &autosave) != SUCCESS || parse_uint(cmd[2], &autosecs) != SUCCESS)
+    {
+        return INVALID_ARG;
+    }
+    // Read by every front end after its commands.
+    __atomic_store_n(&booklist->autosave, autosave, __ATOMIC_RELAXED);
+    __atomic_store_n(&booklist->autosecs, autosecs, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+int cmd_quit(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken != 1)
+    {
+        return INVALID_ARG;
+    }
+    return CMD_QUIT;
+}
+
+int cmd_mem(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken != 1)
+    {
+        return INVALID_ARG;
+    }
+    print_mem(booklist, out);
+    return CMD_DONE;
+}
+
+int cmd_stats(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken != 1)
+    {
+        return INVALID_ARG;
+    }
+    print_stats(booklist, out);
+    return CMD_DONE;
+}
+
+void print_stats(blist_t *booklist, outbuf_t *out)
+{
+    print_counters(out);
+    print_probes(booklist, out);
+    print_mem(booklist, out);
+}
+
+void print_counters(outbuf_t *out)
+{
+    stats_t *sum = (stats_t *)calloc(1, sizeof(stats_t));
+    if (sum == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    stats_sum(sum);
+    ob_printf(out, "command  calls       failed      p50 ns      p99 ns      max ns\n");
+    for (unsigned int i = 0; commands[i].verb != NULL; ++i)
+    {
+        if (sum->calls[i] > 0)
+        {
+            const hist_t *hist = &sum->latency[i];
+            ob_printf(out, "%-8s %-11llu %-11llu %-11llu %-11llu %llu\n", commands[i].verb, sum->calls[i], sum->failed[i], hist_quantile(hist, 0.5),
+                      hist_quantile(hist, 0.99), hist_max(hist));
+        }
+    }
+    ob_printf(out, "ops     ");
+    for (unsigned int i = 0; i < STATS_OPS; ++i)
+    {
+        ob_printf(out, " %s %llu,", stats_opname[i], sum->ops[i]);
+    }
+    ob_printf(out, " failed %llu\n", sum->opfail);
+    free(sum);
+}
+
+void print_probes(blist_t *booklist, outbuf_t *out)
+{
+    // Probe distances of SN map entries, the Robin Hood chain lengths.
+    blist_t **part = booklist->shard != NULL ? booklist->shard : &booklist;
+    unsigned int nparts = booklist->shard != NULL ? booklist->nshards : 1;
+    unsigned long long probe[STATS_PROBE_BINS] = {0};
+    unsigned long long entries = 0;
+    unsigned long long slots = 0;
+    unsigned int maxprobe = 0;
+    for (unsigned int i = 0; i < nparts; ++i)
+    {
+        snmap_table_t *table[2] = {&part[i]->snmap->cur, &part[i]->snmap->old};
+        for (int t = 0; t < 2; ++t)
+        {
+            entries += table[t]->n;
+            slots += table[t]->size;
+            for (unsigned int j = 0; j < table[t]->size; ++j)
+            {
+                if (table[t]->meta[j] == 0)
+                {
+                    continue;
+                }
+                // Bins 0, 1, 2, 3, 4-7, 8-15 and 16 up.
+                unsigned int dist = table[t]->meta[j] - 1;
+                unsigned int bin = dist < 4 ? dist : dist < 8 ? 4 : dist < 16 ? 5 : 6;
+                probe[bin]++;
+                maxprobe = dist > maxprobe ? dist : maxprobe;
+            }
+        }
+    }
+    ob_printf(out, "snmap    %llu entries, %llu slots, load %.2f, max probe %u\n", entries, slots, slots > 0 ? (double)entries / slots : 0.0,
+              maxprobe);
+    ob_printf(out, "probes   0: %llu, 1: %llu, 2: %llu, 3: %llu, 4-7: %llu, 8-15: %llu, 16+: %llu\n", probe[0], probe[1], probe[2], probe[3], probe[4],
+              probe[5], probe[6]);
+}
+
+void print_mem(blist_t *booklist, outbuf_t *out)
+{
+    // Totals over shards of a partitioned list.
+    blist_t **part = booklist->shard != NULL ? booklist->shard : &booklist;
+    unsigned int nparts = booklist->shard != NULL ? booklist->nshards : 1;
+    size_t held[3] = {0};
+    size_t used[3] = {0};
+    for (unsigned int i = 0; i < nparts; ++i)
+    {
+        held[0] += part[i]->books.held;
+        used[0] += part[i]->books.n;
+        held[1] += snmap_held(part[i]->snmap);
+        used[1] += part[i]->snmap->cur.n + part[i]->snmap->old.n;
+        if (part[i]->store != NULL)
+        {
+            held[2] += bstore_held(part[i]->store);
+            used[2] += part[i]->store->n;
+        }
+    }
+    size_t iheld, iused;
+    unsigned int nnames;
+    intern_usage(&iheld, &iused, &nnames);
+    ob_printf(out, "books    %zu bytes held, %zu entries\n", held[0], used[0]);
+    ob_printf(out, "names    %zu bytes held, %zu bytes used, %u distinct (shared)\n", iheld, iused, nnames);
+    ob_printf(out, "snmap    %zu bytes held, %zu entries\n", held[1], used[1]);
+    if (booklist->img != NULL)
+    {
+        ob_printf(out, "image    %zu bytes mapped, %u records live\n", booklist->img->size, booklist->img->live);
+    }
+    if (booklist->img != NULL && booklist->img->cache != NULL)
+    {
+        pcache_t *cache = booklist->img->cache;
+        unsigned int cached = 0;
+        pthread_mutex_lock(&cache->lock);
+        for (unsigned int i = 0; i < cache->nframes; ++i)
+        {
+            cached += cache->frame[i].page != UINT_MAX;
+        }
+        ob_printf(out, "pages    %u of %u cached, %llu hits, %llu misses, %llu written back\n", cached, cache->npages, cache->hits, cache->misses,
+                  cache->writebacks);
+        pthread_mutex_unlock(&cache->lock);
+    }
+    if (booklist->store != NULL)
+    {
+        ob_printf(out, "columns  %zu bytes held, %zu rows\n", held[2], used[2]);
+    }
+    if (booklist->ledger != NULL)
+    {
+        pthread_mutex_lock(&booklist->ledger->lock);
+        ob_printf(out, "ledger   %zu bytes held, %u books\n", ledger_held(booklist->ledger), booklist->ledger->nbook);
+        pthread_mutex_unlock(&booklist->ledger->lock);
+    }
+    if (booklist->shard != NULL)
+    {
+        ob_printf(out, "shards   %u\n", booklist->nshards);
+    }
+}
+
+int cmd_sort(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if ((strcmp(cmd[0], "sort") == 0 && ntoken != 3) || (strcmp(cmd[0], "range") == 0 && ntoken != 4))
+    {
+        return INVALID_ARG;
+    }
+    int type;
+    if (strcmp(cmd[1], "price") == 0)
+    {
+        type = IDX_PRICE;
+    }
+    else if (strcmp(cmd[1], "name") == 0)
+    {
+        type = IDX_NAME;
+    }
+    else
+    {
+        return INVALID_ARG;
+    }
+    idxcur_t cursor;
+    skipnode_t *current;
+    book_t book;
+    if (strcmp(cmd[0], "sort") == 0)
+    {
+        if (strcmp(cmd[2], "a") != 0 && strcmp(cmd[2], "d") != 0)
+        {
+            return INVALID_ARG;
+        }
+        idxcur_init(&cursor, booklist, type, strcmp(cmd[2], "d") == 0);
+        cursor.yield = 1;
+        while ((current = idxcur_next(&cursor)) != NULL)
+        {
+            if (blist_view(booklist, current->sn, &book) != SUCCESS)
+            {
+                return MAP_INCONSIST;
+            }
+            ob_printf(out, "%u %s %u %u\n", book.sn, book.name, book.price, book.quantity);
+        }
+        return CMD_DONE;
+    }
+    // Seek to lower bound, stream until upper bound.
+    unsigned int lo, hi;
+    idxcur_init(&cursor, booklist, type, 0);
+    cursor.yield = 1;
+    if (type == IDX_PRICE)
+    {
+        if (parse_uint(cmd[2], &lo) != SUCCESS || parse_uint(cmd[3], &hi) != SUCCESS)
+        {
+            return INVALID_ARG;
+        }
+        idxcur_seek(&cursor, lo, NULL);
+    }
+    else
+    {
+        idxcur_seek(&cursor, 0, cmd[2]);
+    }
+    while ((current = idxcur_next(&cursor)) != NULL)
+    {
+        if (type == IDX_PRICE ? current->num > hi : strcmp(current->str, cmd[3]) > 0)
+        {
+            break;
+        }
+        if (blist_view(booklist, current->sn, &book) != SUCCESS)
+        {
+            return MAP_INCONSIST;
+        }
+        ob_printf(out, "%u %s %u %u\n", book.sn, book.name, book.price, book.quantity);
+    }
+    return CMD_DONE;
+}
+
+int cmd_top(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken != 3)
+    {
+        return INVALID_ARG;
+    }
+    unsigned int k;
+    int type;
+    if (parse_uint(cmd[1], &k) != SUCCESS)
+    {
+        return INVALID_ARG;
+    }
+    if (strcmp(cmd[2], "price") == 0)
+    {
+        type = IDX_PRICE;
+    }
+    else if (strcmp(cmd[2], "quantity") == 0)
+    {
+        type = IDX_QUANT;
+    }
+    else if (strcmp(cmd[2], "value") == 0)
+    {
+        type = IDX_VALUE;
+    }
+    else
+    {
+        return INVALID_ARG;
+    }
+    // Walk back from the largest key.
+    book_t book;
+    idxcur_t cursor;
+    skipnode_t *current;
+    idxcur_init(&cursor, booklist, type, 1);
+    cursor.yield = 1;
+    for (unsigned int i = 0; i < k && (current = idxcur_next(&cursor)) != NULL; ++i)
+    {
+        if (blist_view(booklist, current->sn, &book) != SUCCESS)
+        {
+            return MAP_INCONSIST;
+        }
+        ob_printf(out, "%u %s %u %u\n", book.sn, book.name, book.price, book.quantity);
+    }
+    return CMD_DONE;
+}
+
+int cmd_sell(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken != 3)
+    {
+        return INVALID_ARG;
+    }
+    book_t data;
+    if (parse_uint(cmd[1], &data.sn) != SUCCESS || parse_uint(cmd[2], &data.quantity) != SUCCESS)
+    {
+        return INVALID_ARG;
+    }
+    return blist_op(booklist, &data, SELL_BOOK);
+}
+
+int cmd_order(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken < 2)
+    {
+        return INVALID_ARG;
+    }
+    orderline_t *line;
+    unsigned int n;
+    if (cmd[1][0] == '@')
+    {
+        if (ntoken != 2 || (n = read_order(cmd[1] + 1, &line)) == 0)
+        {
+            return INVALID_ARG;
+        }
+    }
+    else
+    {
+        n = ntoken - 1;
+        line = (orderline_t *)malloc(sizeof(orderline_t) * n);
+        if (line == NULL)
+        {
+            error_die("Malloc failed");
+        }
+        for (unsigned int i = 0; i < n; ++i)
+        {
+            if (parse_orderline(cmd[i + 1], &line[i]) != SUCCESS)
+            {
+                free(line);
+                return INVALID_ARG;
+            }
+        }
+    }
+    int res = blist_order(booklist, line, n);
+    // Per line results, lines of a rejected basket are left unsold.
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        if (line[i].res != SUCCESS)
+        {
+            ob_printf(out, "%u:%u %s\n", line[i].sn, line[i].quantity, result_msg(line[i].res));
+        }
+        else if (res != SUCCESS)
+        {
+            ob_printf(out, "%u:%u Not sold\n", line[i].sn, line[i].quantity);
+        }
+        else
+        {
+            ob_printf(out, "%u:%u Sold, %u left\n", line[i].sn, line[i].quantity, line[i].left);
+        }
+    }
+    free(line);
+    return res;
+}
+
+int cmd_import(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken < 2 || ntoken > 3 || cmd[1][0] != '@' || (ntoken == 3 && strcmp(cmd[2], "atomic") != 0))
+    {
+        return INVALID_ARG;
+    }
+    feed_t *feed = feed_open(cmd[1] + 1);
+    if (feed == NULL)
+    {
+        return INVALID_ARG;
+    }
+    // An atomic feed is read whole. Otherwise BATCH_OPS lines are applied
+    // at a time, those before a malformed line stay applied.
+    int atomic = ntoken == 3;
+    unsigned int max = atomic ? UINT_MAX : BATCH_OPS;
+    unsigned int n = 0;
+    unsigned int nfail = 0;
+    int res = SUCCESS;
+    while (res == SUCCESS)
+    {
+        res = feed_read(feed, max);
+        if (feed->n == 0 || (atomic && res != SUCCESS))
+        {
+            break;
+        }
+        int batchres = blist_batch(booklist, feed->op, feed->n, atomic);
+        // Only failed lines are listed, an atomic feed stops at the first.
+        for (unsigned int i = 0; i < feed->n; ++i)
+        {
+            if (feed->op[i].res != SUCCESS)
+            {
+                ob_printf(out, "%u %s\n", feed->op[i].data.sn, result_msg(feed->op[i].res));
+                nfail++;
+            }
+        }
+        n += feed->n;
+        if (atomic && batchres != SUCCESS)
+        {
+            res = batchres;
+        }
+    }
+    feed_close(feed);
+    if (n == 0 && res == SUCCESS)
+    {
+        // Empty feed.
+        res = INVALID_ARG;
+    }
+    if (n > 0 && (res == SUCCESS || !atomic))
+    {
+        ob_printf(out, "%u imported, %u failed\n", n - nfail, nfail);
+    }
+    return res == SUCCESS ? CMD_DONE : res;
+}
+
+int cmd_find(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken != 3)
+    {
+        return INVALID_ARG;
+    }
+    book_t book;
+    size_t len = strlen(cmd[2]);
+    if (strcmp(cmd[1], "prefix") == 0)
+    {
+        // Names with the prefix are adjacent in the name index.
+        idxcur_t cursor;
+        skipnode_t *current;
+        idxcur_init(&cursor, booklist, IDX_NAME, 0);
+        cursor.yield = 1;
+        idxcur_seek(&cursor, 0, cmd[2]);
+        while ((current = idxcur_next(&cursor)) != NULL && strncmp(current->str, cmd[2], len) == 0)
+        {
+            if (blist_view(booklist, current->sn, &book) != SUCCESS)
+            {
+                return MAP_INCONSIST;
+            }
+            ob_printf(out, "%u %s %u %u\n", book.sn, book.name, book.price, book.quantity);
+        }
+        return CMD_DONE;
+    }
+    if (strcmp(cmd[1], "contains") != 0)
+    {
+        return INVALID_ARG;
+    }
+    if (len < 3)
+    {
+        // Too short for trigrams, scan all names in SN order.
+        idxcur_t cursor;
+        skipnode_t *current;
+        idxcur_init(&cursor, booklist, IDX_SN, 0);
+        cursor.yield = 1;
+        while ((current = idxcur_next(&cursor)) != NULL)
+        {
+            if (blist_view(booklist, current->sn, &book) != SUCCESS)
+            {
+                return MAP_INCONSIST;
+            }
+            if (strstr(book.name, cmd[2]) != NULL)
+            {
+                ob_printf(out, "%u %s %u %u\n", book.sn, book.name, book.price, book.quantity);
+            }
+        }
+        return CMD_DONE;
+    }
+    blist_trigram(booklist);
+    blist_t **part = booklist->shard != NULL ? booklist->shard : &booklist;
+    unsigned int nparts = booklist->shard != NULL ? booklist->nshards : 1;
+    unsigned int checked = 0;
+    for (unsigned int j = 0; j < nparts; ++j)
+    {
+        unsigned int *cand;
+        unsigned int ncand = trigram_search(part[j]->trigram, cmd[2], &cand);
+        int yielded = 0;
+        for (unsigned int i = 0; i < ncand; ++i)
+        {
+            // Writers get in between pages, candidates may be gone since.
+            if (++checked % IDXCUR_PAGE_BOOKS == 0)
+            {
+                blist_yield(booklist);
+                yielded = 1;
+            }
+            // Trigrams may match out of order, check the name itself.
+            int res = blist_view(part[j], cand[i], &book);
+            if (res == BOOK_NONEXIST && yielded)
+            {
+                continue;
+            }
+            if (res != SUCCESS)
+            {
+                free(cand);
+                return MAP_INCONSIST;
+            }
+            if (strstr(book.name, cmd[2]) != NULL)
+            {
+                ob_printf(out, "%u %s %u %u\n", book.sn, book.name, book.price, book.quantity);
+            }
+        }
+        free(cand);
+    }
+    return CMD_DONE;
+}
+
+int cmd_watch(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    unsigned int threshold = 0;
+    int watch = 1;
+    if (ntoken == 2 && strcmp(cmd[1], "off") == 0)
+    {
+        watch = 0;
+    }
+    else if (ntoken != 4 || strcmp(cmd[1], "quantity") != 0 || strcmp(cmd[2], "<") != 0)
+    {
+        return INVALID_ARG;
+    }
+    else if (parse_uint(cmd[3], &threshold) != SUCCESS)
+    {
+        return INVALID_ARG;
+    }
+    // Shards check the threshold themselves.
+    for (unsigned int i = 0; booklist->shard != NULL && i < booklist->nshards; ++i)
+    {
+        booklist->shard[i]->watch = watch;
+        booklist->shard[i]->threshold = threshold;
+    }
+    booklist->watch = watch;
+    booklist->threshold = threshold;
+    if (watch)
+    {
+        blist_index(booklist, IDX_QUANT);
+    }
+    return SUCCESS;
+}
+
+int cmd_lowstock(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken != 1 || !booklist->watch)
+    {
+        return INVALID_ARG;
+    }
+    book_t book;
+    idxcur_t cursor;
+    skipnode_t *current;
+    idxcur_init(&cursor, booklist, IDX_QUANT, 0);
+    cursor.yield = 1;
+    while ((current = idxcur_next(&cursor)) != NULL && current->num < booklist->threshold)
+    {
+        if (blist_view(booklist, current->sn, &book) != SUCCESS)
+        {
+            return MAP_INCONSIST;
+        }
+        ob_printf(out, "%u %s %u %u\n", book.sn, book.name, book.price, book.quantity);
+    }
+    return CMD_DONE;
+}
+
+int cmd_revenue(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken < 2 || ntoken > 4 || booklist->ledger == NULL)
+    {
+        return INVALID_ARG;
+    }
+    unsigned int sn = 0;
+    int all = strcmp(cmd[1], "all") == 0;
+    if (!all && parse_uint(cmd[1], &sn) != SUCCESS)
+    {
+        return INVALID_ARG;
+    }
+    // Whole hours, TO includes its day or hour.
+    unsigned int from = 0;
+    unsigned int to = UINT_MAX;
+    unsigned int span;
+    if (ntoken >= 3 && parse_hour(cmd[2], &from, &span) != SUCCESS)
+    {
+        return INVALID_ARG;
+    }
+    if (ntoken == 4)
+    {
+        if (parse_hour(cmd[3], &to, &span) != SUCCESS)
+        {
+            return INVALID_ARG;
+        }
+        to += span;
+    }
+    unsigned long long units = 0;
+    unsigned long long revenue = 0;
+    ledger_t *ledger = booklist->ledger;
+    pthread_mutex_lock(&ledger->lock);
+    rollup_t *roll = all ? &ledger->all : ledger_book(ledger, sn, 0);
+    if (roll != NULL)
+    {
+        rollup_sum(roll, from, to, &units, &revenue);
+    }
+    pthread_mutex_unlock(&ledger->lock);
+    ob_printf(out, "%llu units sold, revenue %llu\n", units, revenue);
+    return CMD_DONE;
+}
+
+int cmd_query(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    if (ntoken != 3)
+    {
+        return INVALID_ARG;
+    }
+    char bookname[MAX_BOOKNAME_LEN + 1];
+    book_t qrybook;
+    qrybook.name = bookname;
+    if (parse_uint(cmd[2], &qrybook.sn) != SUCCESS)
+    {
+        return INVALID_ARG;
+    }
+    if (strcmp(cmd[1], "name") != 0 && strcmp(cmd[1], "price") != 0 &&
+        strcmp(cmd[1], "quantity") != 0 && strcmp(cmd[1], "all") != 0)
+    {
+        return INVALID_ARG;
+    }
+    int opres = blist_op(booklist, &qrybook, QRY_BOOK);
+    if (opres < 0)
+    {
+        return opres;
+    }
+    if (strcmp(cmd[1], "name") == 0)
+    {
+        ob_printf(out, "%s\n", qrybook.name);
+    }
+    else if (strcmp(cmd[1], "price") == 0)
+    {
+        ob_printf(out, "%u\n", qrybook.price);
+    }
+    else if (strcmp(cmd[1], "quantity") == 0)
+    {
+        ob_printf(out, "%u\n", qrybook.quantity);
+    }
+    else
+    {
+        ob_printf(out, "%u %s %u %u\n", qrybook.sn, qrybook.name, qrybook.price, qrybook.quantity);
+    }
+    return CMD_DONE;
+}
+
+int cmd_queryall(blist_t *booklist, char **cmd, int ntoken, outbuf_t *out)
+{
+    // Leading numbers are limit and cursor, then filters.
+    unsigned int limit = 0;
+    unsigned int num[2];
+    int arg = 1;
+    scan_t scan;
+    scan_init(&scan);
+    if (arg < ntoken && parse_uint(cmd[arg], &limit) == SUCCESS)
+    {
+        if (limit == 0)
+        {
+            return INVALID_ARG;
+        }
+        arg++;
+        if (arg < ntoken && strcmp(cmd[arg], "end") == 0)
+        {
+            scan.next = SCAN_END;
+            arg++;
+        }
+        else if (arg < ntoken && parse_uint(cmd[arg], &num[0]) == SUCCESS)
+        {
+            scan.next = num[0];
+            arg++;
+        }
+    }
+    while (arg + 3 <= ntoken)
+    {
+        if (parse_uint(cmd[arg + 1], &num[0]) != SUCCESS || parse_uint(cmd[arg + 2], &num[1]) != SUCCESS || num[0] > num[1])
+        {
+            return INVALID_ARG;
+        }
+        if (strcmp(cmd[arg], "price") == 0)
+        {
+            scan.minprice = num[0];
+            scan.maxprice = num[1];
+        }
+        else if (strcmp(cmd[arg], "quantity") == 0)
+        {
+            scan.minquant = num[0];
+            scan.maxquant = num[1];
+        }
+        else
+        {
+            return INVALID_ARG;
+        }
+        arg += 3;
+    }
+    if (arg != ntoken)
+    {
+        return INVALID_ARG;
+    }
+    book_t page[SCAN_PAGE_BOOKS];
+    unsigned int left = limit;
+    int streamed = 0;
+    do
+    {
+        unsigned int want = limit > 0 && left < SCAN_PAGE_BOOKS ? left : SCAN_PAGE_BOOKS;
+        int n = blist_scan(booklist, &scan, page, want);
+        if (n < 0)
+        {
+            return n;
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            ob_printf(out, "%u %s %u %u\n", page[i].sn, page[i].name, page[i].price, page[i].quantity);
+        }
+        left -= limit > 0 ? n : 0;
+        if (scan.next == SCAN_END || (limit > 0 && left == 0))
+        {
+            // Front end sends the last page.
+            break;
+        }
+        // Pages resume by SN, writers get in between them.
+        if (out->fd < 0)
+        {
+            blist_yield(booklist);
+            continue;
+        }
+        // Stream long listings page by page, with the shards let go and
+        // earlier results of the session committed first.
+        blist_unlock(booklist);
+        if (!streamed && booklist->jnl != NULL)
+        {
+            journal_commit(booklist);
+        }
+        streamed = 1;
+        ob_flush(out);
+        blist_lock(booklist);
+    } while (scan.next != SCAN_END && (limit == 0 || left > 0));
+    if (limit > 0)
+    {
+        if (scan.next == SCAN_END)
+        {
+            ob_printf(out, "cursor end\n");
+        }
+        else
+        {
+            ob_printf(out, "cursor %llu\n", scan.next);
+        }
+    }
+    return CMD_DONE;
+}
+
+int cmd_use(session_t *session, char **cmd, int ntoken, outbuf_t *out)
+{
+    catalogs_t *cats = session->cats;
+    if (ntoken == 1)
+    {
+        pthread_mutex_lock(&cats->lock);
+        for (catalog_t *cat = cats->head; cat != NULL; cat = cat->next)
+        {
+            char mark = cat == session->cur ? '*' : ' ';
+            if (cat->blist != NULL)
+            {
+                ob_printf(out, "%c %-16s loaded, %zu bytes, %u sessions\n", mark, cat->name, cat->held, cat->refs);
+            }
+            else
+            {
+                ob_printf(out, "%c %-16s not loaded\n", mark, cat->name);
+            }
+        }
+        pthread_mutex_unlock(&cats->lock);
+        return CMD_DONE;
+    }
+    if (ntoken != 2)
+    {
+        return INVALID_ARG;
+    }
+    catalog_t *cat = catalog_find(cats, cmd[1]);
+    if (cat == NULL)
+    {
+        return INVALID_ARG;
+    }
+    if (cat == session->cur)
+    {
+        return SUCCESS;
+    }
+    catalog_acquire(cats, cat, cats->verbose ? out : NULL);
+    // Front end commits the new catalog only, results so far need the old one.
+    blist_t *old = session->cur->blist;
+    if (old->jnl != NULL)
+    {
+        journal_commit(old);
+    }
+    catalog_release(cats, session->cur);
+    session->cur = cat;
+    return SUCCESS;
+}
+
+// Catalog functions.
+
+catalogs_t *catalogs_create(const char *datapath)
+{
+    catalogs_t *new = (catalogs_t *)calloc(1, sizeof(catalogs_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    pthread_mutex_init(&new->lock, NULL);
+    const char *base = strrchr(datapath, '/');
+    new->dir = base != NULL ? strndup(datapath, base == datapath ? 1 : base - datapath) : strdup(".");
+    base = base != NULL ? base + 1 : datapath;
+    // Default catalog is named after its file, without extension.
+    size_t len = strlen(base);
+    if (len > 4 && strcmp(base + len - 4, ".dat") == 0)
+    {
+        len -= 4;
+    }
+    char name[NAME_MAX + 1];
+    snprintf(name, sizeof(name), "%.*s", (int)len, base);
+    new->dflt = catalog_add(new, name, datapath);
+    // Data files of the directory are listed before first use.
+    DIR *dir = opendir(new->dir);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL)
+    {
+        len = strlen(entry->d_name);
+        if (len > 4 && strcmp(entry->d_name + len - 4, ".dat") == 0)
+        {
+            entry->d_name[len - 4] = '\0';
+            catalog_find(new, entry->d_name);
+        }
+    }
+    if (dir != NULL)
+    {
+        closedir(dir);
+    }
+    return new;
+}
+
+void catalogs_destroy(catalogs_t *cats)
+{
+    // Unsaved catalogs are left to their journals, as on quit.
+    catalog_t *current = cats->head;
+    catalog_t *temp = NULL;
+    while (current != NULL)
+    {
+        temp = current;
+        current = current->next;
+        if (temp->blist != NULL)
+        {
+            blist_destroy(temp->blist);
+        }
+        pthread_cond_destroy(&temp->cond);
+        free(temp->name);
+        free(temp->path);
+        free(temp);
+    }
+    pthread_mutex_destroy(&cats->lock);
+    free(cats->dir);
+    free(cats->statspath);
+    free(cats);
+}
+
+catalog_t *catalog_add(catalogs_t *cats, const char *name, const char *path)
+{
+    catalog_t *new = (catalog_t *)calloc(1, sizeof(catalog_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    new->name = strdup(name);
+    new->path = strdup(path);
+    pthread_cond_init(&new->cond, NULL);
+    catalog_t **tail = &cats->head;
+    while (*tail != NULL)
+    {
+        tail = &(*tail)->next;
+    }
+    *tail = new;
+    return new;
+}
+
+catalog_t *catalog_find(catalogs_t *cats, const char *name)
+{
+    // Name becomes a file name of the catalog directory.
+    size_t len = strlen(name);
+    if (len == 0 || len > MAX_LISTNAME_LEN || name[0] == '.' || strspn(name, CATALOG_NAME_CHARS) != len)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&cats->lock);
+    catalog_t *cat = cats->head;
+    while (cat != NULL && strcmp(cat->name, name) != 0)
+    {
+        cat = cat->next;
+    }
+    if (cat == NULL)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s.dat", cats->dir, name);
+        cat = catalog_add(cats, name, path);
+    }
+    pthread_mutex_unlock(&cats->lock);
+    return cat;
+}
+
+void catalog_acquire(catalogs_t *cats, catalog_t *cat, outbuf_t *out)
+{
+    pthread_mutex_lock(&cats->lock);
+    while (cat->busy)
+    {
+        pthread_cond_wait(&cat->cond, &cats->lock);
+    }
+    if (cat->blist == NULL)
+    {
+        // Other catalogs stay usable while this one is read.
+        cat->busy = 1;
+        pthread_mutex_unlock(&cats->lock);
+        blist_t *blist = catalog_load(cats, cat, out);
+        size_t held = blist_held(blist);
+        pthread_mutex_lock(&cats->lock);
+        cat->blist = blist;
+        cat->held = held;
+        cat->busy = 0;
+        pthread_cond_broadcast(&cat->cond);
+    }
+    cat->refs++;
+    cat->used = ++cats->clock;
+    catalogs_evict(cats);
+    pthread_mutex_unlock(&cats->lock);
+}
+
+void catalog_release(catalogs_t *cats, catalog_t *cat)
+{
+    pthread_mutex_lock(&cats->lock);
+    if (--cat->refs == 0)
+    {
+        // Unused list stays as it is until acquired again.
+        cat->held = blist_held(cat->blist);
+        catalogs_evict(cats);
+    }
+    pthread_mutex_unlock(&cats->lock);
+}
+
+blist_t *catalog_load(catalogs_t *cats, catalog_t *cat, outbuf_t *out)
+{
+    // Read data from save location.
+    blist_t *blist = blist_create(cats->engine);
+    blist->path = strdup(cat->path);
+    blist->pagecache = cats->pagecache;
+    blist->autosave = cats->autosave;
+    blist->autosecs = cats->autosecs;
+    blist->savedat = clock_ns();
+    if (read_data(blist, cat->path, cats->nthreads))
+    {
+        if (cat != cats->dflt)
+        {
+            free(blist->name);
+            blist->name = strdup(cat->name);
+        }
+        if (out != NULL)
+        {
+            ob_printf(out, "Saved data not found, new data file created\n\n");
+        }
+    }
+    if (cats->nshards > 1)
+    {
+        blist_shard(blist, cats->nshards);
+    }
+    // Recover modifications since last snapshot.
+    if (cats->journal)
+    {
+        char jpath[PATH_MAX];
+        int nreplay = 0;
+        snprintf(jpath, sizeof(jpath), "%s.journal.old", cat->path);
+        nreplay += journal_replay(blist, jpath);
+        snprintf(jpath, sizeof(jpath), "%s.journal", cat->path);
+        nreplay += journal_replay(blist, jpath);
+        if (nreplay > 0 && out != NULL)
+        {
+            ob_printf(out, "Recovered %d modifications from journal\n\n", nreplay);
+        }
+        blist->jnl = journal_open(cat->path);
+    }
+    blist->ledger = ledger_open(cat->path);
+    if (blist->jnl != NULL)
+    {
+        blist->jnl->ledgerfd = blist->ledger->fd;
+    }
+    return blist;
+}
+
+int catalog_unload(catalog_t *cat, blist_t *blist)
+{
+    // Without a journal, modifications live in memory only.
+    pthread_mutex_lock(&blist->savelock);
+    save_join(blist);
+    pthread_mutex_unlock(&blist->savelock);
+    if (blist->jnl == NULL && save_data(blist, NULL, blist->path, blist->format) != 0)
+    {
+        fprintf(stderr, "Failed to save catalog %s, kept loaded\n", cat->name);
+        return -1;
+    }
+    blist_destroy(blist);
+    return 0;
+}
+
+void catalogs_evict(catalogs_t *cats)
+{
+    // Caller holds lock. Least recently used catalogs go first, those in
+    // use stay.
+    while (cats->budget > 0 && catalogs_held(cats) > cats->budget)
+    {
+        catalog_t *victim = NULL;
+        for (catalog_t *cat = cats->head; cat != NULL; cat = cat->next)
+        {
+            if (cat->blist != NULL && cat->refs == 0 && !cat->busy && (victim == NULL || cat->used < victim->used))
+            {
+                victim = cat;
+            }
+        }
+        if (victim == NULL)
+        {
+            return;
+        }
+        // Saved with the registry unlocked, the list is hidden from
+        // others meanwhile.
+        blist_t *blist = victim->blist;
+        victim->blist = NULL;
+        victim->busy = 1;
+        pthread_mutex_unlock(&cats->lock);
+        int res = catalog_unload(victim, blist);
+        pthread_mutex_lock(&cats->lock);
+        if (res != 0)
+        {
+            victim->blist = blist;
+        }
+        else
+        {
+            victim->held = 0;
+        }
+        victim->busy = 0;
+        pthread_cond_broadcast(&victim->cond);
+        if (res != 0)
+        {
+            return;
+        }
+    }
+}
+
+size_t catalogs_held(catalogs_t *cats)
+{
+    // Shared names count once, by bytes in use.
+    size_t held, used;
+    unsigned int n;
+    intern_usage(&held, &used, &n);
+    for (catalog_t *cat = cats->head; cat != NULL; cat = cat->next)
+    {
+        used += cat->held;
+    }
+    return used;
+}
+
+// Output buffer functions.
+
+void ob_init(outbuf_t *ob, int fd)
+{
+    ob->data = (char *)malloc(OUTBUF_INIT_SIZE);
+    if (ob->data == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    ob->used = 0;
+    ob->size = OUTBUF_INIT_SIZE;
+    ob->fd = fd;
+}
+
+void ob_printf(outbuf_t *ob, const char *fmt, ...)
+{
+    va_list args;
+    while (1)
+    {
+        va_start(args, fmt);
+        int len = vsnprintf(ob->data + ob->used, ob->size - ob->used, fmt, args);
+        va_end(args);
+        if (len < 0)
+        {
+            error_die("Output format error");
+        }
+        if ((size_t)len < ob->size - ob->used)
+        {
+            ob->used += len;
+            return;
+        }
+        // Grow and retry.
+        while (ob->size - ob->used <= (size_t)len)
+        {
+            ob->size *= 2;
+        }
+        ob->data = (char *)realloc(ob->data, ob->size);
+        if (ob->data == NULL)
+        {
+            error_die("Malloc failed");
+        }
+    }
+}
+
+void ob_flush(outbuf_t *ob)
+{
+    if (ob->fd < 0)
+    {
+        return;
+    }
+    size_t done = 0;
+    while (done < ob->used)
+    {
+        ssize_t res = write(ob->fd, ob->data + done, ob->used - done);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error_die(strerror(errno));
+        }
+        done += res;
+    }
+    ob->used = 0;
+}
+
+void ob_destroy(outbuf_t *ob)
+{
+    free(ob->data);
+    ob->data = NULL;
+}
+
+void error_die(const char *msg)
+{
+    fprintf(stderr, "Fatal error: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
 
 // Booklist functions.
 
-book_t *book_create()
+book_t *book_create(blist_t *blist)
+{
+    book_t *new = (book_t *)pool_alloc(&blist->books);
+    memset(new, 0, sizeof(book_t));
+    return new;
+}
+
+blist_t *blist_create(int engine)
+{
+    blist_t *new = (blist_t *)malloc(sizeof(blist_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    memset(new, 0, sizeof(blist_t));
+    new->engine = engine;
+    if (engine == ENGINE_COLUMN)
+    {
+        new->store = bstore_create();
+    }
+    new->snmap = snmap_create();
+    pool_init(&new->books, sizeof(book_t));
+    pthread_mutex_init(&new->snaplock, NULL);
+    // Snapshots would wait out a steady stream of baskets otherwise.
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&new->gate, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&new->savelock, NULL);
+    return new;
+}
+
+void book_destroy(blist_t *blist, book_t *book)
+{
+    blist_retire(blist, book->name);
+    pool_free(&blist->books, book);
+}
+
+void blist_destroy(blist_t *blist)
+{
+    // Background save and compaction still read the list.
+    save_join(blist);
+    if (blist->jnl != NULL && blist->jnl->compactor != NULL)
+    {
+        journal_reap(blist->jnl);
+    }
+    for (unsigned int i = 0; blist->shard != NULL && i < blist->nshards; ++i)
+    {
+        // Image belongs to parent.
+        blist->shard[i]->img = NULL;
+        pthread_mutex_destroy(&blist->shard[i]->lock);
+        blist_destroy(blist->shard[i]);
+    }
+    free(blist->shard);
+    // Entries live in pools, release whole slabs at once.
+    blist_put_names(blist);
+    pool_destroy(&blist->books);
+    if (blist->store != NULL)
+    {
+        bstore_destroy(blist->store);
+    }
+    if (blist->img != NULL)
+    {
+        img_close(blist->img);
+    }
+    if (blist->ledger != NULL)
+    {
+        ledger_close(blist->ledger);
+    }
+    if (blist->jnl != NULL)
+    {
+        journal_close(blist->jnl);
+    }
+    for (int i = 0; i < IDX_COUNT; ++i)
+    {
+        if (blist->index[i] != NULL)
+        {
+            skip_destroy(blist->index[i]);
+        }
+    }
+    if (blist->trigram != NULL)
+    {
+        trigram_destroy(blist->trigram);
+    }
+    free(blist->alert);
+    free(blist->limbo);
+    pthread_mutex_destroy(&blist->snaplock);
+    pthread_rwlock_destroy(&blist->gate);
+    pthread_mutex_destroy(&blist->savelock);
+    snmap_destroy(blist->snmap);
+    free(blist->name);
+    free(blist->path);
+    free(blist);
+}
+
+int blist_op(blist_t *blist, book_t *data, int opflag)
+{
+    // Only the shard of the book is locked.
+    blist_t *shard = blist_route(blist, data->sn);
+    if (shard != blist)
+    {
+        pthread_mutex_lock(&shard->lock);
+    }
+    unsigned int sold = opflag & SELL_BOOK ? data->quantity : 0;
+    int res = blist_apply(shard, data, opflag);
+    if (res == SUCCESS && (opflag & SELL_BOOK) && blist->ledger != NULL)
+    {
+        ledger_sell(blist->ledger, data->sn, sold, data->price);
+    }
+    // Log successful modification.
+    if (res == SUCCESS && blist->jnl != NULL && !(opflag & QRY_BOOK))
+    {
+        // Sells are logged as their absolute quantity.
+        journal_append(blist->jnl, data, opflag & SELL_BOOK ? UPD_QUANT : opflag);
+    }
+    if (res == SUCCESS && !(opflag & QRY_BOOK))
+    {
+        __atomic_add_fetch(&blist->nmods, 1, __ATOMIC_RELAXED);
+    }
+    if (shard != blist)
+    {
+        pthread_mutex_unlock(&shard->lock);
+    }
+    stats_t *stats = stats_local();
+    stats_add(&stats->ops[stats_op(opflag)], 1);
+    if (res != SUCCESS)
+    {
+        stats_add(&stats->opfail, 1);
+    }
+    return res;
+}
+
+int blist_apply(blist_t *blist, book_t *data, int opflag)
+{
+    if (blist->shard != NULL)
+    {
+        return blist_apply(blist_route(blist, data->sn), data, opflag);
+    }
+    return blist_apply_node(blist, snmap_query(blist->snmap, data->sn), data, opflag);
+}
+
+int blist_apply_node(blist_t *blist, snmap_node_t *node, book_t *data, int opflag)
+{
+    // Node is the SN map slot of the book, NULL if it is not in the engine.
+    book_t before;
+    book_t after;
+    if (opflag == 0)
+    {
+        return INVALID_ARG;
+    }
+    else if (opflag & DEL_BOOK) // Delete entry.
+    {
+        if (opflag ^ DEL_BOOK) // Other flags present.
+        {
+            return INVALID_ARG;
+        }
+        if (node == NULL)
+        {
+            // Delete from mapped image.
+            imgrec_t rec;
+            long idx = img_query(blist->img, data->sn, &rec);
+            if (idx < 0)
+            {
+                return BOOK_NONEXIST;
+            }
+            img_view(blist->img, &rec, &before);
+            blist_index_update(blist, &before, NULL);
+            rec.flags |= IMGREC_DELETED;
+            blist_img_store(blist, idx, &rec);
+            // Image is shared by shards.
+            __atomic_sub_fetch(&blist->img->live, 1, __ATOMIC_RELAXED);
+            blist->n--;
+            return SUCCESS;
+        }
+        if (blist->engine == ENGINE_COLUMN)
+        {
+            bstore_t *store = blist->store;
+            unsigned int row = node->row;
+            if (store->sn[row] != data->sn)
+            {
+                return MAP_INCONSIST;
+            }
+            bstore_view(store, row, &before);
+            blist_index_update(blist, &before, NULL);
+            // Remove hashmap entry.
+            snmap_remove(blist->snmap, data->sn);
+            blist_retire(blist, store->name[row]);
+            // Last row moves into the hole, repoint its entry.
+            bstore_remove(store, row);
+            if (row < store->n)
+            {
+                snmap_query(blist->snmap, store->sn[row])->row = row;
+            }
+            blist->n--;
+            return SUCCESS;
+        }
+        book_t *current = node->book;
+        if (current->sn != data->sn)
+        {
+            return MAP_INCONSIST;
+        }
+        blist_index_update(blist, current, NULL);
+        // Unlink entry.
+        if (current->prev != NULL)
+        {
+            current->prev->next = current->next;
+        }
+        else
+        {
+            blist->head = current->next;
+        }
+        if (current->next != NULL)
+        {
+            current->next->prev = current->prev;
+        }
+        // Remove hashmap entry.
+        snmap_remove(blist->snmap, data->sn);
+        book_destroy(blist, current);
+        blist->n--;
+        return SUCCESS;
+    }
+    else if (opflag & NEW_BOOK)
+    {
+        if (opflag ^ NEW_BOOK) // Other flags present.
+        {
+            return INVALID_ARG;
+        }
+        imgrec_t rec;
+        if (node != NULL || img_query(blist->img, data->sn, &rec) >= 0)
+        {
+            return BOOK_EXIST;
+        }
+        snmap_node_t node;
+        memset(&node, 0, sizeof(snmap_node_t));
+        node.sn = data->sn;
+        if (blist->engine == ENGINE_COLUMN)
+        {
+            node.row = bstore_append(blist->store, data);
+            bstore_view(blist->store, node.row, &after);
+        }
+        else
+        {
+            // Construct new entry.
+            book_t *newbook = book_create(blist);
+            memcpy(newbook, data, sizeof(book_t));
+            // Copy name.
+            newbook->name = intern_get(data->name, strlen(data->name));
+            // Add to list.
+            newbook->prev = NULL;
+            newbook->next = blist->head;
+            if (blist->head != NULL)
+            {
+                blist->head->prev = newbook;
+            }
+            blist->head = newbook;
+            node.book = newbook;
+            memcpy(&after, newbook, sizeof(book_t));
+        }
+        // Append to hashmap.
+        snmap_append(blist->snmap, node);
+        blist->n++;
+        blist_index_update(blist, NULL, &after);
+        return SUCCESS;
+    }
+    else if (opflag & QRY_BOOK) // Query book data.
+    {
+        if (opflag ^ QRY_BOOK)
+        {
+            return INVALID_ARG;
+        }
+        // Find book.
+        if (node == NULL)
+        {
+            imgrec_t rec;
+            if (img_query(blist->img, data->sn, &rec) < 0)
+            {
+                return BOOK_NONEXIST;
+            }
+            data->price = rec.price;
+            data->quantity = rec.quantity;
+            strcpy(data->name, img_name(blist->img, &rec));
+            return SUCCESS;
+        }
+        if (blist->engine == ENGINE_COLUMN)
+        {
+            bstore_t *store = blist->store;
+            if (store->sn[node->row] != data->sn)
+            {
+                return MAP_INCONSIST;
+            }
+            data->price = store->price[node->row];
+            data->quantity = store->quantity[node->row];
+            strcpy(data->name, store->name[node->row]);
+            return SUCCESS;
+        }
+        book_t *current = node->book;
+        if (current->sn != data->sn)
+        {
+            return MAP_INCONSIST;
+        }
+        data->price = current->price;
+        data->quantity = current->quantity;
+        strcpy(data->name, current->name);
+        return SUCCESS;
+    }
+    else // Update book data.
+    {
+        if ((opflag & SELL_BOOK) && (opflag ^ SELL_BOOK))
+        {
+            return INVALID_ARG;
+        }
+        int res;
+        // Find book.
+        if (node == NULL)
+        {
+            imgrec_t rec;
+            long idx = img_query(blist->img, data->sn, &rec);
+            if (idx < 0)
+            {
+                return BOOK_NONEXIST;
+            }
+            img_view(blist->img, &rec, &before);
+            if ((res = blist_sell(data, &before, &opflag)) != SUCCESS)
+            {
+                return res;
+            }
+            // Unchanged name keeps its storage.
+            if ((opflag & UPD_NAME) && strcmp(before.name, data->name) == 0)
+            {
+                opflag ^= UPD_NAME;
+            }
+            if (opflag & UPD_NAME)
+            {
+                // Name doesn't fit mapped record, move book to engine.
+                book_t moved;
+                moved.sn = rec.sn;
+                moved.name = data->name;
+                moved.price = opflag & UPD_PRICE ? data->price : rec.price;
+                moved.quantity = opflag & UPD_QUANT ? data->quantity : rec.quantity;
+                blist_index_update(blist, &before, NULL);
+                rec.flags |= IMGREC_DELETED;
+                blist_img_store(blist, idx, &rec);
+                __atomic_sub_fetch(&blist->img->live, 1, __ATOMIC_RELAXED);
+                blist->n--;
+                res = blist_apply(blist, &moved, NEW_BOOK);
+                blist_watch(blist, &before, &moved);
+                return res;
+            }
+            if (opflag & UPD_PRICE)
+            {
+                rec.price = data->price;
+            }
+            if (opflag & UPD_QUANT)
+            {
+                rec.quantity = data->quantity;
+            }
+            blist_img_store(blist, idx, &rec);
+            img_view(blist->img, &rec, &after);
+            blist_index_update(blist, &before, &after);
+            return SUCCESS;
+        }
+        if (blist->engine == ENGINE_COLUMN)
+        {
+            bstore_t *store = blist->store;
+            unsigned int row = node->row;
+            if (store->sn[row] != data->sn)
+            {
+                return MAP_INCONSIST;
+            }
+            bstore_view(store, row, &before);
+            if ((res = blist_sell(data, &before, &opflag)) != SUCCESS)
+            {
+                return res;
+            }
+            // Unchanged name keeps its storage.
+            if ((opflag & UPD_NAME) && strcmp(before.name, data->name) == 0)
+            {
+                opflag ^= UPD_NAME;
+            }
+            if (opflag & UPD_NAME)
+            {
+                store->name[row] = intern_get(data->name, strlen(data->name));
+            }
+            if (opflag & UPD_PRICE)
+            {
+                store->price[row] = data->price;
+            }
+            if (opflag & UPD_QUANT)
+            {
+                store->quantity[row] = data->quantity;
+            }
+            bstore_view(store, row, &after);
+            blist_index_update(blist, &before, &after);
+            // Old name is freed only after indexes dropped it.
+            if (opflag & UPD_NAME)
+            {
+                blist_retire(blist, before.name);
+            }
+            return SUCCESS;
+        }
+        book_t *current = node->book;
+        if (current->sn != data->sn)
+        {
+            return MAP_INCONSIST;
+        }
+        memcpy(&before, current, sizeof(book_t));
+        if ((res = blist_sell(data, &before, &opflag)) != SUCCESS)
+        {
+            return res;
+        }
+        // Unchanged name keeps its storage.
+        if ((opflag & UPD_NAME) && strcmp(before.name, data->name) == 0)
+        {
+            opflag ^= UPD_NAME;
+        }
+        if (opflag & UPD_NAME)
+        {
+            current->name = intern_get(data->name, strlen(data->name));
+        }
+        if (opflag & UPD_PRICE)
+        {
+            current->price = data->price;
+        }
+        if (opflag & UPD_QUANT)
+        {
+            current->quantity = data->quantity;
+        }
+        blist_index_update(blist, &before, current);
+        if (opflag & UPD_NAME)
+        {
+            blist_retire(blist, before.name);
+        }
+        return SUCCESS;
+    }
+}
+
+int blist_sell(book_t *data, const book_t *before, int *opflag)
+{
+    if (!(*opflag & SELL_BOOK))
+    {
+        return SUCCESS;
+    }
+    if (before->quantity < data->quantity)
+    {
+        return OUT_OF_STOCK;
+    }
+    // Continue as absolute quantity update, price reports unit price.
+    data->quantity = before->quantity - data->quantity;
+    data->price = before->price;
+    *opflag = UPD_QUANT;
+    return SUCCESS;
+}
+
+void blist_img_store(blist_t *blist, unsigned int idx, const imgrec_t *rec)
+{
+    // Caller holds the shard. Snapshots that took it keep the record as
+    // it was, others copy the shard later and see the new one.
+    blist_t *top = blist->parent != NULL ? blist->parent : blist;
+    unsigned int part = blist->parent != NULL ? blist->id : 0;
+    if (__atomic_load_n(&top->nsnaps, __ATOMIC_ACQUIRE) == 0)
+    {
+        img_store(blist->img, idx, rec);
+        return;
+    }
+    imgrec_t old;
+    int read = 0;
+    pthread_mutex_lock(&top->snaplock);
+    for (snap_t *snap = top->snaps; snap != NULL; snap = snap->next)
+    {
+        if (!snap->taken[part] || snap_pre(snap, idx) != NULL)
+        {
+            continue;
+        }
+        if (!read)
+        {
+            img_read(blist->img, idx, &old);
+            read = 1;
+        }
+        snap_keep(snap, idx, &old);
+    }
+    img_store(blist->img, idx, rec);
+    pthread_mutex_unlock(&top->snaplock);
+}
+
+int blist_order(blist_t *blist, orderline_t *line, unsigned int n)
+{
+    // Sell lines in order, undo them all if one fails.
+    book_t data;
+    unsigned int nalert[SHARD_MAX];
+    unsigned long long held = 0; // Shards of basket.
+    unsigned int i;
+    int res = SUCCESS;
+    if (blist->shard != NULL)
+    {
+        // Lock in ascending order, baskets can't deadlock. Snapshots
+        // copy shard by shard, the gate keeps baskets out meanwhile.
+        pthread_rwlock_rdlock(&blist->gate);
+        for (i = 0; i < n; ++i)
+        {
+            held |= 1ULL << shard_id(line[i].sn, blist->nshards);
+        }
+        for (i = 0; i < blist->nshards; ++i)
+        {
+            if (held >> i & 1)
+            {
+                pthread_mutex_lock(&blist->shard[i]->lock);
+                nalert[i] = blist->shard[i]->nalert;
+            }
+        }
+    }
+    else
+    {
+        nalert[0] = blist->nalert;
+    }
+    for (i = 0; i < n; ++i)
+    {
+        data.sn = line[i].sn;
+        data.quantity = line[i].quantity;
+        line[i].res = blist_apply(blist, &data, SELL_BOOK);
+        if (line[i].res != SUCCESS)
+        {
+            res = line[i].res;
+            break;
+        }
+        line[i].left = data.quantity;
+        line[i].price = data.price;
+    }
+    if (res != SUCCESS)
+    {
+        // Check rest of lines for reporting only.
+        for (unsigned int j = i + 1; j < n; ++j)
+        {
+            line[j].res = blist_view(blist, line[j].sn, &data);
+            if (line[j].res == SUCCESS && data.quantity < line[j].quantity)
+            {
+                line[j].res = OUT_OF_STOCK;
+            }
+        }
+        // Undo in reverse, repeated SNs restore correctly.
+        while (i-- > 0)
+        {
+            data.sn = line[i].sn;
+            data.quantity = line[i].left + line[i].quantity;
+            blist_apply(blist, &data, UPD_QUANT);
+        }
+        // Drop alerts of undone lines.
+        if (blist->shard == NULL)
+        {
+            blist->nalert = nalert[0];
+        }
+        for (i = 0; blist->shard != NULL && i < blist->nshards; ++i)
+        {
+            if (held >> i & 1)
+            {
+                blist->shard[i]->nalert = nalert[i];
+            }
+        }
+    }
+    // Only committed baskets reach the ledger and journal.
+    for (i = 0; res == SUCCESS && i < n && blist->ledger != NULL; ++i)
+    {
+        ledger_sell(blist->ledger, line[i].sn, line[i].quantity, line[i].price);
+    }
+    for (i = 0; res == SUCCESS && i < n && blist->jnl != NULL; ++i)
+    {
+        data.sn = line[i].sn;
+        data.quantity = line[i].left;
+        journal_append(blist->jnl, &data, UPD_QUANT);
+    }
+    for (i = 0; blist->shard != NULL && i < blist->nshards; ++i)
+    {
+        if (held >> i & 1)
+        {
+            pthread_mutex_unlock(&blist->shard[i]->lock);
+        }
+    }
+    if (blist->shard != NULL)
+    {
+        pthread_rwlock_unlock(&blist->gate);
+    }
+    if (res == SUCCESS)
+    {
+        __atomic_add_fetch(&blist->nmods, n, __ATOMIC_RELAXED);
+    }
+    // Lines of a committed basket count as sells.
+    stats_t *stats = stats_local();
+    stats_add(res == SUCCESS ? &stats->ops[stats_op(SELL_BOOK)] : &stats->opfail, res == SUCCESS ? n : 1);
+    return res;
+}
+
+int blist_batch(blist_t *blist, batchop_t *op, unsigned int n, int atomic)
+{
+    // Apply ops shard by shard, each shard locked once. Ops on one SN keep
+    // their order, atomic batches are undone if one op fails.
+    unsigned int nshards = blist->shard != NULL ? blist->nshards : 1;
+    unsigned int start[SHARD_MAX + 1];
+    unsigned int nalert[SHARD_MAX];
+    unsigned int nops[STATS_OPS];
+    unsigned int nfail = 0;
+    unsigned int i, s;
+    int res = SUCCESS;
+    unsigned int *order = (unsigned int *)malloc(sizeof(unsigned int) * (n ? n : 1));
+    unsigned int *tmp = (unsigned int *)malloc(sizeof(unsigned int) * 2 * (n ? n : 1));
+    batchundo_t *undo = atomic ? (batchundo_t *)calloc(n ? n : 1, sizeof(batchundo_t)) : NULL;
+    if (order == NULL || tmp == NULL || (atomic && undo == NULL))
+    {
+        error_die("Malloc failed");
+    }
+    memset(nops, 0, sizeof(nops));
+    for (i = 0; i < n; ++i)
+    {
+        op[i].res = SUCCESS;
+    }
+    batch_order(blist, op, n, order, start);
+    if (atomic && blist->shard != NULL)
+    {
+        // Like baskets, kept out while a snapshot is copied.
+        pthread_rwlock_rdlock(&blist->gate);
+    }
+    for (s = 0; atomic && s < nshards; ++s)
+    {
+        // Lock in ascending order, like baskets.
+        blist_t *shard = blist->shard != NULL ? blist->shard[s] : blist;
+        if (shard != blist && start[s] < start[s + 1])
+        {
+            pthread_mutex_lock(&shard->lock);
+        }
+        nalert[s] = shard->nalert;
+    }
+    for (s = 0; s < nshards && (res == SUCCESS || !atomic); ++s)
+    {
+        blist_t *shard = blist->shard != NULL ? blist->shard[s] : blist;
+        unsigned int end = start[s + 1];
+        if (start[s] == end)
+        {
+            continue;
+        }
+        if (!atomic && shard != blist)
+        {
+            pthread_mutex_lock(&shard->lock);
+        }
+        batch_group(shard->snmap, op, order + start[s], end - start[s], tmp);
+        for (i = start[s]; i < end && (res == SUCCESS || !atomic); ++i)
+        {
+            // Home slots, then books of later ops load while this one runs.
+            if (i + 2 * BATCH_PREFETCH < end)
+            {
+                snmap_prefetch(shard->snmap, op[order[i + 2 * BATCH_PREFETCH]].data.sn);
+            }
+            if (i + BATCH_PREFETCH < end)
+            {
+                batch_prefetch(shard, op[order[i + BATCH_PREFETCH]].data.sn);
+            }
+            batchop_t *cur = &op[order[i]];
+            unsigned int sold = cur->opflag == SELL_BOOK ? cur->data.quantity : 0;
+            int applied;
+            cur->res = batch_apply(shard, cur, atomic ? &undo[i].before : NULL, &applied);
+            if (cur->res != SUCCESS)
+            {
+                res = res == SUCCESS ? cur->res : res;
+                nfail++;
+                continue;
+            }
+            nops[stats_op(applied)]++;
+            if (atomic)
+            {
+                undo[i].opflag = applied;
+            }
+            else
+            {
+                batch_log(blist, cur, applied, sold);
+            }
+        }
+        if (!atomic && shard != blist)
+        {
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+    for (i = n; atomic && res != SUCCESS && i-- > 0;)
+    {
+        // Undo in reverse, repeated SNs restore correctly.
+        batchop_t *cur = &op[order[i]];
+        batchundo_t *prev = &undo[i];
+        if (prev->opflag & NEW_BOOK)
+        {
+            blist_apply(blist, &cur->data, DEL_BOOK);
+        }
+        else if (prev->opflag & DEL_BOOK)
+        {
+            blist_apply(blist, &prev->before, NEW_BOOK);
+        }
+        else if (prev->opflag & SELL_BOOK)
+        {
+            blist_apply(blist, &prev->before, UPD_QUANT);
+        }
+        else if (prev->opflag != 0 && !(prev->opflag & QRY_BOOK))
+        {
+            blist_apply(blist, &prev->before, prev->opflag);
+        }
+    }
+    for (i = 0; atomic && i < n; ++i)
+    {
+        // Only committed batches reach the ledger and journal.
+        batchundo_t *prev = &undo[i];
+        if (res == SUCCESS)
+        {
+            batchop_t *cur = &op[order[i]];
+            batch_log(blist, cur, prev->opflag, prev->opflag & SELL_BOOK ? prev->before.quantity - cur->data.quantity : 0);
+        }
+        if (prev->before.name != NULL)
+        {
+            intern_put(prev->before.name);
+        }
+    }
+    for (s = 0; atomic && s < nshards; ++s)
+    {
+        // Drop alerts of undone ops.
+        blist_t *shard = blist->shard != NULL ? blist->shard[s] : blist;
+        if (res != SUCCESS)
+        {
+            shard->nalert = nalert[s];
+        }
+        if (shard != blist && start[s] < start[s + 1])
+        {
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+    if (atomic && blist->shard != NULL)
+    {
+        pthread_rwlock_unlock(&blist->gate);
+    }
+    // A rejected atomic batch counts as one failure.
+    stats_t *stats = stats_local();
+    if (atomic && res != SUCCESS)
+    {
+        stats_add(&stats->opfail, 1);
+    }
+    else
+    {
+        for (i = 0; i < STATS_OPS; ++i)
+        {
+            stats_add(&stats->ops[i], nops[i]);
+        }
+        stats_add(&stats->opfail, nfail);
+        __atomic_add_fetch(&blist->nmods, n - nfail - nops[stats_op(QRY_BOOK)], __ATOMIC_RELAXED);
+    }
+    free(undo);
+    free(tmp);
+    free(order);
+    return res;
+}
+
+void batch_order(blist_t *blist, const batchop_t *op, unsigned int n, unsigned int *order, unsigned int *start)
+{
+    // Counting sort by shard, stable. Ops of shard s end up in
+    // order[start[s]] to order[start[s + 1] - 1].
+    unsigned int nshards = blist->shard != NULL ? blist->nshards : 1;
+    unsigned int next[SHARD_MAX];
+    unsigned int i;
+    memset(next, 0, sizeof(unsigned int) * nshards);
+    for (i = 0; i < n; ++i)
+    {
+        next[shard_id(op[i].data.sn, nshards)]++;
+    }
+    start[0] = 0;
+    for (i = 0; i < nshards; ++i)
+    {
+        start[i + 1] = start[i] + next[i];
+        next[i] = start[i];
+    }
+    for (i = 0; i < n; ++i)
+    {
+        order[next[shard_id(op[i].data.sn, nshards)]++] = i;
+    }
+}
+
+void batch_group(const snmap_t *snmap, const batchop_t *op, unsigned int *order, unsigned int n, unsigned int *tmp)
+{
+    // Counting sort by region of home slot, so the SN map is walked in
+    // order. Stable, sizes are powers of 2. Caller holds the shard.
+    unsigned int size = snmap->cur.size;
+    unsigned int count[BATCH_REGIONS + 1];
+    unsigned int nregions = 1;
+    unsigned int shift = 0;
+    unsigned int i;
+    while (nregions < BATCH_REGIONS && nregions < n && nregions < size)
+    {
+        nregions *= 2;
+    }
+    while ((nregions << shift) < size)
+    {
+        shift++;
+    }
+    if (nregions == 1)
+    {
+        return;
+    }
+    memset(count, 0, sizeof(unsigned int) * (nregions + 1));
+    for (i = 0; i < n; ++i)
+    {
+        tmp[i] = (sn_hash(op[order[i]].data.sn) & (size - 1)) >> shift;
+        count[tmp[i] + 1]++;
+    }
+    for (i = 1; i <= nregions; ++i)
+    {
+        count[i] += count[i - 1];
+    }
+    // Second half of tmp holds the sorted ops.
+    for (i = 0; i < n; ++i)
+    {
+        tmp[n + count[tmp[i]]++] = order[i];
+    }
+    memcpy(order, tmp + n, sizeof(unsigned int) * n);
+}
+
+void batch_prefetch(blist_t *blist, unsigned int sn)
+{
+    // Home slot was prefetched earlier, pull in the book it locates.
+    // Books away from their home slot are left to the lookup.
+    const snmap_node_t *node = snmap_home(blist->snmap, sn);
+    if (node == NULL)
+    {
+        return;
+    }
+    if (blist->engine == ENGINE_COLUMN)
+    {
+        __builtin_prefetch(&blist->store->sn[node->row]);
+        __builtin_prefetch(&blist->store->price[node->row]);
+        __builtin_prefetch(&blist->store->quantity[node->row]);
+        __builtin_prefetch(&blist->store->name[node->row]);
+        return;
+    }
+    __builtin_prefetch(node->book);
+}
+
+int batch_apply(blist_t *blist, batchop_t *op, book_t *before, int *applied)
+{
+    // One lookup serves the undo view, the op and the upsert fallback.
+    snmap_node_t *node = snmap_query(blist->snmap, op->data.sn);
+    if (before != NULL && blist_view_node(blist, node, op->data.sn, before) == SUCCESS)
+    {
+        // Name may be retired by the op, keep a reference.
+        before->name = intern_get(before->name, strlen(before->name));
+    }
+    else if (before != NULL)
+    {
+        before->name = NULL;
+    }
+    // Upserts replace a book if present and add it otherwise.
+    *applied = op->opflag;
+    if (op->opflag != UPSERT_BOOK)
+    {
+        return blist_apply_node(blist, node, &op->data, op->opflag);
+    }
+    *applied = UPD_NAME | UPD_PRICE | UPD_QUANT;
+    int res = blist_apply_node(blist, node, &op->data, *applied);
+    if (res == BOOK_NONEXIST)
+    {
+        // Failed update left the map as it was, the book is in neither.
+        *applied = NEW_BOOK;
+        res = blist_apply_node(blist, NULL, &op->data, NEW_BOOK);
+    }
+    return res;
+}
+
+void batch_log(blist_t *blist, const batchop_t *op, int applied, unsigned int sold)
+{
+    // Upserts are logged as the op they turned into, sells as absolute quantity.
+    if ((applied & SELL_BOOK) && blist->ledger != NULL)
+    {
+        ledger_sell(blist->ledger, op->data.sn, sold, op->data.price);
+    }
+    if (blist->jnl != NULL && !(applied & QRY_BOOK))
+    {
+        journal_append(blist->jnl, &op->data, applied & SELL_BOOK ? UPD_QUANT : applied);
+    }
+}
+
+int blist_view(blist_t *blist, unsigned int sn, book_t *book)
+{
+    if (blist->shard != NULL)
+    {
+        return blist_view(blist_route(blist, sn), sn, book);
+    }
+    return blist_view_node(blist, snmap_query(blist->snmap, sn), sn, book);
+}
+
+int blist_view_node(blist_t *blist, const snmap_node_t *node, unsigned int sn, book_t *book)
+{
+    if (node == NULL)
+    {
+        imgrec_t rec;
+        if (img_query(blist->img, sn, &rec) < 0)
+        {
+            return BOOK_NONEXIST;
+        }
+        img_view(blist->img, &rec, book);
+    }
+    else if (blist->engine == ENGINE_COLUMN)
+    {
+        bstore_view(blist->store, node->row, book);
+    }
+    else
+    {
+        memcpy(book, node->book, sizeof(book_t));
+    }
+    return SUCCESS;
+}
+
+skiplist_t *blist_index(blist_t *blist, int type)
+{
+    if (blist->shard != NULL)
+    {
+        // Shards build their own indexes in parallel.
+        if (blist->shard[0]->index[type] == NULL)
+        {
+            blist_fanout(blist, shard_index, &type);
+        }
+        return NULL;
+    }
+    if (blist->index[type] == NULL)
+    {
+        // Build on first use.
+        skiplist_t *list = skip_create(type);
+        blist_iter_t iter;
+        book_t current;
+        blist_iter_init(&iter, blist);
+        while (blist_iter_next(&iter, &current))
+        {
+            skip_insert(list, &current);
+        }
+        blist->index[type] = list;
+    }
+    return blist->index[type];
+}
+
+void blist_index_update(blist_t *blist, const book_t *old, const book_t *new)
+{
+    unsigned long long oldnum, newnum;
+    const char *oldstr, *newstr;
+    blist_watch(blist, old, new);
+    // Trigrams change only with the name itself.
+    if (blist->trigram != NULL && (old == NULL || new == NULL || strcmp(old->name, new->name) != 0))
+    {
+        if (old != NULL)
+        {
+            trigram_remove(blist->trigram, old->name, old->sn);
+        }
+        if (new != NULL)
+        {
+            trigram_add(blist->trigram, new->name, new->sn, 0);
+        }
+    }
+    for (int i = 0; i < IDX_COUNT; ++i)
+    {
+        skiplist_t *list = blist->index[i];
+        if (list == NULL)
+        {
+            continue;
+        }
+        if (old != NULL && new != NULL)
+        {
+            // Skip indexes whose key didn't change.
+            skip_key(i, old, &oldnum, &oldstr);
+            skip_key(i, new, &newnum, &newstr);
+            if (oldnum == newnum && (oldstr == newstr || (oldstr != NULL && newstr != NULL && strcmp(oldstr, newstr) == 0)))
+            {
+                if (oldstr != newstr)
+                {
+                    // Same name, new storage.
+                    skip_remove(list, old);
+                    skip_insert(list, new);
+                }
+                continue;
+            }
+        }
+        if (old != NULL)
+        {
+            skip_remove(list, old);
+        }
+        if (new != NULL)
+        {
+            skip_insert(list, new);
+        }
+    }
+}
+
+trigram_t *blist_trigram(blist_t *blist)
+{
+    if (blist->shard != NULL)
+    {
+        if (blist->shard[0]->trigram == NULL)
+        {
+            blist_fanout(blist, shard_trigram, NULL);
+        }
+        return NULL;
+    }
+    if (blist->trigram == NULL)
+    {
+        // Build on first use.
+        trigram_t *tg = trigram_create();
+        blist_iter_t iter;
+        book_t current;
+        blist_iter_init(&iter, blist);
+        while (blist_iter_next(&iter, &current))
+        {
+            trigram_add(tg, current.name, current.sn, 1);
+        }
+        trigram_seal(tg);
+        blist->trigram = tg;
+    }
+    return blist->trigram;
+}
+
+void blist_watch(blist_t *blist, const book_t *old, const book_t *new)
+{
+    // Alert only when an existing book crosses the threshold.
+    if (!blist->watch || old == NULL || new == NULL)
+    {
+        return;
+    }
+    if (new->quantity >= blist->threshold || old->quantity < blist->threshold)
+    {
+        return;
+    }
+    if (blist->nalert == blist->alertsize)
+    {
+        blist->alertsize = blist->alertsize ? blist->alertsize * 2 : ALERT_INIT_SIZE;
+        blist->alert = (alert_t *)realloc(blist->alert, sizeof(alert_t) * blist->alertsize);
+        if (blist->alert == NULL)
+        {
+            error_die("Malloc failed");
+        }
+    }
+    blist->alert[blist->nalert].sn = new->sn;
+    blist->alert[blist->nalert].quantity = new->quantity;
+    blist->nalert++;
+}
+
+void blist_iter_init(blist_iter_t *iter, const blist_t *blist)
+{
+    iter->blist = blist;
+    iter->snap = NULL;
+    iter->rec = 0;
+    iter->shard = 0;
+    iter->cur = blist->shard != NULL ? blist->shard[0] : blist;
+    iter->node = iter->cur->head;
+    iter->row = 0;
+}
+
+int blist_iter_next(blist_iter_t *iter, book_t *book)
+{
+    if (iter->snap != NULL)
+    {
+        // Image as of the snapshot, then the engine copies.
+        const snap_t *snap = iter->snap;
+        while (snap->img != NULL)
+        {
+            if (iter->chunkpos == iter->chunklen)
+            {
+                if (iter->rec >= snap->img->hdr->n)
+                {
+                    break;
+                }
+                snap_chunk(iter);
+            }
+            const imgrec_t *rec = &iter->chunk[iter->chunkpos++];
+            if (!(rec->flags & IMGREC_DELETED))
+            {
+                img_view(snap->img, rec, book);
+                return 1;
+            }
+        }
+        while (iter->shard < snap->nparts && iter->row >= snap->n[iter->shard])
+        {
+            iter->shard++;
+            iter->row = 0;
+        }
+        if (iter->shard >= snap->nparts)
+        {
+            return 0;
+        }
+        const snaprec_t *rec = &snap->rec[iter->shard][iter->row++];
+        book->sn = rec->sn;
+        book->name = (char *)rec->name;
+        book->price = rec->price;
+        book->quantity = rec->quantity;
+        return 1;
+    }
+    // Mapped image first, a shard only takes its own records.
+    const blist_t *blist = iter->blist;
+    mapimg_t *img = blist->img;
+    imgrec_t rec;
+    while (img != NULL && iter->rec < img->hdr->n)
+    {
+        img_read(img, iter->rec++, &rec);
+        if (rec.flags & IMGREC_DELETED)
+        {
+            continue;
+        }
+        if (blist->parent != NULL && shard_id(rec.sn, blist->nshards) != blist->id)
+        {
+            continue;
+        }
+        img_view(img, &rec, book);
+        return 1;
+    }
+    while (1)
+    {
+        if (iter->cur->engine == ENGINE_COLUMN && iter->row < iter->cur->store->n)
+        {
+            bstore_view(iter->cur->store, iter->row++, book);
+            return 1;
+        }
+        if (iter->cur->engine == ENGINE_LIST && iter->node != NULL)
+        {
+            memcpy(book, iter->node, sizeof(book_t));
+            iter->node = iter->node->next;
+            return 1;
+        }
+        // Next shard.
+        if (blist->shard == NULL || ++iter->shard >= blist->nshards)
+        {
+            return 0;
+        }
+        iter->cur = blist->shard[iter->shard];
+        iter->node = iter->cur->head;
+        iter->row = 0;
+    }
+}
+
+void scan_init(scan_t *scan)
+{
+    scan->next = 0;
+    scan->minprice = 0;
+    scan->maxprice = UINT_MAX;
+    scan->minquant = 0;
+    scan->maxquant = UINT_MAX;
+}
+
+int blist_scan(blist_t *blist, scan_t *scan, book_t *page, unsigned int limit)
+{
+    // Caller holds every shard, names stay valid until it lets go.
+    idxcur_t cursor;
+    skipnode_t *current;
+    unsigned int n = 0;
+    if (scan->next == SCAN_END)
+    {
+        return 0;
+    }
+    idxcur_init(&cursor, blist, IDX_SN, 0);
+    idxcur_seek(&cursor, scan->next, NULL);
+    while (n < limit && (current = idxcur_next(&cursor)) != NULL)
+    {
+        if (blist_view(blist, current->sn, &page[n]) != SUCCESS)
+        {
+            return MAP_INCONSIST;
+        }
+        scan->next = (unsigned long long)current->sn + 1;
+        if (page[n].price >= scan->minprice && page[n].price <= scan->maxprice && page[n].quantity >= scan->minquant &&
+            page[n].quantity <= scan->maxquant)
+        {
+            n++;
+        }
+    }
+    if (n < limit)
+    {
+        scan->next = SCAN_END;
+    }
+    return n;
+}
+
+unsigned int blist_count(const blist_t *blist)
+{
+    unsigned int n = blist->n;
+    for (unsigned int i = 0; blist->shard != NULL && i < blist->nshards; ++i)
+    {
+        n += blist->shard[i]->n;
+    }
+    return n;
+}
+
+size_t blist_held(blist_t *blist)
+{
+    // Shared names and the mapped image are not counted.
+    blist_t **part = blist->shard != NULL ? blist->shard : &blist;
+    unsigned int nparts = blist->shard != NULL ? blist->nshards : 1;
+    size_t held = 0;
+    for (unsigned int i = 0; i < nparts; ++i)
+    {
+        held += part[i]->books.held + snmap_held(part[i]->snmap);
+        if (part[i]->store != NULL)
+        {
+            held += bstore_held(part[i]->store);
+        }
+    }
+    if (blist->ledger != NULL)
+    {
+        pthread_mutex_lock(&blist->ledger->lock);
+        held += ledger_held(blist->ledger);
+        pthread_mutex_unlock(&blist->ledger->lock);
+    }
+    return held;
+}
+
+void blist_retire(blist_t *blist, char *name)
+{
+    // Open snapshots may still point at name.
+    blist_t *top = blist->parent != NULL ? blist->parent : blist;
+    if (__atomic_load_n(&top->nsnaps, __ATOMIC_ACQUIRE) == 0)
+    {
+        intern_put(name);
+        return;
+    }
+    if (blist->nlimbo == blist->limbosize)
+    {
+        blist->limbosize = blist->limbosize ? blist->limbosize * 2 : LIMBO_INIT_SIZE;
+        blist->limbo = (limbo_t *)realloc(blist->limbo, sizeof(limbo_t) * blist->limbosize);
+        if (blist->limbo == NULL)
+        {
+            error_die("Malloc failed");
+        }
+    }
+    blist->limbo[blist->nlimbo].name = name;
+    blist->limbo[blist->nlimbo].epoch = __atomic_load_n(&top->epoch, __ATOMIC_ACQUIRE);
+    blist->nlimbo++;
+}
+
+void blist_put_names(blist_t *blist)
+{
+    // Release the names of all books and retired ones.
+    for (book_t *book = blist->head; book != NULL; book = book->next)
+    {
+        intern_put(book->name);
+    }
+    for (unsigned int row = 0; blist->store != NULL && row < blist->store->n; ++row)
+    {
+        intern_put(blist->store->name[row]);
+    }
+    for (unsigned int i = 0; i < blist->nlimbo; ++i)
+    {
+        intern_put(blist->limbo[i].name);
+    }
+    blist->nlimbo = 0;
+}
+
+void blist_reclaim(blist_t *blist)
+{
+    // Limbo is in epoch order, free names no open snapshot can see.
+    blist_t *top = blist->parent != NULL ? blist->parent : blist;
+    unsigned long long oldest = __atomic_load_n(&top->oldest, __ATOMIC_ACQUIRE);
+    unsigned int i = 0;
+    int open = __atomic_load_n(&top->nsnaps, __ATOMIC_ACQUIRE) != 0;
+    while (i < blist->nlimbo && (!open || blist->limbo[i].epoch < oldest))
+    {
+        intern_put(blist->limbo[i].name);
+        i++;
+    }
+    if (i > 0)
+    {
+        blist->nlimbo -= i;
+        memmove(blist->limbo, blist->limbo + i, sizeof(limbo_t) * blist->nlimbo);
+    }
+}
+
+// Snapshot functions.
+
+snap_t *snap_take(blist_t *blist)
+{
+    snap_t *new = (snap_t *)malloc(sizeof(snap_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    memset(new, 0, sizeof(snap_t));
+    new->blist = blist;
+    new->img = blist->img;
+    // Register before copying, names retired from now on are kept.
+    pthread_mutex_lock(&blist->snaplock);
+    new->epoch = __atomic_add_fetch(&blist->epoch, 1, __ATOMIC_ACQ_REL);
+    if (blist->snaps == NULL)
+    {
+        __atomic_store_n(&blist->oldest, new->epoch, __ATOMIC_RELEASE);
+    }
+    new->next = blist->snaps;
+    if (blist->snaps != NULL)
+    {
+        blist->snaps->prev = new;
+    }
+    blist->snaps = new;
+    __atomic_add_fetch(&blist->nsnaps, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&blist->snaplock);
+    // Shards are copied in parallel, each one held only while its own
+    // part is taken. Modifications spanning shards wait at the gate, so
+    // they are in the snapshot entirely or not at all.
+    if (blist->shard != NULL)
+    {
+        new->nparts = blist->nshards;
+        pthread_rwlock_wrlock(&blist->gate);
+        blist_fanout(blist, shard_snap, new);
+        pthread_rwlock_unlock(&blist->gate);
+    }
+    else
+    {
+        new->nparts = 1;
+        shard_snap(blist, new);
+    }
+    return new;
+}
+
+void snap_release(blist_t *blist, snap_t *snap)
+{
+    pthread_mutex_lock(&blist->snaplock);
+    if (snap->prev != NULL)
+    {
+        snap->prev->next = snap->next;
+    }
+    else
+    {
+        blist->snaps = snap->next;
+    }
+    if (snap->next != NULL)
+    {
+        snap->next->prev = snap->prev;
+    }
+    // Oldest is last in list.
+    snap_t *last = blist->snaps;
+    while (last != NULL && last->next != NULL)
+    {
+        last = last->next;
+    }
+    if (last != NULL)
+    {
+        __atomic_store_n(&blist->oldest, last->epoch, __ATOMIC_RELEASE);
+    }
+    __atomic_sub_fetch(&blist->nsnaps, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&blist->snaplock);
+    for (unsigned int i = 0; i < snap->nparts; ++i)
+    {
+        free(snap->rec[i]);
+    }
+    free(snap->pre);
+    free(snap);
+    // Free what only this snapshot held.
+    if (blist->shard == NULL)
+    {
+        blist_reclaim(blist);
+        return;
+    }
+    for (unsigned int i = 0; i < blist->nshards; ++i)
+    {
+        pthread_mutex_lock(&blist->shard[i]->lock);
+        blist_reclaim(blist->shard[i]);
+        pthread_mutex_unlock(&blist->shard[i]->lock);
+    }
+}
+
+void snap_iter_init(blist_iter_t *iter, const snap_t *snap)
+{
+    memset(iter, 0, offsetof(blist_iter_t, chunk));
+    iter->snap = snap;
+    iter->chunkpos = 0;
+    iter->chunklen = 0;
+}
+
+void snap_chunk(blist_iter_t *iter)
+{
+    // A page at a time. Records overwritten since their part was taken
+    // come from pre, which is checked after the page is read, so records
+    // overwritten while it is read are not missed.
+    const snap_t *snap = iter->snap;
+    mapimg_t *img = snap->img;
+    unsigned int n = img->hdr->n - iter->rec;
+    n = n < SNAP_CHUNK_RECS ? n : SNAP_CHUNK_RECS;
+    if (img->cache != NULL)
+    {
+        // Out of core, pages are read past the cache.
+        pcache_peek(img->cache, iter->rec / PCACHE_PAGE_RECS, iter->chunk);
+    }
+    pthread_mutex_lock(&snap->blist->snaplock);
+    if (img->cache == NULL)
+    {
+        memcpy(iter->chunk, &img->rec[iter->rec], sizeof(imgrec_t) * n);
+    }
+    for (unsigned int i = 0; i < n && snap->npre > 0; ++i)
+    {
+        const snapimg_t *pre = snap_pre(snap, iter->rec + i);
+        if (pre != NULL)
+        {
+            memcpy(&iter->chunk[i], &pre->rec, sizeof(imgrec_t));
+        }
+    }
+    pthread_mutex_unlock(&snap->blist->snaplock);
+    iter->rec += n;
+    iter->chunkpos = 0;
+    iter->chunklen = n;
+}
+
+const snapimg_t *snap_pre(const snap_t *snap, unsigned int idx)
+{
+    // Caller holds snaplock.
+    if (snap->presize == 0)
+    {
+        return NULL;
+    }
+    unsigned int mask = snap->presize - 1;
+    unsigned int slot = sn_hash(idx) & mask;
+    while (snap->pre[slot].idx != 0)
+    {
+        if (snap->pre[slot].idx == idx + 1)
+        {
+            return &snap->pre[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+void snap_keep(snap_t *snap, unsigned int idx, const imgrec_t *rec)
+{
+    // Caller holds snaplock, idx is not kept yet. Grow at half load.
+    if (2 * (snap->npre + 1) > snap->presize)
+    {
+        unsigned int size = snap->presize ? snap->presize * 2 : SNAP_PRE_INIT_SIZE;
+        snapimg_t *pre = (snapimg_t *)calloc(size, sizeof(snapimg_t));
+        if (pre == NULL)
+        {
+            error_die("Malloc failed");
+        }
+        for (unsigned int i = 0; i < snap->presize; ++i)
+        {
+            if (snap->pre[i].idx == 0)
+            {
+                continue;
+            }
+            unsigned int slot = sn_hash(snap->pre[i].idx - 1) & (size - 1);
+            while (pre[slot].idx != 0)
+            {
+                slot = (slot + 1) & (size - 1);
+            }
+            pre[slot] = snap->pre[i];
+        }
+        free(snap->pre);
+        snap->pre = pre;
+        snap->presize = size;
+    }
+    unsigned int slot = sn_hash(idx) & (snap->presize - 1);
+    while (snap->pre[slot].idx != 0)
+    {
+        slot = (slot + 1) & (snap->presize - 1);
+    }
+    snap->pre[slot].idx = idx + 1;
+    memcpy(&snap->pre[slot].rec, rec, sizeof(imgrec_t));
+    snap->npre++;
+}
+
+void shard_snap(blist_t *shard, void *arg)
+{
+    // Only engine books are copied, image records stay where they are.
+    snap_t *snap = (snap_t *)arg;
+    unsigned int part = shard->parent != NULL ? shard->id : 0;
+    blist_iter_t iter;
+    book_t current;
+    snaprec_t *rec = NULL;
+    unsigned int n = 0;
+    unsigned int size = 0;
+    if (shard->parent != NULL)
+    {
+        pthread_mutex_lock(&shard->lock);
+    }
+    blist_iter_init(&iter, shard);
+    iter.rec = shard->img != NULL ? shard->img->hdr->n : 0;
+    while (blist_iter_next(&iter, &current))
+    {
+        if (n == size)
+        {
+            size = size ? size * 2 : LIMBO_INIT_SIZE;
+            rec = (snaprec_t *)realloc(rec, sizeof(snaprec_t) * size);
+            if (rec == NULL)
+            {
+                error_die("Malloc failed");
+            }
+        }
+        rec[n].sn = current.sn;
+        rec[n].price = current.price;
+        rec[n].quantity = current.quantity;
+        rec[n].name = current.name;
+        n++;
+    }
+    snap->rec[part] = rec;
+    snap->n[part] = n;
+    snap->books[part] = shard->n;
+    snap->taken[part] = 1;
+    if (shard->parent != NULL)
+    {
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// Shard functions.
+
+void blist_shard(blist_t *blist, unsigned int nshards)
+{
+    blist->shard = (blist_t **)malloc(sizeof(blist_t *) * nshards);
+    if (blist->shard == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    blist->nshards = nshards;
+    for (unsigned int i = 0; i < nshards; ++i)
+    {
+        blist_t *shard = blist_create(blist->engine);
+        shard->img = blist->img;
+        shard->parent = blist;
+        shard->nshards = nshards;
+        shard->id = i;
+        pthread_mutex_init(&shard->lock, NULL);
+        blist->shard[i] = shard;
+    }
+    // Image records stay where they are, shards only count theirs. Nothing
+    // is deleted right after loading, so one pass over the SN index does
+    // without reading records.
+    if (blist->img != NULL)
+    {
+        const mapimg_t *img = blist->img;
+        for (unsigned int i = 0; i < img->hdr->idxsize; ++i)
+        {
+            if (img->idx[i].rec != 0)
+            {
+                blist->shard[shard_id(img->idx[i].sn, nshards)]->n++;
+            }
+        }
+    }
+    // Shards take their books from the loaded list in parallel.
+    blist_fanout(blist, shard_fill, NULL);
+    blist_put_names(blist);
+    pool_destroy(&blist->books);
+    snmap_destroy(blist->snmap);
+    blist->snmap = snmap_create();
+    blist->head = NULL;
+    if (blist->store != NULL)
+    {
+        bstore_destroy(blist->store);
+        blist->store = bstore_create();
+    }
+    blist->n = 0;
+}
+
+unsigned int shard_id(unsigned int sn, unsigned int nshards)
+{
+    // High hash bits, low ones pick slots within the shard.
+    return ((unsigned long long)sn_hash(sn) * nshards) >> 32;
+}
+
+blist_t *blist_route(blist_t *blist, unsigned int sn)
+{
+    if (blist->shard == NULL)
+    {
+        return blist;
+    }
+    return blist->shard[shard_id(sn, blist->nshards)];
+}
+
+void blist_lock(blist_t *blist)
+{
+    for (unsigned int i = 0; blist->shard != NULL && i < blist->nshards; ++i)
+    {
+        pthread_mutex_lock(&blist->shard[i]->lock);
+    }
+}
+
+void blist_unlock(blist_t *blist)
+{
+    for (unsigned int i = 0; blist->shard != NULL && i < blist->nshards; ++i)
+    {
+        pthread_mutex_unlock(&blist->shard[i]->lock);
+    }
+}
+
+void blist_yield(blist_t *blist)
+{
+    // Caller holds every shard, writers get in between pages of a listing.
+    // Mutexes are not fair, woken writers need a chance to run.
+    blist_unlock(blist);
+    sched_yield();
+    blist_lock(blist);
+}
+
+void blist_fanout(blist_t *blist, void (*fn)(blist_t *, void *), void *arg)
+{
+    fanout_t task[SHARD_MAX];
+    for (unsigned int i = 0; i < blist->nshards; ++i)
+    {
+        task[i].shard = blist->shard[i];
+        task[i].fn = fn;
+        task[i].arg = arg;
+        if (pthread_create(&task[i].thread, NULL, fanout_run, &task[i]) != 0)
+        {
+            error_die("Failed to create thread");
+        }
+    }
+    for (unsigned int i = 0; i < blist->nshards; ++i)
+    {
+        pthread_join(task[i].thread, NULL);
+    }
+}
+
+void *fanout_run(void *arg)
+{
+    fanout_t *task = (fanout_t *)arg;
+    task->fn(task->shard, task->arg);
+    return NULL;
+}
+
+void shard_fill(blist_t *shard, void *arg)
+{
+    // Every shard scans the parent and copies its own books.
+    const blist_t *parent = shard->parent;
+    book_t current;
+    (void)arg;
+    if (parent->engine == ENGINE_COLUMN)
+    {
+        for (unsigned int row = 0; row < parent->store->n; ++row)
+        {
+            if (shard_id(parent->store->sn[row], shard->nshards) == shard->id)
+            {
+                bstore_view(parent->store, row, &current);
+                blist_apply(shard, &current, NEW_BOOK);
+            }
+        }
+        return;
+    }
+    for (const book_t *node = parent->head; node != NULL; node = node->next)
+    {
+        if (shard_id(node->sn, shard->nshards) == shard->id)
+        {
+            memcpy(&current, node, sizeof(book_t));
+            blist_apply(shard, &current, NEW_BOOK);
+        }
+    }
+}
+
+void shard_index(blist_t *shard, void *arg)
+{
+    blist_index(shard, *(int *)arg);
+}
+
+void shard_trigram(blist_t *shard, void *arg)
+{
+    (void)arg;
+    blist_trigram(shard);
+}
+
+void idxcur_init(idxcur_t *cur, blist_t *blist, int type, int descending)
+{
+    blist_t **part = blist->shard != NULL ? blist->shard : &blist;
+    cur->blist = blist;
+    cur->type = type;
+    cur->n = blist->shard != NULL ? blist->nshards : 1;
+    cur->descending = descending;
+    cur->yield = 0;
+    cur->count = 0;
+    cur->last = NULL;
+    blist_index(blist, type);
+    for (unsigned int i = 0; i < cur->n; ++i)
+    {
+        cur->list[i] = part[i]->index[type];
+        cur->node[i] = descending ? cur->list[i]->tail : cur->list[i]->head->next[0];
+    }
+}
+
+void idxcur_seek(idxcur_t *cur, unsigned long long num, const char *str)
+{
+    for (unsigned int i = 0; i < cur->n; ++i)
+    {
+        cur->node[i] = skip_seek(cur->list[i], num, str);
+    }
+}
+
+skipnode_t *idxcur_next(idxcur_t *cur)
+{
+    // Few shards, a linear pick beats a heap.
+    if (cur->yield && cur->last != NULL && cur->count % IDXCUR_PAGE_BOOKS == 0)
+    {
+        idxcur_resume(cur);
+    }
+    int best = -1;
+    for (unsigned int i = 0; i < cur->n; ++i)
+    {
+        skipnode_t *node = cur->node[i];
+        if (node == NULL)
+        {
+            continue;
+        }
+        if (best < 0)
+        {
+            best = i;
+            continue;
+        }
+        int cmp = skip_cmp(cur->list[i], node, cur->node[best]->num, cur->node[best]->str, cur->node[best]->sn);
+        if (cur->descending ? cmp > 0 : cmp < 0)
+        {
+            best = i;
+        }
+    }
+    if (best < 0)
+    {
+        return NULL;
+    }
+    skipnode_t *node = cur->node[best];
+    cur->node[best] = cur->descending ? node->prev : node->next[0];
+    cur->last = node;
+    cur->count++;
+    return node;
+}
+
+void idxcur_resume(idxcur_t *cur)
+{
+    // Caller holds every shard and is done with the last book. Its key is
+    // kept, nodes may be gone once writers got in.
+    char str[MAX_BOOKNAME_LEN + 1];
+    unsigned long long num = cur->last->num;
+    unsigned int sn = cur->last->sn;
+    if (cur->type == IDX_NAME)
+    {
+        snprintf(str, sizeof(str), "%s", cur->last->str);
+    }
+    blist_yield(cur->blist);
+    for (unsigned int i = 0; i < cur->n; ++i)
+    {
+        cur->node[i] = skip_next(cur->list[i], num, cur->type == IDX_NAME ? str : NULL, sn, cur->descending);
+    }
+}
+
+// Column store functions.
+
+bstore_t *bstore_create()
+{
+    bstore_t *new = (bstore_t *)malloc(sizeof(bstore_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    memset(new, 0, sizeof(bstore_t));
+    return new;
+}
+
+void bstore_destroy(bstore_t *store)
+{
+    free(store->sn);
+    free(store->price);
+    free(store->quantity);
+    free(store->name);
+    free(store);
+}
+
+unsigned int bstore_append(bstore_t *store, const book_t *data)
+{
+    if (store->n == store->size)
+    {
+        bstore_reserve(store, store->size ? store->size * 2 : BSTORE_INIT_SIZE);
+    }
+    unsigned int row = store->n;
+    store->sn[row] = data->sn;
+    store->price[row] = data->price;
+    store->quantity[row] = data->quantity;
+    store->name[row] = intern_get(data->name, strlen(data->name));
+    store->n++;
+    return row;
+}
+
+void bstore_reserve(bstore_t *store, unsigned int size)
+{
+    if (size <= store->size)
+    {
+        return;
+    }
+    // Grow all columns.
+    unsigned int *sn = (unsigned int *)realloc(store->sn, sizeof(unsigned int) * size);
+    unsigned int *price = (unsigned int *)realloc(store->price, sizeof(unsigned int) * size);
+    unsigned int *quantity = (unsigned int *)realloc(store->quantity, sizeof(unsigned int) * size);
+    char **name = (char **)realloc(store->name, sizeof(char *) * size);
+    if (sn == NULL || price == NULL || quantity == NULL || name == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    store->sn = sn;
+    store->price = price;
+    store->quantity = quantity;
+    store->name = name;
+    store->size = size;
+}
+
+void bstore_view(const bstore_t *store, unsigned int row, book_t *book)
+{
+    book->sn = store->sn[row];
+    book->name = store->name[row];
+    book->price = store->price[row];
+    book->quantity = store->quantity[row];
+}
+
+size_t bstore_held(const bstore_t *store)
+{
+    return (size_t)store->size * (sizeof(unsigned int) * 3 + sizeof(char *));
+}
+
+void bstore_remove(bstore_t *store, unsigned int row)
+{
+    unsigned int last = store->n - 1;
+    store->sn[row] = store->sn[last];
+    store->price[row] = store->price[last];
+    store->quantity[row] = store->quantity[last];
+    store->name[row] = store->name[last];
+    store->n--;
+}
+
+// Arena functions.
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    // Keep allocations pointer aligned.
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    arena->used += size;
+    // Reuse freed block of same size class.
+    if (size <= ARENA_MAX_CLASS && arena->free[size / sizeof(void *)] != NULL)
+    {
+        void *ptr = arena->free[size / sizeof(void *)];
+        arena->free[size / sizeof(void *)] = *(void **)ptr;
+        return ptr;
+    }
+    arena_chunk_t *chunk = arena->head;
+    if (chunk == NULL || chunk->size - chunk->used < size)
+    {
+        size_t chunksize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = (arena_chunk_t *)malloc(sizeof(arena_chunk_t) + chunksize);
+        if (chunk == NULL)
+        {
+            error_die("Malloc failed");
+        }
+        chunk->next = arena->head;
+        chunk->used = 0;
+        chunk->size = chunksize;
+        arena->head = chunk;
+        arena->held += chunksize;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void arena_free(arena_t *arena, void *ptr, size_t size)
+{
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    arena->used -= size;
+    // Larger blocks stay unused until arena is destroyed.
+    if (size <= ARENA_MAX_CLASS)
+    {
+        *(void **)ptr = arena->free[size / sizeof(void *)];
+        arena->free[size / sizeof(void *)] = ptr;
+    }
+}
+
+void arena_destroy(arena_t *arena)
+{
+    arena_chunk_t *current = arena->head;
+    arena_chunk_t *temp = NULL;
+    while (current != NULL)
+    {
+        temp = current;
+        current = current->next;
+        free(temp);
+    }
+    memset(arena, 0, sizeof(arena_t));
+}
+
+// Intern table functions.
+
+intern_t intern[INTERN_STRIPES] = {[0 ... INTERN_STRIPES - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+
+char *intern_get(const char *str, size_t len)
+{
+    unsigned int hash = journal_sum(str, len, 2166136261U);
+    intern_t *stripe = &intern[hash & (INTERN_STRIPES - 1)];
+    pthread_mutex_lock(&stripe->lock);
+    if (stripe->size == 0)
+    {
+        stripe->size = INTERN_INIT_SIZE;
+        stripe->bucket = (istr_t **)calloc(stripe->size, sizeof(istr_t *));
+        if (stripe->bucket == NULL)
+        {
+            error_die("Malloc failed");
+        }
+    }
+    istr_t **head = &stripe->bucket[(hash / INTERN_STRIPES) & (stripe->size - 1)];
+    for (istr_t *entry = *head; entry != NULL; entry = entry->next)
+    {
+        if (entry->hash == hash && memcmp(entry->str, str, len) == 0 && entry->str[len] == '\0')
+        {
+            entry->refs++;
+            pthread_mutex_unlock(&stripe->lock);
+            return entry->str;
+        }
+    }
+    istr_t *new = (istr_t *)arena_alloc(&stripe->mem, sizeof(istr_t) + len + 1);
+    new->refs = 1;
+    new->hash = hash;
+    memcpy(new->str, str, len);
+    new->str[len] = '\0';
+    new->next = *head;
+    *head = new;
+    // Keep chains short, at most one entry per bucket on average.
+    if (++stripe->n > stripe->size)
+    {
+        unsigned int size = stripe->size * 2;
+        istr_t **bucket = (istr_t **)calloc(size, sizeof(istr_t *));
+        if (bucket == NULL)
+        {
+            error_die("Malloc failed");
+        }
+        for (unsigned int i = 0; i < stripe->size; ++i)
+        {
+            istr_t *entry = stripe->bucket[i];
+            while (entry != NULL)
+            {
+                istr_t *next = entry->next;
+                istr_t **to = &bucket[(entry->hash / INTERN_STRIPES) & (size - 1)];
+                entry->next = *to;
+                *to = entry;
+                entry = next;
+            }
+        }
+        free(stripe->bucket);
+        stripe->bucket = bucket;
+        stripe->size = size;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return new->str;
+}
+
+void intern_put(char *str)
+{
+    istr_t *entry = (istr_t *)(str - offsetof(istr_t, str));
+    intern_t *stripe = &intern[entry->hash & (INTERN_STRIPES - 1)];
+    pthread_mutex_lock(&stripe->lock);
+    if (--entry->refs == 0)
+    {
+        istr_t **prev = &stripe->bucket[(entry->hash / INTERN_STRIPES) & (stripe->size - 1)];
+        while (*prev != entry)
+        {
+            prev = &(*prev)->next;
+        }
+        *prev = entry->next;
+        stripe->n--;
+        arena_free(&stripe->mem, entry, sizeof(istr_t) + strlen(entry->str) + 1);
+    }
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+void intern_usage(size_t *held, size_t *used, unsigned int *n)
+{
+    *held = 0;
+    *used = 0;
+    *n = 0;
+    for (unsigned int i = 0; i < INTERN_STRIPES; ++i)
+    {
+        pthread_mutex_lock(&intern[i].lock);
+        *held += intern[i].mem.held + sizeof(istr_t *) * intern[i].size;
+        *used += intern[i].mem.used;
+        *n += intern[i].n;
+        pthread_mutex_unlock(&intern[i].lock);
+    }
+}
+
+// Pool functions.
+
+void pool_init(pool_t *pool, size_t objsize)
+{
+    memset(pool, 0, sizeof(pool_t));
+    // Free list links live inside free objects.
+    if (objsize < sizeof(void *))
+    {
+        objsize = sizeof(void *);
+    }
+    pool->objsize = (objsize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    pool->carved = POOL_SLAB_SIZE;
+}
+
+void *pool_alloc(pool_t *pool)
+{
+    void *ptr;
+    pool->n++;
+    if (pool->free != NULL)
+    {
+        ptr = pool->free;
+        pool->free = *(void **)ptr;
+        return ptr;
+    }
+    if (pool->carved == POOL_SLAB_SIZE)
+    {
+        size_t slabsize = pool->objsize * POOL_SLAB_SIZE;
+        pool_slab_t *slab = (pool_slab_t *)malloc(sizeof(pool_slab_t) + slabsize);
+        if (slab == NULL)
+        {
+            error_die("Malloc failed");
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->carved = 0;
+        pool->held += slabsize;
+    }
+    ptr = pool->slabs->data + pool->objsize * pool->carved;
+    pool->carved++;
+    return ptr;
+}
+
+void pool_free(pool_t *pool, void *ptr)
+{
+    *(void **)ptr = pool->free;
+    pool->free = ptr;
+    pool->n--;
+}
+
+void pool_merge(pool_t *pool, pool_t *from)
+{
+    // Splice slabs behind current slab, rest of from's slab stays unused.
+    if (from->slabs != NULL)
+    {
+        pool_slab_t *last = from->slabs;
+        while (last->next != NULL)
+        {
+            last = last->next;
+        }
+        if (pool->slabs == NULL)
+        {
+            pool->slabs = from->slabs;
+            pool->carved = from->carved;
+        }
+        else
+        {
+            last->next = pool->slabs->next;
+            pool->slabs->next = from->slabs;
+        }
+    }
+    if (from->free != NULL)
+    {
+        void **last = (void **)from->free;
+        while (*last != NULL)
+        {
+            last = (void **)*last;
+        }
+        *last = pool->free;
+        pool->free = from->free;
+    }
+    pool->held += from->held;
+    pool->n += from->n;
+    pool_init(from, from->objsize);
+}
+
+void pool_destroy(pool_t *pool)
+{
+    pool_slab_t *current = pool->slabs;
+    pool_slab_t *temp = NULL;
+    while (current != NULL)
+    {
+        temp = current;
+        current = current->next;
+        free(temp);
+    }
+    pool_init(pool, pool->objsize);
+}
+
+// SNMap functions.
+
+unsigned int sn_hash(unsigned int sn)
+{
+    // Murmur3 finalizer, spreads clustered SNs over all bits.
+    sn ^= sn >> 16;
+    sn *= 0x85ebca6bU;
+    sn ^= sn >> 13;
+    sn *= 0xc2b2ae35U;
+    sn ^= sn >> 16;
+    return sn;
+}
+
+size_t snmap_held(const snmap_t *snmap)
+{
+    return (size_t)(snmap->cur.size + snmap->old.size) * (sizeof(snmap_node_t) + 1);
+}
+
+snmap_t *snmap_create()
+{
+    snmap_t *new = (snmap_t *)malloc(sizeof(snmap_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    memset(new, 0, sizeof(snmap_t));
+    snmap_table_init(&new->cur, SNMAP_INIT_SIZE);
+    return new;
+}
+
+void snmap_destroy(snmap_t *snmap)
+{
+    free(snmap->cur.slot);
+    free(snmap->cur.meta);
+    free(snmap->old.slot);
+    free(snmap->old.meta);
+    free(snmap);
+}
+
+void snmap_table_init(snmap_table_t *table, unsigned int size)
+{
+    table->slot = (snmap_node_t *)malloc(sizeof(snmap_node_t) * size);
+    table->meta = (unsigned char *)calloc(size, 1);
+    if (table->slot == NULL || table->meta == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    table->size = size;
+    table->n = 0;
+}
+
+long snmap_table_find(const snmap_table_t *table, unsigned int sn, unsigned int hash)
+{
+    if (table->size == 0)
+    {
+        return -1;
+    }
+    unsigned int mask = table->size - 1;
+    unsigned int idx = hash & mask;
+    unsigned int dist = 1;
+    // Entries are ordered by probe distance, stop at first poorer slot.
+    while (table->meta[idx] >= dist)
+    {
+        if (table->meta[idx] == dist && table->slot[idx].sn == sn)
+        {
+            return idx;
+        }
+        idx = (idx + 1) & mask;
+        dist++;
+    }
+    return -1;
+}
+
+int snmap_table_insert(snmap_table_t *table, snmap_node_t *node)
+{
+    unsigned int mask = table->size - 1;
+    unsigned int idx = sn_hash(node->sn) & mask;
+    unsigned int dist = 1;
+    snmap_node_t temp;
+    unsigned char tempdist;
+    while (1)
+    {
+        if (table->meta[idx] == 0) // Empty slot.
+        {
+            table->slot[idx] = *node;
+            table->meta[idx] = dist;
+            table->n++;
+            return 0;
+        }
+        if (table->meta[idx] < dist) // Take from the rich.
+        {
+            temp = table->slot[idx];
+            tempdist = table->meta[idx];
+            table->slot[idx] = *node;
+            table->meta[idx] = dist;
+            *node = temp;
+            dist = tempdist;
+        }
+        idx = (idx + 1) & mask;
+        dist++;
+        if (dist > 255)
+        {
+            // Distance no longer fits in meta, node holds displaced entry.
+            return -1;
+        }
+    }
+}
+
+void snmap_table_erase(snmap_table_t *table, unsigned int idx)
+{
+    unsigned int mask = table->size - 1;
+    unsigned int next = (idx + 1) & mask;
+    // Shift following displaced entries back by one.
+    while (table->meta[next] > 1)
+    {
+        table->slot[idx] = table->slot[next];
+        table->meta[idx] = table->meta[next] - 1;
+        idx = next;
+        next = (next + 1) & mask;
+    }
+    table->meta[idx] = 0;
+    table->n--;
+}
+
+void snmap_place(snmap_t *snmap, snmap_node_t node)
+{
+    while (snmap_table_insert(&snmap->cur, &node) < 0)
+    {
+        // Probe sequence too long, grow and place displaced entry.
+        snmap_grow(snmap);
+    }
+}
+
+void snmap_grow(snmap_t *snmap)
+{
+    // Finish pending migration first.
+    snmap_migrate(snmap, (unsigned int)-1);
+    snmap->old = snmap->cur;
+    snmap->migrate = 0;
+    snmap_table_init(&snmap->cur, snmap->old.size * 2);
+}
+
+void snmap_migrate(snmap_t *snmap, unsigned int steps)
+{
+    snmap_table_t *old = &snmap->old;
+    snmap_node_t node;
+    while (old->size != 0 && steps > 0)
+    {
+        if (old->n == 0) // Migration finished.
+        {
+            free(old->slot);
+            free(old->meta);
+            memset(old, 0, sizeof(snmap_table_t));
+            return;
+        }
+        if (old->meta[snmap->migrate] == 0)
+        {
+            snmap->migrate++;
+        }
+        else
+        {
+            // Erasing shifts successors back into this slot, slots
+            // before migrate stay empty.
+            node = old->slot[snmap->migrate];
+            snmap_table_erase(old, snmap->migrate);
+            snmap_place(snmap, node);
+        }
+        steps--;
+    }
+}
+
+void snmap_append(snmap_t *snmap, snmap_node_t node)
+{
+    unsigned int hash = sn_hash(node.sn);
+    long idx;
+    // Update existing entry.
+    if ((idx = snmap_table_find(&snmap->cur, node.sn, hash)) >= 0)
+    {
+        snmap->cur.slot[idx] = node;
+        return;
+    }
+    if ((idx = snmap_table_find(&snmap->old, node.sn, hash)) >= 0)
+    {
+        snmap->old.slot[idx] = node;
+        return;
+    }
+    snmap_migrate(snmap, SNMAP_MIGRATE_STEP);
+    if ((unsigned long)(snmap->cur.n + 1) * SNMAP_LOAD_DEN > (unsigned long)snmap->cur.size * SNMAP_LOAD_NUM)
+    {
+        snmap_grow(snmap);
+    }
+    snmap_place(snmap, node);
+}
+
+void snmap_reserve(snmap_t *snmap, unsigned int n)
+{
+    // Only resize empty map.
+    if (snmap->cur.n != 0 || snmap->old.n != 0)
+    {
+        return;
+    }
+    unsigned int size = SNMAP_INIT_SIZE;
+    while ((unsigned long)n * SNMAP_LOAD_DEN > (unsigned long)size * SNMAP_LOAD_NUM)
+    {
+        size *= 2;
+    }
+    free(snmap->cur.slot);
+    free(snmap->cur.meta);
+    free(snmap->old.slot);
+    free(snmap->old.meta);
+    memset(snmap, 0, sizeof(snmap_t));
+    snmap_table_init(&snmap->cur, size);
+}
+
+snmap_node_t *snmap_query(snmap_t *snmap, unsigned int sn)
+{
+    unsigned int hash = sn_hash(sn);
+    long idx;
+    if ((idx = snmap_table_find(&snmap->cur, sn, hash)) >= 0)
+    {
+        return &snmap->cur.slot[idx];
+    }
+    if ((idx = snmap_table_find(&snmap->old, sn, hash)) >= 0)
+    {
+        return &snmap->old.slot[idx];
+    }
+    return NULL;
+}
+
+void snmap_prefetch(const snmap_t *snmap, unsigned int sn)
+{
+    // Home slot only, most lookups end there.
+    if (snmap->cur.size == 0)
+    {
+        return;
+    }
+    unsigned int idx = sn_hash(sn) & (snmap->cur.size - 1);
+    __builtin_prefetch(&snmap->cur.meta[idx]);
+    __builtin_prefetch(&snmap->cur.slot[idx]);
+}
+
+const snmap_node_t *snmap_home(const snmap_t *snmap, unsigned int sn)
+{
+    // Node of sn if it sits in its home slot, without probing further.
+    if (snmap->cur.size == 0)
+    {
+        return NULL;
+    }
+    unsigned int idx = sn_hash(sn) & (snmap->cur.size - 1);
+    if (snmap->cur.meta[idx] == 0 || snmap->cur.slot[idx].sn != sn)
+    {
+        return NULL;
+    }
+    return &snmap->cur.slot[idx];
+}
+
+void snmap_remove(snmap_t *snmap, unsigned int sn)
+{
+    unsigned int hash = sn_hash(sn);
+    long idx;
+    if ((idx = snmap_table_find(&snmap->cur, sn, hash)) >= 0)
+    {
+        snmap_table_erase(&snmap->cur, idx);
+    }
+    else if ((idx = snmap_table_find(&snmap->old, sn, hash)) >= 0)
+    {
+        snmap_table_erase(&snmap->old, idx);
+    }
+    snmap_migrate(snmap, SNMAP_MIGRATE_STEP);
+}
+
+// Skip list functions.
+
+skiplist_t *skip_create(int type)
+{
+    skiplist_t *new = (skiplist_t *)malloc(sizeof(skiplist_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    memset(new, 0, sizeof(skiplist_t));
+    new->type = type;
+    new->level = 1;
+    new->seed = 2463534242U;
+    new->head = (skipnode_t *)arena_alloc(&new->nodes, sizeof(skipnode_t) + sizeof(skipnode_t *) * SKIP_MAX_LEVEL);
+    memset(new->head, 0, sizeof(skipnode_t) + sizeof(skipnode_t *) * SKIP_MAX_LEVEL);
+    new->head->level = SKIP_MAX_LEVEL;
+    return new;
+}
+
+void skip_destroy(skiplist_t *list)
+{
+    arena_destroy(&list->nodes);
+    free(list);
+}
+
+void skip_key(int type, const book_t *book, unsigned long long *num, const char **str)
+{
+    *num = 0;
+    *str = NULL;
+    switch (type)
+    {
+    case IDX_PRICE:
+        *num = book->price;
+        break;
+    case IDX_NAME:
+        *str = book->name;
+        break;
+    case IDX_QUANT:
+        *num = book->quantity;
+        break;
+    case IDX_VALUE:
+        *num = (unsigned long long)book->price * book->quantity;
+        break;
+    case IDX_SN:
+        *num = book->sn;
+        break;
+    }
+}
+
+int skip_cmp(const skiplist_t *list, const skipnode_t *node, unsigned long long num, const char *str, unsigned int sn)
+{
+    if (str != NULL)
+    {
+        int res = strcmp(node->str, str);
+        if (res != 0)
+        {
+            return res;
+        }
+    }
+    else if (node->num != num)
+    {
+        return node->num < num ? -1 : 1;
+    }
+    return node->sn < sn ? -1 : node->sn > sn;
+}
+
+void skip_insert(skiplist_t *list, const book_t *book)
+{
+    unsigned long long num;
+    const char *str;
+    skipnode_t *update[SKIP_MAX_LEVEL];
+    skipnode_t *current = list->head;
+    skip_key(list->type, book, &num, &str);
+    for (int i = list->level - 1; i >= 0; --i)
+    {
+        while (current->next[i] != NULL && skip_cmp(list, current->next[i], num, str, book->sn) < 0)
+        {
+            current = current->next[i];
+        }
+        update[i] = current;
+    }
+    // Random level, each level with probability 1/4.
+    unsigned int level = 1;
+    list->seed ^= list->seed << 13;
+    list->seed ^= list->seed >> 17;
+    list->seed ^= list->seed << 5;
+    for (unsigned int bits = list->seed; (bits & 3) == 0 && level < SKIP_MAX_LEVEL; bits >>= 2)
+    {
+        level++;
+    }
+    while (list->level < level)
+    {
+        update[list->level++] = list->head;
+    }
+    skipnode_t *new = (skipnode_t *)arena_alloc(&list->nodes, sizeof(skipnode_t) + sizeof(skipnode_t *) * level);
+    new->num = num;
+    new->str = str;
+    new->sn = book->sn;
+    new->level = level;
+    for (unsigned int i = 0; i < level; ++i)
+    {
+        new->next[i] = update[i]->next[i];
+        update[i]->next[i] = new;
+    }
+    new->prev = update[0] == list->head ? NULL : update[0];
+    if (new->next[0] != NULL)
+    {
+        new->next[0]->prev = new;
+    }
+    else
+    {
+        list->tail = new;
+    }
+    list->n++;
+}
+
+void skip_remove(skiplist_t *list, const book_t *book)
+{
+    unsigned long long num;
+    const char *str;
+    skipnode_t *update[SKIP_MAX_LEVEL];
+    skipnode_t *current = list->head;
+    skip_key(list->type, book, &num, &str);
+    for (int i = list->level - 1; i >= 0; --i)
+    {
+        while (current->next[i] != NULL && skip_cmp(list, current->next[i], num, str, book->sn) < 0)
+        {
+            current = current->next[i];
+        }
+        update[i] = current;
+    }
+    current = current->next[0];
+    if (current == NULL || skip_cmp(list, current, num, str, book->sn) != 0)
+    {
+        return;
+    }
+    for (unsigned int i = 0; i < current->level; ++i)
+    {
+        update[i]->next[i] = current->next[i];
+    }
+    if (current->next[0] != NULL)
+    {
+        current->next[0]->prev = current->prev;
+    }
+    else
+    {
+        list->tail = current->prev;
+    }
+    while (list->level > 1 && list->head->next[list->level - 1] == NULL)
+    {
+        list->level--;
+    }
+    arena_free(&list->nodes, current, sizeof(skipnode_t) + sizeof(skipnode_t *) * current->level);
+    list->n--;
+}
+
+skipnode_t *skip_seek(const skiplist_t *list, unsigned long long num, const char *str)
+{
+    // First node with key not less than given key.
+    skipnode_t *current = list->head;
+    for (int i = list->level - 1; i >= 0; --i)
+    {
+        while (current->next[i] != NULL && skip_cmp(list, current->next[i], num, str, 0) < 0)
+        {
+            current = current->next[i];
+        }
+    }
+    return current->next[0];
+}
+
+skipnode_t *skip_next(const skiplist_t *list, unsigned long long num, const char *str, unsigned int sn, int descending)
+{
+    // First node after the key of a book, or last one before it.
+    skipnode_t *current = list->head;
+    for (int i = list->level - 1; i >= 0; --i)
+    {
+        while (current->next[i] != NULL && skip_cmp(list, current->next[i], num, str, sn) < 0)
+        {
+            current = current->next[i];
+        }
+    }
+    if (descending)
+    {
+        return current != list->head ? current : NULL;
+    }
+    current = current->next[0];
+    if (current != NULL && skip_cmp(list, current, num, str, sn) == 0)
+    {
+        current = current->next[0];
+    }
+    return current;
+}
+
+// Trigram index functions.
+
+trigram_t *trigram_create()
+{
+    trigram_t *new = (trigram_t *)malloc(sizeof(trigram_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    new->size = TRIGRAM_INIT_SIZE;
+    new->n = 0;
+    new->slot = (posting_t *)calloc(new->size, sizeof(posting_t));
+    if (new->slot == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    return new;
+}
+
+void trigram_destroy(trigram_t *tg)
+{
+    for (unsigned int i = 0; i < tg->size; ++i)
+    {
+        free(tg->slot[i].sn);
+    }
+    free(tg->slot);
+    free(tg);
+}
+
+posting_t *trigram_posting(trigram_t *tg, unsigned int key, int create)
+{
+    if (create && (tg->n + 1) * 2 > tg->size)
+    {
+        // Rehash into twice the slots. Postings are never removed.
+        posting_t *old = tg->slot;
+        unsigned int oldsize = tg->size;
+        tg->size *= 2;
+        tg->slot = (posting_t *)calloc(tg->size, sizeof(posting_t));
+        if (tg->slot == NULL)
+        {
+            error_die("Malloc failed");
+        }
+        for (unsigned int i = 0; i < oldsize; ++i)
+        {
+            if (old[i].key == 0)
+            {
+                continue;
+            }
+            unsigned int idx = sn_hash(old[i].key) & (tg->size - 1);
+            while (tg->slot[idx].key != 0)
+            {
+                idx = (idx + 1) & (tg->size - 1);
+            }
+            tg->slot[idx] = old[i];
+        }
+        free(old);
+    }
+    unsigned int idx = sn_hash(key) & (tg->size - 1);
+    while (tg->slot[idx].key != 0)
+    {
+        if (tg->slot[idx].key == key)
+        {
+            return &tg->slot[idx];
+        }
+        idx = (idx + 1) & (tg->size - 1);
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+    tg->slot[idx].key = key;
+    tg->n++;
+    return &tg->slot[idx];
+}
+
+long posting_find(const posting_t *post, unsigned int sn)
+{
+    // Lower bound, negative if sn absent.
+    unsigned int lo = 0;
+    unsigned int hi = post->n;
+    while (lo < hi)
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (post->sn[mid] < sn)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo < post->n && post->sn[lo] == sn ? (long)lo : -(long)lo - 1;
+}
+
+void trigram_add(trigram_t *tg, const char *name, unsigned int sn, int bulk)
+{
+    for (const unsigned char *p = (const unsigned char *)name; p[0] && p[1] && p[2]; ++p)
+    {
+        posting_t *post = trigram_posting(tg, (unsigned int)p[0] << 16 | p[1] << 8 | p[2], 1);
+        // Bulk adds append, trigram_seal sorts once at the end.
+        long pos = bulk ? -(long)post->n - 1 : posting_find(post, sn);
+        if (pos >= 0)
+        {
+            // Repeated trigram in name.
+            continue;
+        }
+        pos = -pos - 1;
+        if (post->n == post->size)
+        {
+            post->size = post->size ? post->size * 2 : POSTING_INIT_SIZE;
+            post->sn = (unsigned int *)realloc(post->sn, sizeof(unsigned int) * post->size);
+            if (post->sn == NULL)
+            {
+                error_die("Malloc failed");
+            }
+        }
+        memmove(post->sn + pos + 1, post->sn + pos, sizeof(unsigned int) * (post->n - pos));
+        post->sn[pos] = sn;
+        post->n++;
+    }
+}
+
+void trigram_seal(trigram_t *tg)
+{
+    for (unsigned int i = 0; i < tg->size; ++i)
+    {
+        posting_t *post = &tg->slot[i];
+        if (post->n == 0)
+        {
+            continue;
+        }
+        qsort(post->sn, post->n, sizeof(unsigned int), sn_cmp);
+        // Drop repeated trigrams of a name.
+        unsigned int kept = 1;
+        for (unsigned int j = 1; j < post->n; ++j)
+        {
+            if (post->sn[j] != post->sn[kept - 1])
+            {
+                post->sn[kept++] = post->sn[j];
+            }
+        }
+        post->n = kept;
+    }
+}
+
+int sn_cmp(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+void trigram_remove(trigram_t *tg, const char *name, unsigned int sn)
+{
+    for (const unsigned char *p = (const unsigned char *)name; p[0] && p[1] && p[2]; ++p)
+    {
+        posting_t *post = trigram_posting(tg, (unsigned int)p[0] << 16 | p[1] << 8 | p[2], 0);
+        if (post == NULL)
+        {
+            continue;
+        }
+        long pos = posting_find(post, sn);
+        if (pos < 0)
+        {
+            continue;
+        }
+        memmove(post->sn + pos, post->sn + pos + 1, sizeof(unsigned int) * (post->n - pos - 1));
+        post->n--;
+    }
+}
+
+unsigned int trigram_search(trigram_t *tg, const char *text, unsigned int **res)
+{
+    // Candidates are SNs in every posting of text, smallest posting first.
+    const posting_t *shortest = NULL;
+    const unsigned char *p;
+    *res = NULL;
+    for (p = (const unsigned char *)text; p[0] && p[1] && p[2]; ++p)
+    {
+        posting_t *post = trigram_posting(tg, (unsigned int)p[0] << 16 | p[1] << 8 | p[2], 0);
+        if (post == NULL || post->n == 0)
+        {
+            return 0;
+        }
+        if (shortest == NULL || post->n < shortest->n)
+        {
+            shortest = post;
+        }
+    }
+    if (shortest == NULL)
+    {
+        return 0;
+    }
+    unsigned int *cand = (unsigned int *)malloc(sizeof(unsigned int) * shortest->n);
+    if (cand == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    memcpy(cand, shortest->sn, sizeof(unsigned int) * shortest->n);
+    unsigned int n = shortest->n;
+    for (p = (const unsigned char *)text; p[0] && p[1] && p[2] && n > 0; ++p)
+    {
+        const posting_t *post = trigram_posting(tg, (unsigned int)p[0] << 16 | p[1] << 8 | p[2], 0);
+        if (post == shortest)
+        {
+            continue;
+        }
+        unsigned int kept = 0;
+        for (unsigned int i = 0; i < n; ++i)
+        {
+            if (posting_find(post, cand[i]) >= 0)
+            {
+                cand[kept++] = cand[i];
+            }
+        }
+        n = kept;
+    }
+    *res = cand;
+    return n;
+}
+
+// Journal functions.
+
+journal_t *journal_open(const char *datapath)
+{
+    journal_t *new = (journal_t *)malloc(sizeof(journal_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    memset(new, 0, sizeof(journal_t));
+    new->datapath = strdup(datapath);
+    new->path = (char *)malloc(strlen(datapath) + sizeof(".journal.old"));
+    new->oldpath = (char *)malloc(strlen(datapath) + sizeof(".journal.old"));
+    new->buf = (char *)malloc(JOURNAL_BUF_SIZE);
+    if (new->datapath == NULL || new->path == NULL || new->oldpath == NULL || new->buf == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    sprintf(new->path, "%s.journal", datapath);
+    sprintf(new->oldpath, "%s.journal.old", datapath);
+    errno = 0;
+    new->fd = open(new->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (new->fd < 0)
+    {
+        error_die(strerror(errno));
+    }
+    struct stat st;
+    if (fstat(new->fd, &st) < 0)
+    {
+        error_die(strerror(errno));
+    }
+    new->size = st.st_size;
+    new->ledgerfd = -1;
+    pthread_mutex_init(&new->buflock, NULL);
+    pthread_mutex_init(&new->lock, NULL);
+    pthread_cond_init(&new->cond, NULL);
+    pthread_cond_init(&new->synccond, NULL);
+    if (pthread_create(&new->syncer, NULL, journal_syncer, new) != 0)
+    {
+        error_die("Failed to create thread");
+    }
+    return new;
+}
+
+void journal_close(journal_t *jnl)
+{
+    pthread_mutex_lock(&jnl->buflock);
+    journal_write(jnl);
+    pthread_mutex_unlock(&jnl->buflock);
+    pthread_mutex_lock(&jnl->lock);
+    jnl->stop = 1;
+    pthread_cond_signal(&jnl->cond);
+    pthread_mutex_unlock(&jnl->lock);
+    pthread_join(jnl->syncer, NULL);
+    fsync(jnl->fd);
+    close(jnl->fd);
+    pthread_mutex_destroy(&jnl->buflock);
+    pthread_mutex_destroy(&jnl->lock);
+    pthread_cond_destroy(&jnl->cond);
+    pthread_cond_destroy(&jnl->synccond);
+    free(jnl->datapath);
+    free(jnl->path);
+    free(jnl->oldpath);
+    free(jnl->buf);
+    free(jnl);
+}
+
+unsigned int journal_sum(const void *data, size_t len, unsigned int sum)
+{
+    // FNV-1a.
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; ++i)
+    {
+        sum ^= p[i];
+        sum *= 16777619U;
+    }
+    return sum;
+}
+
+int journal_replay(blist_t *blist, const char *path)
+{
+    FILE *jfile = fopen(path, "r+");
+    if (jfile == NULL)
+    {
+        return 0;
+    }
+    jentry_t entry;
+    long good = 0;
+    int n = 0;
+    // Entries are applied in batches, names live next to them.
+    batchop_t *op = (batchop_t *)malloc(sizeof(batchop_t) * BATCH_OPS);
+    char *names = (char *)malloc((MAX_BOOKNAME_LEN + 1) * BATCH_OPS);
+    if (op == NULL || names == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    unsigned int nop = 0;
+    while (fread(&entry, sizeof(jentry_t), 1, jfile) == 1)
+    {
+        char *bookname = names + (MAX_BOOKNAME_LEN + 1) * nop;
+        if (entry.namelen > MAX_BOOKNAME_LEN || fread(bookname, 1, entry.namelen, jfile) != entry.namelen)
+        {
+            break;
+        }
+        bookname[entry.namelen] = '\0';
+        unsigned int sum = journal_sum((const char *)&entry + sizeof(entry.sum), sizeof(jentry_t) - sizeof(entry.sum), 2166136261U);
+        if (journal_sum(bookname, entry.namelen, sum) != entry.sum)
+        {
+            break;
+        }
+        op[nop].data.sn = entry.sn;
+        op[nop].data.name = bookname;
+        op[nop].data.price = entry.price;
+        op[nop].data.quantity = entry.quantity;
+        op[nop].opflag = entry.opflag;
+        // Entries are absolute, failures mean entry is already applied.
+        if (++nop == BATCH_OPS)
+        {
+            blist_batch(blist, op, nop, 0);
+            nop = 0;
+        }
+        good = ftell(jfile);
+        n++;
+    }
+    blist_batch(blist, op, nop, 0);
+    free(names);
+    free(op);
+    // Drop torn tail.
+    if (!feof(jfile) || ftell(jfile) != good)
+    {
+        fprintf(stderr, "%s: discarding corrupt journal tail at byte %ld\n", path, good);
+        if (ftruncate(fileno(jfile), good) != 0)
+        {
+            error_die(strerror(errno));
+        }
+    }
+    if (fclose(jfile) == EOF)
+    {
+        error_die("Failed to close file");
+    }
+    return n;
+}
+
+void journal_append(journal_t *jnl, const book_t *data, int opflag)
+{
+    jentry_t entry;
+    memset(&entry, 0, sizeof(jentry_t));
+    entry.opflag = opflag;
+    entry.sn = data->sn;
+    // Only fields covered by opflag are valid.
+    const char *name = "";
+    if (opflag & (NEW_BOOK | UPD_NAME))
+    {
+        name = data->name;
+        entry.namelen = strlen(name);
+    }
+    if (opflag & (NEW_BOOK | UPD_PRICE))
+    {
+        entry.price = data->price;
+    }
+    if (opflag & (NEW_BOOK | UPD_QUANT))
+    {
+        entry.quantity = data->quantity;
+    }
+    unsigned int sum = journal_sum((const char *)&entry + sizeof(entry.sum), sizeof(jentry_t) - sizeof(entry.sum), 2166136261U);
+    entry.sum = journal_sum(name, entry.namelen, sum);
+    pthread_mutex_lock(&jnl->buflock);
+    if (jnl->used + sizeof(jentry_t) + entry.namelen > JOURNAL_BUF_SIZE)
+    {
+        journal_write(jnl);
+    }
+    memcpy(jnl->buf + jnl->used, &entry, sizeof(jentry_t));
+    memcpy(jnl->buf + jnl->used + sizeof(jentry_t), name, entry.namelen);
+    jnl->used += sizeof(jentry_t) + entry.namelen;
+    pthread_mutex_unlock(&jnl->buflock);
+}
+
+void journal_write(journal_t *jnl)
+{
+    // Caller holds buflock.
+    size_t done = 0;
+    while (done < jnl->used)
+    {
+        ssize_t res = write(jnl->fd, jnl->buf + done, jnl->used - done);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error_die(strerror(errno));
+        }
+        done += res;
+    }
+    jnl->size += jnl->used;
+    if (jnl->used > 0)
+    {
+        // Wake syncer.
+        pthread_mutex_lock(&jnl->lock);
+        jnl->dirty = 1;
+        jnl->written += jnl->used;
+        pthread_cond_signal(&jnl->cond);
+        pthread_mutex_unlock(&jnl->lock);
+    }
+    jnl->used = 0;
+}
+
+void journal_sync(journal_t *jnl)
+{
+    pthread_mutex_lock(&jnl->lock);
+    jnl->dirty = 0;
+    unsigned long long target = jnl->written;
+    pthread_mutex_unlock(&jnl->lock);
+    // Sales first, a crash never loses a sale whose stock is gone.
+    if (jnl->ledgerfd >= 0 && fsync(jnl->ledgerfd) != 0)
+    {
+        error_die(strerror(errno));
+    }
+    if (fsync(jnl->fd) != 0)
+    {
+        error_die(strerror(errno));
+    }
+    pthread_mutex_lock(&jnl->lock);
+    if (jnl->synced < target)
+    {
+        jnl->synced = target;
+    }
+    pthread_cond_broadcast(&jnl->synccond);
+    pthread_mutex_unlock(&jnl->lock);
+}
+
+void journal_await(journal_t *jnl)
+{
+    // Everything written so far is dirty or being synced, the syncer
+    // advances synced past it.
+    pthread_mutex_lock(&jnl->lock);
+    unsigned long long target = jnl->written;
+    jnl->waiters++;
+    while (jnl->synced < target)
+    {
+        pthread_cond_wait(&jnl->synccond, &jnl->lock);
+    }
+    jnl->waiters--;
+    pthread_mutex_unlock(&jnl->lock);
+}
+
+void *journal_syncer(void *arg)
+{
+    journal_t *jnl = (journal_t *)arg;
+    struct timespec delay = {0, JOURNAL_SYNC_MS * 1000000L};
+    pthread_mutex_lock(&jnl->lock);
+    while (!jnl->stop)
+    {
+        if (!jnl->dirty)
+        {
+            pthread_cond_wait(&jnl->cond, &jnl->lock);
+            continue;
+        }
+        // Let writes of the interval pile up, then fsync them at once.
+        // Committers waiting meanwhile are grouped by the fsync itself.
+        if (jnl->waiters == 0)
+        {
+            pthread_mutex_unlock(&jnl->lock);
+            nanosleep(&delay, NULL);
+            pthread_mutex_lock(&jnl->lock);
+        }
+        jnl->dirty = 0;
+        int fd = jnl->fd;
+        unsigned long long target = jnl->written;
+        pthread_mutex_unlock(&jnl->lock);
+        if (jnl->ledgerfd >= 0)
+        {
+            fsync(jnl->ledgerfd);
+        }
+        fsync(fd);
+        pthread_mutex_lock(&jnl->lock);
+        if (jnl->synced < target)
+        {
+            jnl->synced = target;
+        }
+        pthread_cond_broadcast(&jnl->synccond);
+    }
+    pthread_mutex_unlock(&jnl->lock);
+    return NULL;
+}
+
+void journal_commit(blist_t *blist)
+{
+    journal_t *jnl = blist->jnl;
+    if (blist->ledger != NULL)
+    {
+        pthread_mutex_lock(&blist->ledger->lock);
+        ledger_write(blist->ledger);
+        pthread_mutex_unlock(&blist->ledger->lock);
+    }
+    pthread_mutex_lock(&jnl->buflock);
+    journal_write(jnl);
+    pthread_mutex_unlock(&jnl->buflock);
+    // Front ends release results once this returns, so only after fsync.
+    journal_await(jnl);
+    // Compactions start and end under savelock like saves, a busy lock
+    // leaves them to the next commit.
+    if (pthread_mutex_trylock(&blist->savelock) != 0)
+    {
+        return;
+    }
+    // Reap finished compaction.
+    if (jnl->compactor != NULL && __atomic_load_n(&jnl->compactor->done, __ATOMIC_ACQUIRE))
+    {
+        journal_reap(jnl);
+    }
+    pthread_mutex_lock(&jnl->buflock);
+    int compact = jnl->compactor == NULL && !jnl->saving && jnl->size >= JOURNAL_COMPACT_SIZE;
+    pthread_mutex_unlock(&jnl->buflock);
+    if (compact)
+    {
+        journal_compact(blist);
+    }
+    pthread_mutex_unlock(&blist->savelock);
+}
+
+void journal_reset(journal_t *jnl, int saved)
+{
+    // Saved snapshot holds everything moved aside by journal_rotate.
+    pthread_mutex_lock(&jnl->buflock);
+    if (saved && jnl->compactor == NULL)
+    {
+        unlink(jnl->oldpath);
+    }
+    jnl->saving = 0;
+    pthread_mutex_unlock(&jnl->buflock);
+}
+
+void journal_wait(blist_t *blist)
+{
+    // Caller holds savelock. Compaction in progress would rename an older
+    // snapshot over ours, none starts until the save resets saving.
+    journal_t *jnl = blist->jnl;
+    pthread_mutex_lock(&jnl->buflock);
+    jnl->saving = 1;
+    pthread_mutex_unlock(&jnl->buflock);
+    if (jnl->compactor != NULL)
+    {
+        journal_reap(jnl);
+    }
+}
+
+void journal_rotate(journal_t *jnl)
+{
+    // Move journal aside, a failed save or compaction may have left one
+    // already.
+    pthread_mutex_lock(&jnl->buflock);
+    journal_write(jnl);
+    journal_sync(jnl);
+    if (access(jnl->oldpath, F_OK) == 0)
+    {
+        int oldfd = open(jnl->oldpath, O_WRONLY | O_APPEND);
+        int curfd = open(jnl->path, O_RDONLY);
+        char buf[JOURNAL_BUF_SIZE];
+        ssize_t len;
+        if (oldfd < 0 || curfd < 0)
+        {
+            error_die(strerror(errno));
+        }
+        while ((len = read(curfd, buf, sizeof(buf))) > 0)
+        {
+            if (write(oldfd, buf, len) != len)
+            {
+                error_die(strerror(errno));
+            }
+        }
+        if (len < 0 || fsync(oldfd) != 0)
+        {
+            error_die(strerror(errno));
+        }
+        close(oldfd);
+        close(curfd);
+        unlink(jnl->path);
+    }
+    else if (rename(jnl->path, jnl->oldpath) != 0)
+    {
+        error_die(strerror(errno));
+    }
+    int fd = open(jnl->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        error_die(strerror(errno));
+    }
+    pthread_mutex_lock(&jnl->lock);
+    close(jnl->fd);
+    jnl->fd = fd;
+    pthread_mutex_unlock(&jnl->lock);
+    jnl->size = 0;
+    pthread_mutex_unlock(&jnl->buflock);
+}
+
+void journal_compact(blist_t *blist)
+{
+    // Caller holds savelock. Everything logged before rotation is in the
+    // snapshot, which is written like a background save.
+    journal_t *jnl = blist->jnl;
+    journal_rotate(jnl);
+    savetask_t *task = (savetask_t *)calloc(1, sizeof(savetask_t));
+    if (task == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    task->blist = blist;
+    task->format = blist->format;
+    task->snap = snap_take(blist);
+    if (pthread_create(&task->thread, NULL, journal_compactor, task) != 0)
+    {
+        // Old journal stays, the next save takes it in.
+        fprintf(stderr, "Journal compaction failed\n");
+        snap_release(blist, task->snap);
+        free(task);
+        return;
+    }
+    pthread_mutex_lock(&jnl->buflock);
+    jnl->compactor = task;
+    pthread_mutex_unlock(&jnl->buflock);
+}
+
+void *journal_compactor(void *arg)
+{
+    savetask_t *task = (savetask_t *)arg;
+    blist_t *blist = task->blist;
+    task->res = save_data(blist, task->snap, blist->jnl->datapath, task->format);
+    snap_release(blist, task->snap);
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void journal_reap(journal_t *jnl)
+{
+    // Caller holds savelock, or is the only user of the list.
+    savetask_t *task = jnl->compactor;
+    pthread_join(task->thread, NULL);
+    pthread_mutex_lock(&jnl->buflock);
+    if (task->res == 0)
+    {
+        unlink(jnl->oldpath);
+    }
+    else
+    {
+        fprintf(stderr, "Journal compaction failed\n");
+    }
+    jnl->compactor = NULL;
+    pthread_mutex_unlock(&jnl->buflock);
+    free(task);
+}
+
+// Sales ledger functions.
+
+ledger_t *ledger_open(const char *datapath)
+{
+    ledger_t *new = (ledger_t *)malloc(sizeof(ledger_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    memset(new, 0, sizeof(ledger_t));
+    new->buf = (char *)malloc(LEDGER_BUF_SIZE);
+    new->size = LEDGER_INIT_SIZE;
+    new->book = (salebook_t *)calloc(new->size, sizeof(salebook_t));
+    if (new->buf == NULL || new->book == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    pthread_mutex_init(&new->lock, NULL);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.sales", datapath);
+    errno = 0;
+    new->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (new->fd < 0)
+    {
+        error_die(strerror(errno));
+    }
+    // Rebuild rollups, a torn record at the tail is dropped.
+    salerec_t *rec = (salerec_t *)new->buf;
+    size_t held = 0;
+    off_t good = 0;
+    ssize_t len;
+    while ((len = read(new->fd, new->buf + held, LEDGER_BUF_SIZE - held)) > 0)
+    {
+        held += len;
+        size_t n = held / sizeof(salerec_t);
+        for (size_t i = 0; i < n; ++i)
+        {
+            ledger_add(new, &rec[i]);
+        }
+        good += n * sizeof(salerec_t);
+        held -= n * sizeof(salerec_t);
+        memmove(new->buf, new->buf + n * sizeof(salerec_t), held);
+    }
+    if (len < 0)
+    {
+        error_die(strerror(errno));
+    }
+    if (held > 0)
+    {
+        fprintf(stderr, "%s: discarding torn sales record at byte %lld\n", path, (long long)good);
+        if (ftruncate(new->fd, good) != 0)
+        {
+            error_die(strerror(errno));
+        }
+    }
+    return new;
+}
+
+void ledger_close(ledger_t *ledger)
+{
+    ledger_write(ledger);
+    fsync(ledger->fd);
+    close(ledger->fd);
+    pthread_mutex_destroy(&ledger->lock);
+    for (unsigned int i = 0; i < ledger->size; ++i)
+    {
+        free(ledger->book[i].roll.pt);
+    }
+    free(ledger->all.pt);
+    free(ledger->book);
+    free(ledger->buf);
+    free(ledger);
+}
+
+void ledger_sell(ledger_t *ledger, unsigned int sn, unsigned int quantity, unsigned int price)
+{
+    salerec_t rec;
+    rec.sn = sn;
+    rec.quantity = quantity;
+    rec.price = price;
+    pthread_mutex_lock(&ledger->lock);
+    // Keep records in time order if the clock steps back.
+    rec.time = (unsigned int)time(NULL);
+    if (rec.time < ledger->last)
+    {
+        rec.time = ledger->last;
+    }
+    ledger_add(ledger, &rec);
+    if (ledger->used + sizeof(salerec_t) > LEDGER_BUF_SIZE)
+    {
+        ledger_write(ledger);
+    }
+    memcpy(ledger->buf + ledger->used, &rec, sizeof(salerec_t));
+    ledger->used += sizeof(salerec_t);
+    pthread_mutex_unlock(&ledger->lock);
+}
+
+void ledger_add(ledger_t *ledger, const salerec_t *rec)
+{
+    // Caller holds lock.
+    unsigned int hour = rec->time / HOUR_SECS;
+    ledger->last = rec->time;
+    rollup_add(&ledger->all, hour, rec->quantity, rec->price);
+    rollup_add(ledger_book(ledger, rec->sn, 1), hour, rec->quantity, rec->price);
+}
+
+void ledger_write(ledger_t *ledger)
+{
+    // Caller holds lock.
+    size_t done = 0;
+    while (done < ledger->used)
+    {
+        ssize_t res = write(ledger->fd, ledger->buf + done, ledger->used - done);
+        if (res < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error_die(strerror(errno));
+        }
+        done += res;
+    }
+    ledger->used = 0;
+}
+
+rollup_t *ledger_book(ledger_t *ledger, unsigned int sn, int create)
+{
+    // Caller holds lock.
+    unsigned int mask = ledger->size - 1;
+    unsigned int i = sn_hash(sn) & mask;
+    while (ledger->book[i].roll.n > 0)
+    {
+        if (ledger->book[i].sn == sn)
+        {
+            return &ledger->book[i].roll;
+        }
+        i = (i + 1) & mask;
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+    if ((ledger->nbook + 1) * 2 > ledger->size)
+    {
+        // Grow at half load, then look again.
+        salebook_t *old = ledger->book;
+        unsigned int oldsize = ledger->size;
+        ledger->size *= 2;
+        ledger->book = (salebook_t *)calloc(ledger->size, sizeof(salebook_t));
+        if (ledger->book == NULL)
+        {
+            error_die("Malloc failed");
+        }
+        mask = ledger->size - 1;
+        for (unsigned int j = 0; j < oldsize; ++j)
+        {
+            if (old[j].roll.n == 0)
+            {
+                continue;
+            }
+            unsigned int k = sn_hash(old[j].sn) & mask;
+            while (ledger->book[k].roll.n > 0)
+            {
+                k = (k + 1) & mask;
+            }
+            ledger->book[k] = old[j];
+        }
+        free(old);
+        i = sn_hash(sn) & mask;
+        while (ledger->book[i].roll.n > 0)
+        {
+            i = (i + 1) & mask;
+        }
+    }
+    // Slot counts as used once caller adds the first point.
+    ledger->book[i].sn = sn;
+    ledger->nbook++;
+    return &ledger->book[i].roll;
+}
+
+size_t ledger_held(const ledger_t *ledger)
+{
+    size_t held = sizeof(ledger_t) + LEDGER_BUF_SIZE + sizeof(salebook_t) * ledger->size;
+    held += sizeof(rollpt_t) * ledger->all.size;
+    for (unsigned int i = 0; i < ledger->size; ++i)
+    {
+        held += sizeof(rollpt_t) * ledger->book[i].roll.size;
+    }
+    return held;
+}
+
+void rollup_add(rollup_t *roll, unsigned int hour, unsigned int quantity, unsigned int price)
+{
+    unsigned long long units = quantity;
+    unsigned long long revenue = (unsigned long long)quantity * price;
+    if (roll->n > 0 && roll->pt[roll->n - 1].hour >= hour)
+    {
+        // Same hour as latest point.
+        roll->pt[roll->n - 1].units += units;
+        roll->pt[roll->n - 1].revenue += revenue;
+        return;
+    }
+    if (roll->n == roll->size)
+    {
+        roll->size = roll->size ? roll->size * 2 : ROLLUP_INIT_SIZE;
+        roll->pt = (rollpt_t *)realloc(roll->pt, sizeof(rollpt_t) * roll->size);
+        if (roll->pt == NULL)
+        {
+            error_die("Malloc failed");
+        }
+    }
+    rollpt_t *pt = &roll->pt[roll->n];
+    pt->hour = hour;
+    pt->units = units;
+    pt->revenue = revenue;
+    if (roll->n > 0)
+    {
+        pt->units += roll->pt[roll->n - 1].units;
+        pt->revenue += roll->pt[roll->n - 1].revenue;
+    }
+    roll->n++;
+}
+
+unsigned int rollup_find(const rollup_t *roll, unsigned int hour)
+{
+    // Number of points before hour.
+    unsigned int lo = 0;
+    unsigned int hi = roll->n;
+    while (lo < hi)
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (roll->pt[mid].hour < hour)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void rollup_sum(const rollup_t *roll, unsigned int from, unsigned int to, unsigned long long *units, unsigned long long *revenue)
+{
+    // Totals of hours in [from, to).
+    unsigned int lo = rollup_find(roll, from);
+    unsigned int hi = to == UINT_MAX ? roll->n : rollup_find(roll, to);
+    *units = 0;
+    *revenue = 0;
+    if (hi > lo)
+    {
+        *units = roll->pt[hi - 1].units - (lo > 0 ? roll->pt[lo - 1].units : 0);
+        *revenue = roll->pt[hi - 1].revenue - (lo > 0 ? roll->pt[lo - 1].revenue : 0);
+    }
+}
+
+int parse_hour(const char *text, unsigned int *hour, unsigned int *span)
+{
+    // YYYY-MM-DD spans a day, YYYY-MM-DDTHH an hour, both UTC.
+    struct tm tm;
+    int len = 0;
+    memset(&tm, 0, sizeof(struct tm));
+    if (sscanf(text, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &len) != 3 || len != 10)
+    {
+        return INVALID_ARG;
+    }
+    *span = 24;
+    if (text[len] == 'T')
+    {
+        int hlen = 0;
+        if (sscanf(text + len + 1, "%2d%n", &tm.tm_hour, &hlen) != 1 || hlen != 2 || tm.tm_hour > 23)
+        {
+            return INVALID_ARG;
+        }
+        len += 1 + hlen;
+        *span = 1;
+    }
+    if (text[len] != '\0' || tm.tm_year < 1970 || tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31)
+    {
+        return INVALID_ARG;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    time_t t = timegm(&tm);
+    if (t < 0)
+    {
+        return INVALID_ARG;
+    }
+    *hour = t / HOUR_SECS;
+    return SUCCESS;
+}
+
+// Mapped image functions.
+
+mapimg_t *img_open(const char *path, size_t cache)
+{
+    errno = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        error_die(strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        error_die(strerror(errno));
+    }
+    if ((size_t)st.st_size < sizeof(imghdr_t))
+    {
+        error_die("Data file corrupt");
+    }
+    mapimg_t *new = (mapimg_t *)calloc(1, sizeof(mapimg_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    const imghdr_t *hdr;
+    char *base = NULL;
+    if (cache == 0)
+    {
+        // Private writable mapping, pages are faulted in on demand.
+        base = (char *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED)
+        {
+            error_die(strerror(errno));
+        }
+        close(fd);
+        new->base = base;
+        new->size = st.st_size;
+        hdr = (const imghdr_t *)base;
+    }
+    else
+    {
+        pcache_io(fd, (char *)&new->head, sizeof(imghdr_t), 0, 0);
+        hdr = &new->head;
+    }
+    new->hdr = hdr;
+    // Check header.
+    if (memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) != 0)
+    {
+        error_die("Data file corrupt");
+    }
+    if (hdr->version != IMAGE_VERSION)
+    {
+        error_die("Data file version mismatch");
+    }
+    if (hdr->recoff + (unsigned long long)hdr->n * sizeof(imgrec_t) > (size_t)st.st_size ||
+        hdr->idxoff + (unsigned long long)hdr->idxsize * sizeof(imgslot_t) > (size_t)st.st_size ||
+        hdr->nameoff + hdr->namelen > (size_t)st.st_size || hdr->namelen == 0 ||
+        (hdr->idxsize & (hdr->idxsize - 1)) != 0 || hdr->idxsize <= hdr->n ||
+        hdr->listname >= hdr->namelen)
+    {
+        error_die("Data file corrupt");
+    }
+    if (cache == 0)
+    {
+        new->rec = (imgrec_t *)(base + hdr->recoff);
+        new->idx = (const imgslot_t *)(base + hdr->idxoff);
+        new->names = base + hdr->nameoff;
+    }
+    else
+    {
+        // SN index stays in memory, names are mapped read only.
+        imgslot_t *idx = (imgslot_t *)malloc(sizeof(imgslot_t) * hdr->idxsize);
+        if (idx == NULL)
+        {
+            error_die("Malloc failed");
+        }
+        pcache_io(fd, (char *)idx, sizeof(imgslot_t) * hdr->idxsize, hdr->idxoff, 0);
+        new->idx = idx;
+        unsigned long long start = hdr->nameoff & ~(unsigned long long)(sysconf(_SC_PAGESIZE) - 1);
+        new->size = hdr->nameoff + hdr->namelen - start;
+        new->base = (char *)mmap(NULL, new->size, PROT_READ, MAP_PRIVATE, fd, start);
+        if (new->base == MAP_FAILED)
+        {
+            error_die(strerror(errno));
+        }
+        new->names = new->base + (hdr->nameoff - start);
+        new->cache = pcache_create(fd, path, hdr->recoff, hdr->n, cache);
+    }
+    if (new->names[hdr->namelen - 1] != '\0')
+    {
+        error_die("Data file corrupt");
+    }
+    new->live = hdr->n;
+    return new;
+}
+
+void img_close(mapimg_t *img)
+{
+    munmap(img->base, img->size);
+    if (img->cache != NULL)
+    {
+        pcache_destroy(img->cache);
+        free((imgslot_t *)img->idx);
+    }
+    free(img);
+}
+
+long img_query(mapimg_t *img, unsigned int sn, imgrec_t *rec)
+{
+    if (img == NULL)
+    {
+        return -1;
+    }
+    unsigned int mask = img->hdr->idxsize - 1;
+    unsigned int idx = sn_hash(sn) & mask;
+    // Linear probing until empty slot.
+    while (img->idx[idx].rec != 0)
+    {
+        if (img->idx[idx].sn == sn)
+        {
+            if (img->idx[idx].rec > img->hdr->n)
+            {
+                error_die("Data file corrupt");
+            }
+            img_read(img, img->idx[idx].rec - 1, rec);
+            return rec->flags & IMGREC_DELETED ? -1 : (long)img->idx[idx].rec - 1;
+        }
+        idx = (idx + 1) & mask;
+    }
+    return -1;
+}
+
+void img_read(mapimg_t *img, unsigned int idx, imgrec_t *rec)
+{
+    if (img->cache == NULL)
+    {
+        memcpy(rec, &img->rec[idx], sizeof(imgrec_t));
+        return;
+    }
+    pthread_mutex_lock(&img->cache->lock);
+    imgrec_t *page = pcache_page(img->cache, idx / PCACHE_PAGE_RECS, 0);
+    memcpy(rec, &page[idx % PCACHE_PAGE_RECS], sizeof(imgrec_t));
+    pthread_mutex_unlock(&img->cache->lock);
+}
+
+void img_store(mapimg_t *img, unsigned int idx, const imgrec_t *rec)
+{
+    if (img->cache == NULL)
+    {
+        memcpy(&img->rec[idx], rec, sizeof(imgrec_t));
+        return;
+    }
+    pthread_mutex_lock(&img->cache->lock);
+    imgrec_t *page = pcache_page(img->cache, idx / PCACHE_PAGE_RECS, 1);
+    memcpy(&page[idx % PCACHE_PAGE_RECS], rec, sizeof(imgrec_t));
+    pthread_mutex_unlock(&img->cache->lock);
+}
+
+const char *img_name(const mapimg_t *img, const imgrec_t *rec)
+{
+    if (rec->name >= img->hdr->namelen)
+    {
+        error_die("Data file corrupt");
+    }
+    return img->names + rec->name;
+}
+
+void img_view(const mapimg_t *img, const imgrec_t *rec, book_t *book)
+{
+    book->sn = rec->sn;
+    book->name = (char *)img_name(img, rec);
+    book->price = rec->price;
+    book->quantity = rec->quantity;
+}
+
+// Page cache functions.
+
+pcache_t *pcache_create(int fd, const char *path, unsigned long long off, unsigned int n, size_t bytes)
+{
+    pcache_t *new = (pcache_t *)calloc(1, sizeof(pcache_t));
+    if (new == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    pthread_mutex_init(&new->lock, NULL);
+    new->fd = fd;
+    new->off = off;
+    new->n = n;
+    new->npages = (n + PCACHE_PAGE_RECS - 1) / PCACHE_PAGE_RECS;
+    new->nframes = bytes / (sizeof(imgrec_t) * PCACHE_PAGE_RECS);
+    new->nframes = new->nframes < PCACHE_MIN_FRAMES ? PCACHE_MIN_FRAMES : new->nframes;
+    new->nframes = new->nframes > new->npages ? new->npages : new->nframes;
+    new->mem = (char *)malloc(sizeof(imgrec_t) * PCACHE_PAGE_RECS * (new->nframes > 0 ? new->nframes : 1));
+    new->frame = (pframe_t *)calloc(new->nframes + 1, sizeof(pframe_t));
+    new->where = (unsigned int *)calloc(new->npages + 1, sizeof(unsigned int));
+    new->swapped = (unsigned char *)calloc(new->npages + 1, 1);
+    if (new->mem == NULL || new->frame == NULL || new->where == NULL || new->swapped == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    for (unsigned int i = 0; i < new->nframes; ++i)
+    {
+        new->frame[i].page = UINT_MAX;
+    }
+    // Scratch file is gone once closed.
+    char swappath[PATH_MAX];
+    snprintf(swappath, sizeof(swappath), "%s.pages", path);
+    new->swapfd = open(swappath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (new->swapfd < 0)
+    {
+        error_die(strerror(errno));
+    }
+    unlink(swappath);
+    return new;
+}
+
+void pcache_destroy(pcache_t *cache)
+{
+    close(cache->fd);
+    close(cache->swapfd);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->mem);
+    free(cache->frame);
+    free(cache->where);
+    free(cache->swapped);
+    free(cache);
+}
+
+imgrec_t *pcache_page(pcache_t *cache, unsigned int page, int dirty)
+{
+    // Caller holds lock.
+    size_t pagesize = sizeof(imgrec_t) * PCACHE_PAGE_RECS;
+    unsigned int f = cache->where[page];
+    if (f != 0)
+    {
+        cache->hits++;
+        cache->frame[f - 1].ref = 1;
+        cache->frame[f - 1].dirty |= dirty;
+        return (imgrec_t *)(cache->mem + pagesize * (f - 1));
+    }
+    cache->misses++;
+    // Clock, pages used since the hand last passed get another round.
+    while (cache->frame[cache->hand].ref)
+    {
+        cache->frame[cache->hand].ref = 0;
+        cache->hand = (cache->hand + 1) % cache->nframes;
+    }
+    f = cache->hand;
+    cache->hand = (cache->hand + 1) % cache->nframes;
+    pframe_t *frame = &cache->frame[f];
+    char *mem = cache->mem + pagesize * f;
+    if (frame->page != UINT_MAX)
+    {
+        if (frame->dirty)
+        {
+            pcache_io(cache->swapfd, mem, pagesize, (unsigned long long)pagesize * frame->page, 1);
+            cache->swapped[frame->page] = 1;
+            cache->writebacks++;
+        }
+        cache->where[frame->page] = 0;
+    }
+    // Last page is cut short by the end of the records.
+    size_t len = page == cache->npages - 1 ? sizeof(imgrec_t) * (cache->n - page * PCACHE_PAGE_RECS) : pagesize;
+    if (cache->swapped[page])
+    {
+        pcache_io(cache->swapfd, mem, len, (unsigned long long)pagesize * page, 0);
+    }
+    else
+    {
+        pcache_io(cache->fd, mem, len, cache->off + (unsigned long long)pagesize * page, 0);
+    }
+    frame->page = page;
+    frame->ref = 1;
+    frame->dirty = dirty;
+    cache->where[page] = f + 1;
+    return (imgrec_t *)mem;
+}
+
+void pcache_peek(pcache_t *cache, unsigned int page, imgrec_t *buf)
+{
+    // Copy of a page for a reader passing through once, pages not cached
+    // are read without taking a frame so the working set stays.
+    size_t pagesize = sizeof(imgrec_t) * PCACHE_PAGE_RECS;
+    size_t len = page == cache->npages - 1 ? sizeof(imgrec_t) * (cache->n - page * PCACHE_PAGE_RECS) : pagesize;
+    pthread_mutex_lock(&cache->lock);
+    unsigned int f = cache->where[page];
+    if (f != 0)
+    {
+        memcpy(buf, cache->mem + pagesize * (f - 1), len);
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    int swapped = cache->swapped[page];
+    pthread_mutex_unlock(&cache->lock);
+    if (swapped)
+    {
+        pcache_io(cache->swapfd, (char *)buf, len, (unsigned long long)pagesize * page, 0);
+    }
+    else
+    {
+        pcache_io(cache->fd, (char *)buf, len, cache->off + (unsigned long long)pagesize * page, 0);
+    }
+}
+
+void pcache_io(int fd, char *buf, size_t len, unsigned long long off, int out)
+{
+    while (len > 0)
+    {
+        ssize_t res = out ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+        if (res < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (res <= 0)
+        {
+            error_die(out ? "Page write failed" : "Data file truncated");
+        }
+        buf += res;
+        len -= res;
+        off += res;
+    }
+}
+
+// File IO.
+int save_data(const blist_t *blist, const snap_t *snap, const char *path, int format)
+{
+    // Write to temporary file and rename it over path, so data file stays
+    // intact on failure and a mapped image keeps its pages.
+    char tmppath[PATH_MAX];
+    if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= (int)sizeof(tmppath))
+    {
+        return 1;
+    }
+    errno = 0;
+    FILE *datfile = fopen(tmppath, "w");
+    if (datfile == NULL)
+    {
+        perror("Error writing to file");
+        return 1;
+    }
+    char *buf = (char *)malloc(IO_BUF_SIZE);
+    if (buf == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    setvbuf(datfile, buf, _IOFBF, IO_BUF_SIZE);
+    int res = 0;
+    if (format == FORMAT_BINARY)
+    {
+        res = save_binary(blist, snap, datfile);
+    }
+    else if (format == FORMAT_PACKED)
+    {
+        res = save_packed(blist, snap, datfile);
+    }
+    else
+    {
+        res = save_text(blist, snap, datfile);
+    }
+    // Data must be on disk before the rename makes it the data file.
+    if (fflush(datfile) == EOF || fsync(fileno(datfile)) != 0)
+    {
+        res = 1;
+    }
+    if (fclose(datfile) == EOF)
+    {
+        res = 1;
+    }
+    free(buf);
+    if (res == 0 && (rename(tmppath, path) != 0 || sync_dir(path) != 0))
+    {
+        res = 1;
+    }
+    if (res)
+    {
+        perror("Error writing to file");
+        remove(tmppath);
+    }
+    return res;
+}
+
+int sync_dir(const char *path)
+{
+    // Make renames in the directory of path durable.
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL)
+    {
+        strcpy(dir, ".");
+    }
+    else
+    {
+        snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        return 1;
+    }
+    int res = fsync(fd) != 0;
+    close(fd);
+    return res;
+}
+
+int save_start(blist_t *blist, int format, int background)
+{
+    // Caller holds savelock. Writers go on while the snapshot is saved,
+    // a background save returns once it is taken.
+    save_join(blist);
+    if (format < 0)
+    {
+        format = blist->format;
+    }
+    if (blist->jnl != NULL)
+    {
+        // Everything logged before rotation is in the snapshot.
+        journal_wait(blist);
+        journal_rotate(blist->jnl);
+    }
+    savetask_t *task = (savetask_t *)calloc(1, sizeof(savetask_t));
+    if (task == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    task->blist = blist;
+    task->format = format;
+    // Modifications from now on count towards the next autosave.
+    __atomic_store_n(&blist->savedmods, __atomic_load_n(&blist->nmods, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&blist->savedat, clock_ns(), __ATOMIC_RELAXED);
+    task->snap = snap_take(blist);
+    if (background && pthread_create(&task->thread, NULL, save_run, task) == 0)
+    {
+        blist->bgsave = task;
+        return 0;
+    }
+    save_run(task);
+    return save_finish(blist, task);
+}
+
+void *save_run(void *arg)
+{
+    savetask_t *task = (savetask_t *)arg;
+    blist_t *blist = task->blist;
+    task->res = save_data(blist, task->snap, blist->path, task->format);
+    snap_release(blist, task->snap);
+    if (blist->jnl != NULL)
+    {
+        journal_reset(blist->jnl, task->res == 0);
+    }
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int save_join(blist_t *blist)
+{
+    // Caller holds savelock, or is the only user of the list.
+    savetask_t *task = blist->bgsave;
+    if (task == NULL)
+    {
+        return 0;
+    }
+    pthread_join(task->thread, NULL);
+    blist->bgsave = NULL;
+    if (task->res != 0)
+    {
+        fprintf(stderr, "Background save of %s failed\n", blist->name);
+    }
+    return save_finish(blist, task);
+}
+
+int save_finish(blist_t *blist, savetask_t *task)
+{
+    int res = task->res;
+    if (res == 0)
+    {
+        blist->format = task->format;
+    }
+    free(task);
+    return res;
+}
+
+int save_due(blist_t *blist)
+{
+    // Due after autosave modifications, or autosecs after the last save
+    // once modified.
+    unsigned int autosave = __atomic_load_n(&blist->autosave, __ATOMIC_RELAXED);
+    unsigned int autosecs = __atomic_load_n(&blist->autosecs, __ATOMIC_RELAXED);
+    unsigned long long pending = __atomic_load_n(&blist->nmods, __ATOMIC_RELAXED) - __atomic_load_n(&blist->savedmods, __ATOMIC_RELAXED);
+    if (pending == 0)
+    {
+        return 0;
+    }
+    if (autosave > 0 && pending >= autosave)
+    {
+        return 1;
+    }
+    return autosecs > 0 && clock_ns() - __atomic_load_n(&blist->savedat, __ATOMIC_RELAXED) >= autosecs * 1000000000ULL;
+}
+
+void save_auto(blist_t *blist)
+{
+    // Front ends call this after commands, it never waits for a save.
+    if (!save_due(blist) || pthread_mutex_trylock(&blist->savelock) != 0)
+    {
+        return;
+    }
+    if (save_due(blist) && (blist->bgsave == NULL || __atomic_load_n(&blist->bgsave->done, __ATOMIC_ACQUIRE)))
+    {
+        save_start(blist, -1, 1);
+    }
+    pthread_mutex_unlock(&blist->savelock);
+}
+
+void save_tick(catalogs_t *cats)
+{
+    // Time based autosave of idle catalogs, checked once a second.
+    unsigned long long now = clock_ns();
+    unsigned long long next = __atomic_load_n(&cats->savenext, __ATOMIC_RELAXED);
+    if (now < next || !__atomic_compare_exchange_n(&cats->savenext, &next, now + 1000000000ULL, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    pthread_mutex_lock(&cats->lock);
+    for (catalog_t *cat = cats->head; cat != NULL; cat = cat->next)
+    {
+        if (cat->blist != NULL)
+        {
+            save_auto(cat->blist);
+        }
+    }
+    pthread_mutex_unlock(&cats->lock);
+}
+
+void save_iter_init(blist_iter_t *iter, const blist_t *blist, const snap_t *snap)
+{
+    // Without a snapshot the list must not change while saved.
+    if (snap != NULL)
+    {
+        snap_iter_init(iter, snap);
+    }
+    else
+    {
+        blist_iter_init(iter, blist);
+    }
+}
+
+unsigned int save_count(const blist_t *blist, const snap_t *snap)
+{
+    if (snap == NULL)
+    {
+        return blist_count(blist);
+    }
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < snap->nparts; ++i)
+    {
+        n += snap->books[i];
+    }
+    return n;
+}
+
+int save_text(const blist_t *blist, const snap_t *snap, FILE *datfile)
+{
+    // Write format identifier.
+    if (fprintf(datfile, "bookman_dat %s\n", VERSION) < 0)
+    {
+        return 1;
+    }
+    // Write list properties.
+    if (fprintf(datfile, "%s %u\n", blist->name, save_count(blist, snap)) < 0)
+    {
+        return 1;
+    }
+    // Write list data.
+    blist_iter_t iter;
+    book_t current;
+    save_iter_init(&iter, blist, snap);
+    while (blist_iter_next(&iter, &current))
+    {
+        // Names with blanks are quoted, as in commands.
+        const char *quote = strpbrk(current.name, " \t") != NULL ? "\"" : "";
+        if (fprintf(datfile, "%u %s%s%s %u %u\n", current.sn, quote, current.name, quote, current.price, current.quantity) < 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int save_binary(const blist_t *blist, const snap_t *snap, FILE *datfile)
+{
+    imghdr_t hdr;
+    memset(&hdr, 0, sizeof(imghdr_t));
+    memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = IMAGE_VERSION;
+    hdr.n = save_count(blist, snap);
+    // Keep index at most half full.
+    hdr.idxsize = 16;
+    while (hdr.idxsize < 2 * (unsigned long long)hdr.n)
+    {
+        hdr.idxsize *= 2;
+    }
+    hdr.recoff = sizeof(imghdr_t);
+    hdr.idxoff = hdr.recoff + (unsigned long long)hdr.n * sizeof(imgrec_t);
+    hdr.nameoff = hdr.idxoff + (unsigned long long)hdr.idxsize * sizeof(imgslot_t);
+    imgslot_t *idx = (imgslot_t *)calloc(hdr.idxsize, sizeof(imgslot_t));
+    if (idx == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    if (fwrite(&hdr, sizeof(imghdr_t), 1, datfile) != 1)
+    {
+        free(idx);
+        return 1;
+    }
+
+    // Write records and build index.
+    blist_iter_t iter;
+    book_t current;
+    imgrec_t rec;
+    unsigned long long nameoff = strlen(blist->name) + 1;
+    unsigned int i = 0;
+    memset(&rec, 0, sizeof(imgrec_t));
+    save_iter_init(&iter, blist, snap);
+    while (blist_iter_next(&iter, &current))
+    {
+        rec.sn = current.sn;
+        rec.price = current.price;
+        rec.quantity = current.quantity;
+        rec.name = nameoff;
+        rec.namelen = strlen(current.name);
+        nameoff += rec.namelen + 1;
+        if (nameoff > UINT_MAX || fwrite(&rec, sizeof(imgrec_t), 1, datfile) != 1)
+        {
+            free(idx);
+            return 1;
+        }
+        unsigned int slot = sn_hash(current.sn) & (hdr.idxsize - 1);
+        while (idx[slot].rec != 0)
+        {
+            slot = (slot + 1) & (hdr.idxsize - 1);
+        }
+        idx[slot].sn = current.sn;
+        idx[slot].rec = ++i;
+    }
+    if (fwrite(idx, sizeof(imgslot_t), hdr.idxsize, datfile) != hdr.idxsize)
+    {
+        free(idx);
+        return 1;
+    }
+    free(idx);
+
+    // Write name blob in same order.
+    if (fwrite(blist->name, strlen(blist->name) + 1, 1, datfile) != 1)
+    {
+        return 1;
+    }
+    save_iter_init(&iter, blist, snap);
+    while (blist_iter_next(&iter, &current))
+    {
+        if (fwrite(current.name, strlen(current.name) + 1, 1, datfile) != 1)
+        {
+            return 1;
+        }
+    }
+
+    // Fill in name blob length.
+    hdr.namelen = nameoff;
+    if (fseek(datfile, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(imghdr_t), 1, datfile) != 1)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+int save_packed(const blist_t *blist, const snap_t *snap, FILE *datfile)
+{
+    // Gather books in SN order, names stay owned by list or snapshot.
+    unsigned int n = save_count(blist, snap);
+    loadrec_t *rec = (loadrec_t *)malloc(sizeof(loadrec_t) * (n ? n : 1));
+    if (rec == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    blist_iter_t iter;
+    book_t current;
+    unsigned int i = 0;
+    save_iter_init(&iter, blist, snap);
+    while (i < n && blist_iter_next(&iter, &current))
+    {
+        rec[i].sn = current.sn;
+        rec[i].price = current.price;
+        rec[i].quantity = current.quantity;
+        rec[i].name = current.name;
+        rec[i].namelen = strlen(current.name);
+        i++;
+    }
+    qsort(rec, i, sizeof(loadrec_t), pack_rec_cmp);
+
+    // Encode blocks in parallel.
+    packer_t packer;
+    packer.rec = rec;
+    packer.n = i;
+    packer.nblocks = (i + PACK_BLOCK_BOOKS - 1) / PACK_BLOCK_BOOKS;
+    packer.next = 0;
+    packer.block = (unsigned char **)malloc(sizeof(unsigned char *) * (packer.nblocks ? packer.nblocks : 1));
+    if (packer.block == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > LOAD_MAX_THREADS)
+    {
+        nthreads = LOAD_MAX_THREADS;
+    }
+    if (nthreads > (int)packer.nblocks)
+    {
+        nthreads = packer.nblocks;
+    }
+    pthread_t tid[LOAD_MAX_THREADS];
+    for (int t = 1; t < nthreads; ++t)
+    {
+        if (pthread_create(&tid[t], NULL, pack_worker, &packer) != 0)
+        {
+            error_die("Failed to create thread");
+        }
+    }
+    pack_worker(&packer);
+    for (int t = 1; t < nthreads; ++t)
+    {
+        pthread_join(tid[t], NULL);
+    }
+
+    // Write header and list name, then blocks in order.
+    packhdr_t hdr;
+    memset(&hdr, 0, sizeof(packhdr_t));
+    memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+    hdr.version = PACK_VERSION;
+    hdr.nblocks = packer.nblocks;
+    hdr.n = packer.n;
+    hdr.namelen = strlen(blist->name);
+    hdr.crc = crc32c(blist->name, hdr.namelen, crc32c(&hdr, offsetof(packhdr_t, crc), 0));
+    int res = fwrite(&hdr, sizeof(packhdr_t), 1, datfile) != 1 || fwrite(blist->name, hdr.namelen, 1, datfile) != 1;
+    for (i = 0; i < packer.nblocks; ++i)
+    {
+        packblk_t blk;
+        memcpy(&blk, packer.block[i], sizeof(packblk_t));
+        if (!res && fwrite(packer.block[i], sizeof(packblk_t) + blk.size, 1, datfile) != 1)
+        {
+            res = 1;
+        }
+        free(packer.block[i]);
+    }
+    free(packer.block);
+    free(rec);
+    return res;
+}
+
+int read_data(blist_t *blist, const char *path, int nthreads)
+{
+    // Open file and determine whether file is new.
+    errno = 0;
+    FILE *datfile = fopen(path, "r");
+    if (datfile == NULL)
+    {
+        if (errno == ENOENT)
+        {
+            blist->name = strdup("NewList");
+            return 1;
+        }
+        else
+        {
+            error_die(strerror(errno));
+        }
+    }
+    // Check file format.
+    char magic[sizeof(IMAGE_MAGIC) - 1];
+    int binary = fread(magic, sizeof(magic), 1, datfile) == 1;
+    if (binary && memcmp(magic, PACK_MAGIC, sizeof(magic)) == 0)
+    {
+        if (fclose(datfile) == EOF)
+        {
+            error_die("Failed to close file");
+        }
+        read_packed(blist, path, nthreads);
+        blist->format = FORMAT_PACKED;
+        return 0;
+    }
+    if (binary && memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0)
+    {
+        if (fclose(datfile) == EOF)
+        {
+            error_die("Failed to close file");
+        }
+        // Map binary file, records are read on demand.
+        blist->img = img_open(path, blist->pagecache);
+        blist->name = strdup(blist->img->names + blist->img->hdr->listname);
+        blist->n = blist->img->live;
+        blist->format = FORMAT_BINARY;
+        return 0;
+    }
+    if (fclose(datfile) == EOF)
+    {
+        error_die("Failed to close file");
+    }
+    read_text(blist, path, nthreads);
+    blist->format = FORMAT_TEXT;
+    return 0;
+}
+
+int read_text(blist_t *blist, const char *path, int nthreads)
+{
+    // Map whole file, it is parsed in place.
+    errno = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        error_die(strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        error_die(strerror(errno));
+    }
+    if (st.st_size == 0)
+    {
+        error_die("Data file corrupt");
+    }
+    char *base = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        error_die(strerror(errno));
+    }
+    close(fd);
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    const char *p = base;
+    const char *end = base + st.st_size;
+    const char *token;
+    size_t len;
+
+    // Check file format.
+    token = scan_token(p, end, &len);
+    if (len != strlen("bookman_dat") || memcmp(token, "bookman_dat", len) != 0)
+    {
+        error_die("Data file corrupt");
+    }
+    // Check version.
+    token = scan_token(token + len, end, &len);
+    if (len != strlen(VERSION) || memcmp(token, VERSION, len) != 0)
+    {
+        error_die("Data file version mismatch");
+    }
+    // Check finished. Read list properties.
+    token = scan_token(token + len, end, &len);
+    if (len == 0 || len > MAX_LISTNAME_LEN)
+    {
+        error_die("Data file corrupt");
+    }
+    blist->name = strndup(token, len);
+    p = token + len;
+    unsigned int n;
+    if (blist->name == NULL || scan_uint(&p, end, &n) < 0)
+    {
+        error_die("Data file corrupt");
+    }
+    p = memchr(p, '\n', end - p);
+    p = p == NULL ? end : p + 1;
+
+    // Split entries into chunks at line boundaries.
+    loader_t loader;
+    memset(&loader, 0, sizeof(loader_t));
+    loader.blist = blist;
+    if (nthreads <= 0)
+    {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads > (end - p) / LOAD_MIN_CHUNK)
+    {
+        nthreads = (end - p) / LOAD_MIN_CHUNK;
+    }
+    if (nthreads > LOAD_MAX_THREADS)
+    {
+        nthreads = LOAD_MAX_THREADS;
+    }
+    if (nthreads < 1)
+    {
+        nthreads = 1;
+    }
+    loader.nthreads = nthreads;
+    for (int i = 0; i < nthreads; ++i)
+    {
+        loadchunk_t *chunk = &loader.chunk[i];
+        chunk->start = p;
+        if (i == nthreads - 1)
+        {
+            chunk->end = end;
+        }
+        else
+        {
+            chunk->end = p + (end - p) / (nthreads - i);
+            chunk->end = memchr(chunk->end, '\n', end - chunk->end);
+            chunk->end = chunk->end == NULL ? end : chunk->end + 1;
+        }
+        p = chunk->end;
+        pool_init(&chunk->books, sizeof(book_t));
+    }
+
+    // Parse, report malformed lines with absolute line numbers.
+    load_run(&loader, load_phase_parse);
+    unsigned int line = 3;
+    unsigned int total = 0;
+    unsigned int nbad = 0;
+    for (int i = 0; i < nthreads; ++i)
+    {
+        loadchunk_t *chunk = &loader.chunk[i];
+        chunk->firstline = line;
+        chunk->row = total;
+        for (unsigned int j = 0; j < chunk->nbad && j < LOAD_MAX_ERRORS; ++j)
+        {
+            if (nbad + j < LOAD_MAX_ERRORS)
+            {
+                fprintf(stderr, "%s:%u: malformed entry\n", path, line + chunk->bad[j]);
+            }
+        }
+        nbad += chunk->nbad;
+        line += chunk->lines;
+        total += chunk->n;
+    }
+    if (nbad > 0)
+    {
+        fprintf(stderr, "%s: %u malformed entries\n", path, nbad);
+        error_die("Load data failed");
+    }
+    if (total != n)
+    {
+        fprintf(stderr, "%s: %u entries expected, %u found\n", path, n, total);
+        error_die("Data file corrupt");
+    }
+    load_finish(&loader, path, total);
+    munmap(base, st.st_size);
+    return 0;
+}
+
+void load_finish(loader_t *loader, const char *path, unsigned int total)
+{
+    blist_t *blist = loader->blist;
+    int nthreads = loader->nthreads;
+    // Build book store, then SN index partitioned by home slot.
+    if (blist->engine == ENGINE_COLUMN)
+    {
+        bstore_reserve(blist->store, total);
+    }
+    snmap_reserve(blist->snmap, total);
+    snmap_table_t *table = &blist->snmap->cur;
+    unsigned int bits = 0;
+    while ((1U << bits) < table->size)
+    {
+        bits++;
+    }
+    loader->npart = 1;
+    while (loader->npart * 2 <= (unsigned int)nthreads)
+    {
+        loader->npart *= 2;
+    }
+    loader->partshift = bits;
+    for (unsigned int i = loader->npart; i > 1; i /= 2)
+    {
+        loader->partshift--;
+    }
+    load_run(loader, load_phase_store);
+    loader->keys = (loadkey_t *)malloc(sizeof(loadkey_t) * (total ? total : 1));
+    if (loader->keys == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    for (unsigned int i = 0; i < loader->npart; ++i)
+    {
+        loader->partstart[i + 1] = loader->partstart[i];
+        for (int j = 0; j < nthreads; ++j)
+        {
+            loader->partstart[i + 1] += loader->chunk[j].count[i];
+        }
+    }
+    load_run(loader, load_phase_scatter);
+    load_run(loader, load_phase_index);
+
+    // Report duplicates, then place entries that overflowed partitions.
+    unsigned int ndup = 0;
+    for (unsigned int i = 0; i < loader->npart; ++i)
+    {
+        loadchunk_t *chunk = &loader->chunk[i];
+        for (unsigned int j = 0; j < chunk->ndup && j < LOAD_MAX_ERRORS; ++j)
+        {
+            if (ndup + j < LOAD_MAX_ERRORS)
+            {
+                fprintf(stderr, "%s:%u: duplicate entry %u, first on line %u\n", path,
+                        chunk->dup[j][1]->line, chunk->dup[j][1]->sn, chunk->dup[j][0]->line);
+            }
+        }
+        ndup += chunk->ndup;
+    }
+    if (ndup > 0)
+    {
+        fprintf(stderr, "%s: %u duplicate entries\n", path, ndup);
+        error_die("Load data failed");
+    }
+    for (unsigned int i = 0; i < loader->npart; ++i)
+    {
+        loadchunk_t *chunk = &loader->chunk[i];
+        for (unsigned int j = 0; j < chunk->ndeferred; ++j)
+        {
+            snmap_node_t node;
+            node.sn = chunk->deferred[j].rec->sn;
+            node.row = chunk->deferred[j].rec->row;
+            node.book = chunk->deferred[j].rec->book;
+            snmap_place(blist->snmap, node);
+        }
+        free(chunk->deferred);
+    }
+
+    // Merge thread local pools and sub lists into list.
+    book_t *tail = NULL;
+    for (int i = 0; i < nthreads; ++i)
+    {
+        loadchunk_t *chunk = &loader->chunk[i];
+        if (blist->engine == ENGINE_LIST)
+        {
+            pool_merge(&blist->books, &chunk->books);
+        }
+        if (chunk->head != NULL)
+        {
+            if (tail == NULL)
+            {
+                blist->head = chunk->head;
+            }
+            else
+            {
+                tail->next = chunk->head;
+                chunk->head->prev = tail;
+            }
+            tail = chunk->tail;
+        }
+        free(chunk->rec);
+        free(chunk->text);
+    }
+    if (blist->engine == ENGINE_COLUMN)
+    {
+        blist->store->n = total;
+    }
+    blist->n = total;
+    free(loader->keys);
+}
+
+
+int read_packed(blist_t *blist, const char *path, int nthreads)
+{
+    // Map whole file, blocks are checked and decoded in place.
+    errno = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        error_die(strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        error_die(strerror(errno));
+    }
+    if ((size_t)st.st_size < sizeof(packhdr_t))
+    {
+        error_die("Data file corrupt");
+    }
+    char *base = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        error_die(strerror(errno));
+    }
+    close(fd);
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    const char *end = base + st.st_size;
+
+    // Check header.
+    packhdr_t hdr;
+    memcpy(&hdr, base, sizeof(packhdr_t));
+    if (hdr.version != PACK_VERSION)
+    {
+        error_die("Data file version mismatch");
+    }
+    if (hdr.namelen == 0 || hdr.namelen > MAX_LISTNAME_LEN || sizeof(packhdr_t) + hdr.namelen > (size_t)st.st_size ||
+        crc32c(base + sizeof(packhdr_t), hdr.namelen, crc32c(&hdr, offsetof(packhdr_t, crc), 0)) != hdr.crc)
+    {
+        fprintf(stderr, "%s: header checksum mismatch\n", path);
+        error_die("Data file corrupt");
+    }
+    blist->name = strndup(base + sizeof(packhdr_t), hdr.namelen);
+    if (blist->name == NULL)
+    {
+        error_die("Malloc failed");
+    }
+
+    // Walk block headers. A bad one hides all blocks after it.
+    const char *p = base + sizeof(packhdr_t) + hdr.namelen;
+    if (hdr.nblocks > (end - p) / sizeof(packblk_t))
+    {
+        fprintf(stderr, "%s: %u blocks expected, file too short\n", path, hdr.nblocks);
+        error_die("Data file corrupt");
+    }
+    const char **blockstart = (const char **)malloc(sizeof(char *) * (hdr.nblocks + 1));
+    if (blockstart == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    const char *walkerr = NULL;
+    unsigned int nblocks = 0;
+    unsigned int last = 0;
+    while (nblocks < hdr.nblocks)
+    {
+        packblk_t blk;
+        if ((size_t)(end - p) < sizeof(packblk_t))
+        {
+            walkerr = "truncated";
+            break;
+        }
+        memcpy(&blk, p, sizeof(packblk_t));
+        if (blk.n == 0 || blk.n > PACK_BLOCK_BOOKS || blk.first > blk.last || (nblocks > 0 && blk.first <= last) ||
+            blk.namebytes > blk.n * MAX_BOOKNAME_LEN)
+        {
+            walkerr = "bad block header";
+            break;
+        }
+        if (blk.size > (size_t)(end - p) - sizeof(packblk_t))
+        {
+            walkerr = "truncated";
+            break;
+        }
+        blockstart[nblocks++] = p;
+        last = blk.last;
+        p += sizeof(packblk_t) + blk.size;
+    }
+    blockstart[nblocks] = p;
+    if (walkerr == NULL && p != end)
+    {
+        walkerr = "trailing data";
+    }
+
+    // Verify and decode contiguous runs of blocks in parallel.
+    loader_t loader;
+    memset(&loader, 0, sizeof(loader_t));
+    loader.blist = blist;
+    if (nthreads <= 0)
+    {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads > LOAD_MAX_THREADS)
+    {
+        nthreads = LOAD_MAX_THREADS;
+    }
+    if (nthreads > (int)nblocks)
+    {
+        nthreads = nblocks;
+    }
+    if (nthreads < 1)
+    {
+        nthreads = 1;
+    }
+    loader.nthreads = nthreads;
+    for (int i = 0; i < nthreads; ++i)
+    {
+        loadchunk_t *chunk = &loader.chunk[i];
+        chunk->block = (unsigned long long)nblocks * i / nthreads;
+        chunk->start = blockstart[chunk->block];
+        chunk->end = blockstart[(unsigned long long)nblocks * (i + 1) / nthreads];
+        pool_init(&chunk->books, sizeof(book_t));
+    }
+    load_run(&loader, load_phase_unpack);
+
+    // Report each corrupt block with the SNs it held.
+    unsigned int total = 0;
+    unsigned int nbad = 0;
+    for (int i = 0; i < nthreads; ++i)
+    {
+        loadchunk_t *chunk = &loader.chunk[i];
+        chunk->firstline = total + 1;
+        chunk->row = total;
+        for (unsigned int j = 0; j < chunk->nbad && j < LOAD_MAX_ERRORS; ++j)
+        {
+            if (nbad + j < LOAD_MAX_ERRORS)
+            {
+                packblk_t blk;
+                const char *start = blockstart[chunk->bad[j]];
+                memcpy(&blk, start, sizeof(packblk_t));
+                int crcok = crc32c(&blk, offsetof(packblk_t, crc), crc32c(start + sizeof(packblk_t), blk.size, 0)) == blk.crc;
+                fprintf(stderr, "%s: block %u (SN %u to %u) at offset %lld: %s\n", path, chunk->bad[j], blk.first, blk.last,
+                        (long long)(start - base), crcok ? "malformed" : "checksum mismatch");
+            }
+        }
+        nbad += chunk->nbad;
+        total += chunk->n;
+    }
+    if (walkerr != NULL)
+    {
+        fprintf(stderr, "%s: block %u at offset %lld: %s\n", path, nblocks, (long long)(p - base), walkerr);
+        nbad++;
+    }
+    if (nbad > 0)
+    {
+        fprintf(stderr, "%s: %u corrupt blocks\n", path, nbad);
+        error_die("Load data failed");
+    }
+    if (total != hdr.n)
+    {
+        fprintf(stderr, "%s: %u entries expected, %u found\n", path, hdr.n, total);
+        error_die("Data file corrupt");
+    }
+    load_finish(&loader, path, total);
+    free(blockstart);
+    munmap(base, st.st_size);
+    return 0;
+}
+
+// Packed block functions.
+
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+unsigned int crc32c_table[256];
+int crc32c_hw = 0;
+
+unsigned int crc32c(const void *data, size_t len, unsigned int crc)
+{
+    // Castagnoli polynomial, SSE4.2 computes it 8 bytes at a time.
+    pthread_once(&crc32c_once, crc32c_init);
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_hw)
+    {
+        return ~crc32c_sse42(p, len, crc);
+    }
+#endif
+    while (len-- > 0)
+    {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void crc32c_init()
+{
+    for (unsigned int i = 0; i < 256; ++i)
+    {
+        unsigned int crc = i;
+        for (int j = 0; j < 8; ++j)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78U : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) unsigned int crc32c_sse42(const unsigned char *p, size_t len, unsigned int crc)
+{
+    unsigned long long crc64 = crc;
+    while (len >= 8)
+    {
+        unsigned long long word;
+        memcpy(&word, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while (len-- > 0)
+    {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+unsigned char *pack_varint(unsigned char *p, unsigned int val)
+{
+    // 7 bits per byte, high bit set on all but the last.
+    while (val >= 0x80)
+    {
+        *p++ = val | 0x80;
+        val >>= 7;
+    }
+    *p++ = val;
+    return p;
+}
+
+const unsigned char *unpack_varint(const unsigned char *p, const unsigned char *end, unsigned int *val)
+{
+    unsigned long long result = 0;
+    for (unsigned int shift = 0; p < end && shift < 35; shift += 7)
+    {
+        result |= (unsigned long long)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+        {
+            if (result > UINT_MAX)
+            {
+                return NULL;
+            }
+            *val = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+unsigned char *pack_bits(unsigned char *p, const unsigned int *val, unsigned int n)
+{
+    // Offsets from smallest value in just enough bits for the largest.
+    unsigned int base = UINT_MAX;
+    unsigned int top = 0;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        base = val[i] < base ? val[i] : base;
+        top = val[i] > top ? val[i] : top;
+    }
+    unsigned int width = top > base ? 32 - __builtin_clz(top - base) : 0;
+    p = pack_varint(p, base);
+    *p++ = width;
+    unsigned long long acc = 0;
+    unsigned int nbits = 0;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        acc |= (unsigned long long)(val[i] - base) << nbits;
+        nbits += width;
+        while (nbits >= 8)
+        {
+            *p++ = acc;
+            acc >>= 8;
+            nbits -= 8;
+        }
+    }
+    if (nbits > 0)
+    {
+        *p++ = acc;
+    }
+    return p;
+}
+
+const unsigned char *unpack_bits(const unsigned char *p, const unsigned char *end, unsigned int *val, unsigned int n)
+{
+    unsigned int base;
+    p = unpack_varint(p, end, &base);
+    if (p == NULL || p == end || *p > 32)
+    {
+        return NULL;
+    }
+    unsigned int width = *p++;
+    size_t len = ((size_t)n * width + 7) / 8;
+    if ((size_t)(end - p) < len)
+    {
+        return NULL;
+    }
+    unsigned long long mask = (1ULL << width) - 1;
+    unsigned long long acc = 0;
+    unsigned int nbits = 0;
+    const unsigned char *q = p;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        while (nbits < width)
+        {
+            acc |= (unsigned long long)*q++ << nbits;
+            nbits += 8;
+        }
+        unsigned long long v = base + (acc & mask);
+        if (v > UINT_MAX)
+        {
+            return NULL;
+        }
+        val[i] = v;
+        acc >>= width;
+        nbits -= width;
+    }
+    return p + len;
+}
+
+unsigned char *pack_block(const loadrec_t *rec, unsigned int n)
 {
-    book_t *new = (book_t *)malloc(sizeof(book_t));
-    if (new == NULL)
+    packblk_t blk;
+    blk.n = n;
+    blk.namebytes = 0;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        blk.namebytes += rec[i].namelen;
+    }
+    // Worst case of every field, short matches may cost more than they save.
+    unsigned char *out = (unsigned char *)malloc(sizeof(packblk_t) + 24 + (size_t)n * 23 + (size_t)blk.namebytes * 3 / 2);
+    unsigned int *val = (unsigned int *)calloc(n, sizeof(unsigned int));
+    if (out == NULL || val == NULL)
     {
         error_die("Malloc failed");
     }
-    memset(new, 0, sizeof(book_t));
-    return new;
-}
-
-blist_t *blist_create()
-{
-    blist_t *new = (blist_t *)malloc(sizeof(blist_t));
-    if (new == NULL)
+    unsigned char *p = out + sizeof(packblk_t);
+    unsigned int prev = 0;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        p = pack_varint(p, rec[i].sn - prev);
+        prev = rec[i].sn;
+    }
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        val[i] = rec[i].price;
+    }
+    p = pack_bits(p, val, n);
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        val[i] = rec[i].quantity;
+    }
+    p = pack_bits(p, val, n);
+    // Names of neighbouring SNs tend to share long prefixes, the rest
+    // repeats words across the block.
+    unsigned char *suffixes = (unsigned char *)malloc(blk.namebytes + 1);
+    if (suffixes == NULL)
     {
         error_die("Malloc failed");
     }
-    memset(new, 0, sizeof(blist_t));
-    new->snmap = snmap_create();
-    return new;
-}
-
-void book_destroy(book_t *book)
-{
-    free(book->name);
-    free(book);
-}
-
-void blist_destroy(blist_t *blist)
-{
-    book_t *current = blist->head;
-    book_t *temp = NULL;
-    while (current != NULL)
+    size_t nsuffix = 0;
+    const char *last = "";
+    unsigned int lastlen = 0;
+    for (unsigned int i = 0; i < n; ++i)
     {
-        temp = current;
-        current = current->next;
-        book_destroy(temp);
+        unsigned int prefix = 0;
+        while (prefix < lastlen && prefix < rec[i].namelen && last[prefix] == rec[i].name[prefix])
+        {
+            prefix++;
+        }
+        p = pack_varint(p, prefix);
+        p = pack_varint(p, rec[i].namelen - prefix);
+        memcpy(suffixes + nsuffix, rec[i].name + prefix, rec[i].namelen - prefix);
+        nsuffix += rec[i].namelen - prefix;
+        last = rec[i].name;
+        lastlen = rec[i].namelen;
     }
-    snmap_destroy(blist->snmap);
-    free(blist);
+    p = lz_pack(p, suffixes, nsuffix);
+    free(suffixes);
+    free(val);
+    blk.size = p - out - sizeof(packblk_t);
+    blk.first = rec[0].sn;
+    blk.last = rec[n - 1].sn;
+    blk.crc = crc32c(&blk, offsetof(packblk_t, crc), crc32c(out + sizeof(packblk_t), blk.size, 0));
+    memcpy(out, &blk, sizeof(packblk_t));
+    return out;
 }
 
-int blist_op(blist_t *blist, book_t *data, int opflag)
+int unpack_block(const packblk_t *blk, const unsigned char *payload, loadrec_t *rec, char *text)
 {
-    if (opflag == 0)
+    const unsigned char *p = payload;
+    const unsigned char *end = payload + blk->size;
+    unsigned int n = blk->n;
+    unsigned int *val = (unsigned int *)malloc(sizeof(unsigned int) * n);
+    if (val == NULL)
     {
-        return INVALID_ARG;
+        error_die("Malloc failed");
     }
-    else if (opflag & DEL_BOOK) // Delete entry.
+    // SNs strictly ascending.
+    unsigned long long sn = 0;
+    for (unsigned int i = 0; i < n && p != NULL; ++i)
     {
-        if (opflag ^ DEL_BOOK) // Other flags present.
+        unsigned int delta;
+        p = unpack_varint(p, end, &delta);
+        sn += delta;
+        if (p == NULL || (i > 0 && delta == 0) || sn > UINT_MAX)
         {
-            return INVALID_ARG;
-        }
-        if (snmap_query(blist->snmap, data->sn) == 0)
-        {
-            return BOOK_NONEXIST;
+            p = NULL;
+            break;
         }
-        else
+        rec[i].sn = sn;
+    }
+    if (p == NULL || rec[0].sn != blk->first || rec[n - 1].sn != blk->last || (p = unpack_bits(p, end, val, n)) == NULL)
+    {
+        free(val);
+        return -1;
+    }
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        rec[i].price = val[i];
+    }
+    if ((p = unpack_bits(p, end, val, n)) == NULL)
+    {
+        free(val);
+        return -1;
+    }
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        rec[i].quantity = val[i];
+    }
+    // Each name is a prefix of the previous one and a suffix. Names are
+    // laid out first, suffixes are then decompressed into place.
+    unsigned int *suffix = val;
+    char *out = text;
+    unsigned int lastlen = 0;
+    size_t nsuffix = 0;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        unsigned int prefix;
+        if ((p = unpack_varint(p, end, &prefix)) == NULL || (p = unpack_varint(p, end, &suffix[i])) == NULL || prefix > lastlen ||
+            prefix + suffix[i] == 0 || prefix + suffix[i] > MAX_BOOKNAME_LEN || (size_t)(out - text) + prefix + suffix[i] > blk->namebytes)
         {
-            // Find and delete book entry.
-            book_t *current = blist->head;
-            book_t *last = NULL;
-            if (current->sn == data->sn)
-            {
-                blist->head = current->next;
-                book_destroy(current);
-                // Remove hashmap entry.
-                snmap_remove(blist->snmap, data->sn);
-                blist->n--;
-                return SUCCESS;
-            }
-            else
-            {
-                while (current != NULL)
-                {
-                    if (current->sn == data->sn)
-                    {
-                        // Delete entry.
-                        last->next = current->next;
-                        book_destroy(current);
-                        // Remove hashmap entry.
-                        snmap_remove(blist->snmap, data->sn);
-                        blist->n--;
-                        return SUCCESS;
-                    }
-                    last = current;
-                    current = current->next;
-                }
-            }
-
-            return MAP_INCONSIST;
+            free(val);
+            return -1;
         }
+        rec[i].name = out;
+        rec[i].namelen = prefix + suffix[i];
+        lastlen = rec[i].namelen;
+        out += lastlen;
+        nsuffix += suffix[i];
     }
-    else if (opflag & NEW_BOOK)
+    unsigned char *suffixes = (unsigned char *)malloc(nsuffix + 1);
+    if (suffixes == NULL)
     {
-        if (opflag ^ NEW_BOOK) // Other flags present.
+        error_die("Malloc failed");
+    }
+    int res = (size_t)(out - text) == blk->namebytes && lz_unpack(p, end, suffixes, nsuffix) == end ? 0 : -1;
+    const unsigned char *q = suffixes;
+    for (unsigned int i = 0; res == 0 && i < n; ++i)
+    {
+        unsigned int prefix = rec[i].namelen - suffix[i];
+        memcpy((char *)rec[i].name, i > 0 ? rec[i - 1].name : "", prefix);
+        memcpy((char *)rec[i].name + prefix, q, suffix[i]);
+        q += suffix[i];
+    }
+    free(suffixes);
+    free(val);
+    return res;
+}
+
+unsigned char *lz_pack(unsigned char *p, const unsigned char *src, size_t len)
+{
+    // Runs of literals, each but the last followed by a match of at least
+    // 4 bytes found by hashing 4 byte sequences.
+    unsigned int head[1 << LZ_HASH_BITS];
+    memset(head, 0xff, sizeof(head));
+    size_t lit = 0;
+    size_t i = 0;
+    while (i + 4 <= len)
+    {
+        unsigned int word;
+        memcpy(&word, src + i, 4);
+        unsigned int h = (word * 2654435761U) >> (32 - LZ_HASH_BITS);
+        size_t cand = head[h];
+        head[h] = i;
+        if (cand == 0xffffffffU || memcmp(src + cand, src + i, 4) != 0)
         {
-            return INVALID_ARG;
+            i++;
+            continue;
         }
-        if (snmap_query(blist->snmap, data->sn))
+        size_t match = 4;
+        while (i + match < len && src[cand + match] == src[i + match])
         {
-            return BOOK_EXIST;
+            match++;
         }
-        // Append to hashmap.
-        snmap_append(blist->snmap, data->sn);
-        // Construct new entry.
-        book_t *newbook = book_create();
-        memcpy(newbook, data, sizeof(book_t));
-        // Copy name.
-        newbook->name = (char *)malloc(strlen(data->name) + 1);
-        strcpy(newbook->name, data->name);
-        // Add to list.
-        newbook->next = blist->head;
-        blist->head = newbook;
-        blist->n++;
-        return SUCCESS;
+        p = pack_varint(p, i - lit);
+        memcpy(p, src + lit, i - lit);
+        p += i - lit;
+        p = pack_varint(p, match - 4);
+        p = pack_varint(p, i - cand);
+        i += match;
+        lit = i;
     }
-    else if (opflag & QRY_BOOK) // Query book data.
+    p = pack_varint(p, len - lit);
+    memcpy(p, src + lit, len - lit);
+    return p + len - lit;
+}
+
+const unsigned char *lz_unpack(const unsigned char *p, const unsigned char *end, unsigned char *dst, size_t len)
+{
+    size_t out = 0;
+    while (1)
     {
-        if (opflag ^ QRY_BOOK)
-        {
-            return INVALID_ARG;
-        }
-        // Query book.
-        if (snmap_query(blist->snmap, data->sn) == 0)
+        unsigned int lit;
+        if ((p = unpack_varint(p, end, &lit)) == NULL || lit > len - out || lit > (size_t)(end - p))
         {
-            return BOOK_NONEXIST;
+            return NULL;
         }
-        // Find book.
-        book_t *current = blist->head;
-        while (current != NULL)
+        memcpy(dst + out, p, lit);
+        p += lit;
+        out += lit;
+        if (out == len)
         {
-            if (current->sn == data->sn) // Found.
-            {
-                data->price = current->price;
-                data->quantity = current->quantity;
-                strcpy(data->name, current->name);
-                return SUCCESS;
-            }
-            current = current->next;
+            return p;
         }
-        return MAP_INCONSIST;
-    }
-    else // Update book data.
-    {
-        // Query book.
-        if (snmap_query(blist->snmap, data->sn) == 0)
+        // Matches may overlap their own output.
+        unsigned int match;
+        unsigned int dist;
+        if ((p = unpack_varint(p, end, &match)) == NULL || (p = unpack_varint(p, end, &dist)) == NULL || (size_t)match + 4 > len - out ||
+            dist == 0 || dist > out)
         {
-            return BOOK_NONEXIST;
+            return NULL;
         }
-        // Find book location.
-        book_t *current = blist->head;
-        while (current != NULL)
+        for (size_t k = 0; k < (size_t)match + 4; ++k, ++out)
         {
-            if (current->sn == data->sn) // Found.
-            {
-                if (opflag & UPD_NAME)
-                {
-                    free(current->name);
-                    current->name = (char *)malloc(strlen(data->name));
-                    strcpy(current->name, data->name);
-                }
-                if (opflag & UPD_PRICE)
-                {
-                    current->price = data->price;
-                }
-                if (opflag & UPD_QUANT)
-                {
-                    current->quantity = data->quantity;
-                }
-                return SUCCESS;
-            }
-            current = current->next;
+            dst[out] = dst[out - dist];
         }
-        return MAP_INCONSIST;
     }
 }
 
-// SNMap functions.
-
-unsigned int sn_hash(unsigned int sn)
+void *pack_worker(void *arg)
 {
-    return sn % SNMAP_SIZE;
+    packer_t *packer = (packer_t *)arg;
+    unsigned int i;
+    while ((i = __atomic_fetch_add(&packer->next, 1, __ATOMIC_RELAXED)) < packer->nblocks)
+    {
+        unsigned int first = i * PACK_BLOCK_BOOKS;
+        unsigned int n = packer->n - first < PACK_BLOCK_BOOKS ? packer->n - first : PACK_BLOCK_BOOKS;
+        packer->block[i] = pack_block(packer->rec + first, n);
+    }
+    return NULL;
 }
 
-snmap_t *snmap_create()
+int pack_rec_cmp(const void *a, const void *b)
 {
-    snmap_t *new = (snmap_t *)malloc(sizeof(snmap_t));
-    if (new == NULL)
-    {
-        error_die("Malloc failed");
-    }
-    memset(new, 0, sizeof(snmap_t));
-    return new;
+    unsigned int x = ((const loadrec_t *)a)->sn;
+    unsigned int y = ((const loadrec_t *)b)->sn;
+    return x < y ? -1 : x > y;
 }
 
-snmap_node_t *snmap_node_create()
+// Bulk loader functions.
+
+const char *scan_token(const char *p, const char *end, size_t *len)
 {
-    snmap_node_t *new = (snmap_node_t *)malloc(sizeof(snmap_node_t));
-    if (new == NULL)
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
     {
-        error_die("Malloc failed");
+        p++;
     }
-    memset(new, 0, sizeof(snmap_node_t));
-    return new;
+    const char *token = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+    {
+        p++;
+    }
+    *len = p - token;
+    return token;
 }
 
-void snmap_destroy(snmap_t *snmap)
+int scan_uint(const char **p, const char *end, unsigned int *val)
 {
-    snmap_node_t *current = snmap->map[0];
-    snmap_node_t *temp = NULL;
-    for (int i = 0; i < SNMAP_SIZE; ++i)
+    const char *current = *p;
+    while (current < end && (*current == ' ' || *current == '\t'))
+    {
+        current++;
+    }
+    if (current == end || *current < '0' || *current > '9')
     {
-        while (current != NULL)
+        return -1;
+    }
+    unsigned int result = 0;
+    while (current < end && *current >= '0' && *current <= '9')
+    {
+        unsigned int digit = *current - '0';
+        if (result > (UINT_MAX - digit) / 10) // Overflow.
         {
-            temp = current;
-            current = current->next;
-            free(temp);
+            return -1;
         }
+        result = result * 10 + digit;
+        current++;
     }
-    free(snmap);
+    *val = result;
+    *p = current;
+    return 0;
 }
 
-void snmap_append(snmap_t *snmap, unsigned int sn)
+int load_parse_line(const char *p, const char *end, loadrec_t *rec)
 {
-    unsigned int key = sn_hash(sn);
-    snmap_node_t *new = snmap_node_create();
-    new->sn = sn;
-    snmap_node_t *current = snmap->map[key];
-    if (current != NULL)
+    if (scan_uint(&p, end, &rec->sn) < 0)
+    {
+        return -1;
+    }
+    // Name token.
+    if (p == end || (*p != ' ' && *p != '\t'))
+    {
+        return -1;
+    }
+    while (p < end && (*p == ' ' || *p == '\t'))
     {
-        if (current->sn == sn)
+        p++;
+    }
+    rec->name = p;
+    if (p < end && *p == '"')
+    {
+        // Quoted name holds blanks.
+        rec->name = ++p;
+        while (p < end && *p != '"')
         {
-            free(new);
-            return;
+            p++;
         }
-        while (current->next != NULL)
+        if (p == end)
         {
-            if (current->sn == sn)
-            {
-                free(new);
-                return;
-            }
-            current = current->next;
+            return -1;
+        }
+        rec->namelen = p++ - rec->name;
+        if (p < end && *p != ' ' && *p != '\t')
+        {
+            return -1;
         }
-        current->next = new;
     }
     else
     {
-        snmap->map[key] = new;
-    }
-}
-
-int snmap_query(snmap_t *snmap, unsigned int sn)
-{
-    unsigned int key = sn_hash(sn);
-    snmap_node_t *current = snmap->map[key];
-    while (current != NULL)
-    {
-        if (current->sn == sn)
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
         {
-            return 1;
+            p++;
         }
+        rec->namelen = p - rec->name;
     }
-    return 0;
-}
-
-void snmap_remove(snmap_t *snmap, unsigned int sn)
-{
-    unsigned int key = sn_hash(sn);
-    snmap_node_t *current = snmap->map[key];
-    snmap_node_t *last = NULL;
-    // No entries.
-    if (current == NULL)
+    if (rec->namelen == 0 || rec->namelen > MAX_BOOKNAME_LEN)
     {
-        return;
+        return -1;
     }
-
-    // First entry.
-    if (current->sn == sn)
+    if (scan_uint(&p, end, &rec->price) < 0 || scan_uint(&p, end, &rec->quantity) < 0)
     {
-        snmap->map[key] = current->next;
-        free(current);
-        return;
+        return -1;
+    }
+    // Only trailing whitespace allowed.
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+    {
+        p++;
     }
+    return p == end ? 0 : -1;
+}
 
-    // Remaining entries.
-    last = current;
-    current = current->next;
-    while (current != NULL)
+void load_run(loader_t *loader, void (*phase)(loader_t *, int))
+{
+    pthread_t tid[LOAD_MAX_THREADS];
+    loadtask_t task[LOAD_MAX_THREADS];
+    for (int i = 0; i < loader->nthreads; ++i)
     {
-        if (current->sn == sn) // Found, remove entry.
+        task[i].loader = loader;
+        task[i].id = i;
+        task[i].phase = phase;
+    }
+    for (int i = 1; i < loader->nthreads; ++i)
+    {
+        if (pthread_create(&tid[i], NULL, load_worker, &task[i]) != 0)
         {
-            last->next = current->next;
-            free(current);
+            error_die("Failed to create thread");
         }
-        last = current;
-        current = current->next;
     }
-    return;
+    phase(loader, 0);
+    for (int i = 1; i < loader->nthreads; ++i)
+    {
+        pthread_join(tid[i], NULL);
+    }
 }
 
-// File IO.
-int save_data(const blist_t *blist, const char *path)
+void *load_worker(void *arg)
 {
-    errno = 0;
-    FILE *datfile = fopen(path, "w");
-    do
+    loadtask_t *task = (loadtask_t *)arg;
+    task->phase(task->loader, task->id);
+    return NULL;
+}
+
+void load_phase_parse(loader_t *loader, int id)
+{
+    loadchunk_t *chunk = &loader->chunk[id];
+    const char *p = chunk->start;
+    const char *eol;
+    // Roughly 16 bytes per entry.
+    chunk->size = (chunk->end - chunk->start) / 16 + 16;
+    chunk->rec = (loadrec_t *)malloc(sizeof(loadrec_t) * chunk->size);
+    if (chunk->rec == NULL)
     {
-        errno = 0;
-        if (datfile == NULL)
-        {
-            perror(strerror(errno));
-            perror("\n");
-            break;
-        }
-        // Write format identifier.
-        errno = 0;
-        if (fprintf(datfile, "bookman %s\n", VERSION) < 0)
+        error_die("Malloc failed");
+    }
+    while (p < chunk->end)
+    {
+        eol = memchr(p, '\n', chunk->end - p);
+        if (eol == NULL)
         {
-            perror(strerror(errno));
-            perror("\n");
-            break;
+            eol = chunk->end;
         }
-        // Write list properties.
-        errno = 0;
-        if (fprintf(datfile, "%s %d\n", blist->name, blist->n) < 0)
+        // Skip blank lines.
+        const char *q = p;
+        while (q < eol && (*q == ' ' || *q == '\t' || *q == '\r'))
         {
-            perror(strerror(errno));
-            perror("\n");
-            break;
+            q++;
         }
-        // Write list data.
-        char bookname[MAX_BOOKNAME_LEN + 1];
-        book_t buff;
-        buff.name = (char *)&bookname;
-        int opres = 0;
-        book_t *current = blist->head;
-        while (current != NULL)
+        if (q < eol)
         {
-            if (fprintf(datfile, "%d %s %d %d\n", current->sn, current->name, current->price, current->quantity) < 0)
+            if (chunk->n == chunk->size)
             {
-                perror(strerror(errno));
-                perror("\n");
-                perror("Error writing to file");
-                if (fclose(datfile) == EOF)
+                chunk->size *= 2;
+                chunk->rec = (loadrec_t *)realloc(chunk->rec, sizeof(loadrec_t) * chunk->size);
+                if (chunk->rec == NULL)
                 {
-                    error_die("Failed to close file");
+                    error_die("Malloc failed");
                 }
-                return 1;
+            }
+            loadrec_t *rec = &chunk->rec[chunk->n];
+            if (load_parse_line(p, eol, rec) < 0)
+            {
+                if (chunk->nbad < LOAD_MAX_ERRORS)
+                {
+                    chunk->bad[chunk->nbad] = chunk->lines;
+                }
+                chunk->nbad++;
+            }
+            else
+            {
+                rec->line = chunk->lines;
+                chunk->n++;
             }
         }
-        if (fclose(datfile) == EOF)
-        {
-            error_die("Failed to close file");
-        }
-        return 0;
-    } while (1);
-
-    perror("Error writing to file");
-    if (fclose(datfile) == EOF)
-    {
-        error_die("Failed to close file");
+        chunk->lines++;
+        p = eol + 1;
     }
-    return 1;
 }
 
-int read_data(blist_t *blist, const char *path)
+void load_phase_store(loader_t *loader, int id)
 {
-    // Open file and determine whether file is new.
-    errno = 0;
-    FILE *datfile = fopen(path, "r");
-    if (datfile == NULL)
+    loadchunk_t *chunk = &loader->chunk[id];
+    blist_t *blist = loader->blist;
+    bstore_t *store = blist->store;
+    unsigned int mask = blist->snmap->cur.size - 1;
+    for (unsigned int i = 0; i < chunk->n; ++i)
     {
-        if (errno == ENOENT)
+        loadrec_t *rec = &chunk->rec[i];
+        rec->line += chunk->firstline;
+        rec->book = NULL;
+        rec->row = chunk->row + i;
+        if (blist->engine == ENGINE_COLUMN)
+        {
+            store->sn[rec->row] = rec->sn;
+            store->price[rec->row] = rec->price;
+            store->quantity[rec->row] = rec->quantity;
+            store->name[rec->row] = intern_get(rec->name, rec->namelen);
+        }
+        else
         {
-            /*
-            errno = 0;
-            datfile = fopen(path, "a+");
-            if (datfile == NULL)
+            // Keep file order in sub list.
+            book_t *book = (book_t *)pool_alloc(&chunk->books);
+            book->sn = rec->sn;
+            book->name = intern_get(rec->name, rec->namelen);
+            book->price = rec->price;
+            book->quantity = rec->quantity;
+            book->prev = chunk->tail;
+            book->next = NULL;
+            if (chunk->tail == NULL)
             {
-                error_die(strerror(errno));
+                chunk->head = book;
             }
-            */
-            blist->name = "NewList";
-            /*
-            if (fclose(datfile) == EOF)
+            else
             {
-                error_die("Failed to close file");
+                chunk->tail->next = book;
             }
-            */
-            return 1;
+            chunk->tail = book;
+            rec->book = book;
         }
-        else
+        chunk->count[(sn_hash(rec->sn) & mask) >> loader->partshift]++;
+    }
+}
+
+void load_phase_scatter(loader_t *loader, int id)
+{
+    loadchunk_t *chunk = &loader->chunk[id];
+    unsigned int mask = loader->blist->snmap->cur.size - 1;
+    unsigned int offset[LOAD_MAX_THREADS];
+    // Chunks fill each partition in order.
+    for (unsigned int i = 0; i < loader->npart; ++i)
+    {
+        offset[i] = loader->partstart[i];
+        for (int j = 0; j < id; ++j)
         {
-            error_die(strerror(errno));
+            offset[i] += loader->chunk[j].count[i];
         }
     }
-    // Check file format.
-    if (fscanf(datfile, "bookman_dat") <= 0)
+    for (unsigned int i = 0; i < chunk->n; ++i)
     {
-        error_die("Data file corrupt");
+        unsigned int hash = sn_hash(chunk->rec[i].sn);
+        unsigned int home = hash & mask;
+        loadkey_t *key = &loader->keys[offset[home >> loader->partshift]++];
+        key->key = (unsigned long long)home << 32 | hash;
+        key->rec = &chunk->rec[i];
     }
-    // Check version.
-    if (fscanf(datfile, VERSION) <= 0)
+}
+
+int load_key_cmp(const void *a, const void *b)
+{
+    unsigned long long x = ((const loadkey_t *)a)->key;
+    unsigned long long y = ((const loadkey_t *)b)->key;
+    if (x != y)
     {
-        error_die("Data file version mismatch");
+        return x < y ? -1 : 1;
     }
-    // Check finished. Read data.
-    char *listname = (char *)malloc(MAX_LISTNAME_LEN + 1);
-    fscanf(datfile, "%s %d", listname, blist->n);
-    blist->name = listname;
-    // Read entries.
-    book_t buff;
-    int opres = 0;
-    char bookname[MAX_BOOKNAME_LEN + 1];
-    for (int i = 0; i < blist->n; ++i)
+    // Same SN, earlier line first.
+    unsigned int i = ((const loadkey_t *)a)->rec->line;
+    unsigned int j = ((const loadkey_t *)b)->rec->line;
+    return i < j ? -1 : i > j;
+}
+
+void load_phase_index(loader_t *loader, int id)
+{
+    if ((unsigned int)id >= loader->npart)
+    {
+        return;
+    }
+    loadchunk_t *chunk = &loader->chunk[id];
+    snmap_table_t *table = &loader->blist->snmap->cur;
+    loadkey_t *keys = loader->keys + loader->partstart[id];
+    unsigned int n = loader->partstart[id + 1] - loader->partstart[id];
+    unsigned int first = (unsigned int)id << loader->partshift;
+    unsigned int last = first + (1U << loader->partshift);
+    unsigned int pos = first;
+    unsigned int placed = 0;
+    qsort(keys, n, sizeof(loadkey_t), load_key_cmp);
+    // Entries come sorted by home slot, so each one simply takes first
+    // free slot from its home, which is the Robin Hood layout.
+    for (unsigned int i = 0; i < n; ++i)
     {
-        scanf("%d %s %d %d", &buff.sn, bookname, &buff.price, &buff.quantity);
-        blist->name = (char *)&bookname;
-        opres = blist_op(blist, &buff, NEW_BOOK);
-        if (opres < 0)
+        if (i > 0 && (unsigned int)keys[i].key == (unsigned int)keys[i - 1].key)
         {
-            if (opres == INVALID_ARG)
+            // Same hash means same SN.
+            if (chunk->ndup < LOAD_MAX_ERRORS)
             {
-                perror("Invalid error\n");
+                chunk->dup[chunk->ndup][0] = keys[i - 1].rec;
+                chunk->dup[chunk->ndup][1] = keys[i].rec;
             }
-            else if (opres == BOOK_EXIST)
-            {
-                perror("Duplicate entry");
-            }
-            else if (opres == MAP_INCONSIST)
+            chunk->ndup++;
+            continue;
+        }
+        unsigned int home = keys[i].key >> 32;
+        unsigned int slot = home > pos ? home : pos;
+        if (slot >= last || slot - home + 1 > 255)
+        {
+            // Leave for serial placement.
+            if (chunk->ndeferred == 0 || (chunk->ndeferred & (chunk->ndeferred - 1)) == 0)
             {
-                perror("Hashmap inconsistent");
+                chunk->deferred = (loadkey_t *)realloc(chunk->deferred, sizeof(loadkey_t) * (chunk->ndeferred ? chunk->ndeferred * 2 : 1));
+                if (chunk->deferred == NULL)
+                {
+                    error_die("Malloc failed");
+                }
             }
-            error_die("Load data failed");
+            chunk->deferred[chunk->ndeferred++] = keys[i];
+            continue;
         }
+        table->slot[slot].sn = keys[i].rec->sn;
+        table->slot[slot].row = keys[i].rec->row;
+        table->slot[slot].book = keys[i].rec->book;
+        table->meta[slot] = slot - home + 1;
+        pos = slot + 1;
+        placed++;
     }
-    if (fclose(datfile) == EOF)
+    __atomic_fetch_add(&table->n, placed, __ATOMIC_RELAXED);
+}
+
+void load_phase_unpack(loader_t *loader, int id)
+{
+    loadchunk_t *chunk = &loader->chunk[id];
+    // Block headers were checked to lie within the file.
+    packblk_t blk;
+    size_t textsize = 0;
+    for (const char *p = chunk->start; p < chunk->end; p += sizeof(packblk_t) + blk.size)
     {
-        error_die("Failed to close file");
+        memcpy(&blk, p, sizeof(packblk_t));
+        chunk->size += blk.n;
+        textsize += blk.namebytes;
     }
-    return 0;
-}
\ No newline at end of file
+    chunk->rec = (loadrec_t *)malloc(sizeof(loadrec_t) * (chunk->size ? chunk->size : 1));
+    chunk->text = (char *)malloc(textsize ? textsize : 1);
+    if (chunk->rec == NULL || chunk->text == NULL)
+    {
+        error_die("Malloc failed");
+    }
+    unsigned int block = chunk->block;
+    char *text = chunk->text;
+    for (const char *p = chunk->start; p < chunk->end; p += sizeof(packblk_t) + blk.size, ++block)
+    {
+        memcpy(&blk, p, sizeof(packblk_t));
+        const unsigned char *payload = (const unsigned char *)p + sizeof(packblk_t);
+        loadrec_t *rec = &chunk->rec[chunk->n];
+        if (crc32c(&blk, offsetof(packblk_t, crc), crc32c(payload, blk.size, 0)) != blk.crc || unpack_block(&blk, payload, rec, text) < 0)
+        {
+            if (chunk->nbad < LOAD_MAX_ERRORS)
+            {
+                chunk->bad[chunk->nbad] = block;
+            }
+            chunk->nbad++;
+            continue;
+        }
+        // Records are numbered in place of lines.
+        for (unsigned int i = 0; i < blk.n; ++i)
+        {
+            rec[i].line = chunk->n + i;
+        }
+        chunk->n += blk.n;
+        text += blk.namebytes;
+    }
+    chunk->lines = chunk->n;
+}
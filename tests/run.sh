@@ -0,0 +1,83 @@
+#!/bin/sh
+# Regression tests, run against a built binary in batch mode:
+#
+#   tests/run.sh ./bookman
+#
+# Each case prints ok or FAIL, the exit status is the number of failures.
+
+bookman=$(cd "$(dirname "${1:-./bookman}")" && pwd)/$(basename "${1:-./bookman}")
+if [ ! -x "$bookman" ]; then
+    echo "usage: $0 BOOKMAN" >&2
+    exit 1
+fi
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+failed=0
+
+pass() { echo "ok   $1"; }
+fail() { echo "FAIL $1"; failed=$((failed + 1)); }
+# same NAME FILE FILE: files are equal.
+same() { if cmp -s "$2" "$3"; then pass "$1"; else fail "$1"; fi; }
+# has NAME FILE TEXT: file holds text.
+has() { if grep -qF -- "$3" "$2"; then pass "$1"; else fail "$1"; fi; }
+# run FILE OPTS... : batch commands from stdin on data file FILE.
+run() { f=$1; shift; "$bookman" -b "$@" -f "$f"; }
+
+# Two packed blocks of 4096 books, names with blanks are quoted.
+awk 'BEGIN { for (i = 1; i <= 8192; i++) printf "%d \"Book %d\" %d %d\n", i, i % 700, i % 97 + 1, i % 13 }' > feed.txt
+
+# Round trips: text, binary and packed files list the same books.
+printf 'import @feed.txt\nqueryall\nwrite text\n' | run t.dat -n > import.out 2>/dev/null
+grep -v '^=' import.out | grep -v imported > want.out
+printf 'queryall\nwrite binary\n' | run t.dat -n 2>/dev/null | grep -v '^=' > text.out
+same "text round trip" want.out text.out
+printf 'queryall\nwrite packed\n' | run t.dat -n 2>/dev/null | grep -v '^=' > binary.out
+same "binary round trip" want.out binary.out
+printf 'queryall\n' | run t.dat -n 2>/dev/null | grep -v '^=' > packed.out
+same "packed round trip" want.out packed.out
+printf 'write binary\n' | run t.dat -n > /dev/null 2>&1
+printf 'queryall\n' | run t.dat -n -P 1 -S 4 2>/dev/null | grep -v '^=' > paged.out
+same "binary out of core" want.out paged.out
+
+# A damaged packed block is reported with its number and SN range.
+printf 'write packed\n' | run t.dat -n > /dev/null 2>&1
+cp t.dat bad.dat
+size=$(wc -c < bad.dat)
+printf 'X' | dd of=bad.dat bs=1 seek=$((size - 100)) conv=notrunc 2> /dev/null
+if printf 'quit\n' | run bad.dat -n > /dev/null 2> bad.err; then
+    fail "corrupt block refused"
+else
+    pass "corrupt block refused"
+fi
+has "corrupt block reported" bad.err "bad.dat: block 1 (SN 4097 to 8192) at offset"
+has "corrupt block checksum" bad.err "checksum mismatch"
+
+# Journal replay, a torn tail is cut off and the entries before it kept.
+printf 'import @feed.txt\nwrite text\nadd 9000 "New book" 5 5\nmod price 1 77\ndel 2\nsell 3 1\n' | run j.dat > /dev/null 2>&1
+printf 'query all 9000\nquery all 1\nquery all 2\nquery all 3\n' > query.txt
+printf '9000 New book 5 5\n=0\n1 Book 1 77 1\n=0\n=-2\n3 Book 3 4 2\n=0\n' > replay.want
+run j.dat < query.txt > replay.out 2>/dev/null
+same "journal replay" replay.want replay.out
+size=$(wc -c < j.dat.journal)
+printf 'torn' >> j.dat.journal
+run j.dat < query.txt > torn.out 2> torn.err
+same "torn journal replay" replay.want torn.out
+has "torn journal reported" torn.err "j.dat.journal: discarding corrupt journal tail at byte $size"
+if [ "$(wc -c < j.dat.journal)" -eq "$size" ]; then
+    pass "torn journal truncated"
+else
+    fail "torn journal truncated"
+fi
+
+# Loader errors name the file line, also past the first of several chunks.
+awk 'BEGIN { print "bookman_dat 0.0.1"; print "L 80000"; for (i = 1; i <= 80000; i++) {
+    if (i == 50000) print "50000 broken"; else printf "%d Book_%d %d %d\n", i, i, i % 97 + 1, i % 13 } }' > malformed.dat
+printf 'quit\n' | run malformed.dat -n -j 4 > /dev/null 2> malformed.err
+has "malformed line number" malformed.err "malformed.dat:50002: malformed entry"
+awk 'BEGIN { print "bookman_dat 0.0.1"; print "L 80000"; for (i = 1; i <= 80000; i++)
+    printf "%d Book_%d %d %d\n", i == 70000 ? 10 : i, i, i % 97 + 1, i % 13 }' > duplicate.dat
+printf 'quit\n' | run duplicate.dat -n -j 4 > /dev/null 2> duplicate.err
+has "duplicate line number" duplicate.err "duplicate.dat:70002: duplicate entry 10, first on line 12"
+
+exit $failed